@@ -15,11 +15,15 @@
 #include <memory>
 #include <optional>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <utility>
 
 namespace
 {
+    // The maximum number of blocks Flush sends at once.
+    const constexpr std::size_t MaxFlushIovCount = 64;
+
     void EnqueueRemainingBytes(WriteBuffer& b, const void* buf, std::size_t len, ssize_t bytesSent, int err)
     {
         if (bytesSent > 0)
@@ -57,6 +61,13 @@ AncillaryDataSocket::AncillaryDataSocket(int sockFd) noexcept
 
 bool AncillaryDataSocket::SendBuffered(const void* buf, std::size_t len, BlockingFlag blocking) noexcept
 {
+    if (sendBuffer_.HasPendingData())
+    {
+        // Keep the order. The data will be sent by the next Flush.
+        sendBuffer_.Enqueue(buf, len);
+        return true;
+    }
+
     ssize_t bytesSent = send_restarting(fd_.Get(), buf, len, MakeSockFlags(blocking));
     int err = errno;
     EnqueueRemainingBytes(sendBuffer_, buf, len, bytesSent, err);
@@ -94,20 +105,29 @@ bool AncillaryDataSocket::SendExactBytesWithFd(const void* buf, std::size_t len,
 }
 
 // Send data in sendBuffer_ until all data is sent or EWOULDBLOCK is returned.
+// Each sendmsg call gathers multiple blocks.
 bool AncillaryDataSocket::Flush(BlockingFlag blocking) noexcept
 {
     while (sendBuffer_.HasPendingData())
     {
-        std::byte* p;
-        std::size_t len;
-        std::tie(p, len) = sendBuffer_.GetPendingData();
-
-        const ssize_t bytesSent = send_restarting(fd_.Get(), p, len, MakeSockFlags(blocking));
-        if (!HandleSendResult(blocking, "send", bytesSent, errno))
+        iovec iov[MaxFlushIovCount];
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = sendBuffer_.GetPendingData(iov, MaxFlushIovCount);
+
+        const ssize_t bytesSent = sendmsg_restarting(fd_.Get(), &msg, MakeSockFlags(blocking));
+        flushSendCount_++;
+        if (!HandleSendResult(blocking, "sendmsg", bytesSent, errno))
         {
             return false;
         }
 
+        if (bytesSent < 0)
+        {
+            // Would block. The remaining data stays in the buffer.
+            return true;
+        }
+
         sendBuffer_.Dequeue(static_cast<std::size_t>(bytesSent));
     }
 
@@ -137,6 +157,11 @@ ssize_t AncillaryDataSocket::Recv(void* buf, std::size_t len, BlockingFlag block
     msg.msg_flags = 0;
 
     const ssize_t receivedBytes = recvmsg_restarting(fd_.Get(), &msg, MakeSockFlags(blocking) | MSG_CMSG_CLOEXEC);
+    return CompleteRecv(&msg, receivedBytes);
+}
+
+ssize_t AncillaryDataSocket::CompleteRecv(const msghdr* pMsg, ssize_t receivedBytes) noexcept
+{
     if (receivedBytes == -1)
     {
         return -1;
@@ -145,7 +170,7 @@ ssize_t AncillaryDataSocket::Recv(void* buf, std::size_t len, BlockingFlag block
     // Store received fds.
     bool shouldShutdown = false;
 
-    for (cmsghdr* pcmsghdr = CMSG_FIRSTHDR(&msg); pcmsghdr != nullptr; pcmsghdr = CMSG_NXTHDR(&msg, pcmsghdr))
+    for (cmsghdr* pcmsghdr = CMSG_FIRSTHDR(pMsg); pcmsghdr != nullptr; pcmsghdr = CMSG_NXTHDR(const_cast<msghdr*>(pMsg), pcmsghdr))
     {
         if (pcmsghdr->cmsg_level != SOL_SOCKET || pcmsghdr->cmsg_type != SCM_RIGHTS)
         {
@@ -3,11 +3,14 @@
 #pragma once
 
 #include "Base.hpp"
+#include "SocketHelpers.hpp"
 #include "UniqueResource.hpp"
 #include "WriteBuffer.hpp"
 #include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <queue>
+#include <sys/socket.h>
 #include <utility>
 
 // Sends/Receives fds via ancillary data on a unix domain socket. Employs a send buffer if nonblocking.
@@ -16,7 +19,7 @@
 class AncillaryDataSocket final
 {
 public:
-    static const constexpr int MaxFdsPerCall = 3;
+    static const constexpr int MaxFdsPerCall = SocketMaxFdsPerCall;
 
     // Owns sockFd.
     AncillaryDataSocket(int sockFd) noexcept;
@@ -28,14 +31,22 @@ public:
     [[nodiscard]] bool SendBufferedWithFd(const void* buf, std::size_t len, const int* fds, std::size_t fdCount, BlockingFlag blocking) noexcept;
     [[nodiscard]] bool Flush(BlockingFlag blocking) noexcept;
     [[nodiscard]] bool HasPendingData() noexcept { return sendBuffer_.HasPendingData(); }
+    // The number of send calls Flush has made so far (for benchmarks).
+    [[nodiscard]] std::uint64_t GetFlushSendCount() const noexcept { return flushSendCount_; }
 
     [[nodiscard]] ssize_t Recv(void* buf, std::size_t len, BlockingFlag blocking) noexcept;
     [[nodiscard]] bool RecvExactBytes(void* buf, std::size_t len) noexcept;
+    // For a recvmsg performed by someone else (Reactor::AddMessageReader): Stores the fds received in *pMsg.
+    // Returns receivedBytes, or -1 and sets errno if the receive failed or the connection has been shut down.
+    [[nodiscard]] ssize_t CompleteRecv(const msghdr* pMsg, ssize_t receivedBytes) noexcept;
 
     [[nodiscard]] int GetFd() const noexcept { return fd_.Get(); }
 
     [[nodiscard]] std::size_t ReceivedFdCount() const noexcept { return receivedFds_.size(); }
 
+    // Closes all received fds that have not been popped.
+    void ClearReceivedFds() noexcept { receivedFds_ = {}; }
+
     [[nodiscard]] std::optional<UniqueFd> PopReceivedFd() noexcept
     {
         if (receivedFds_.size() == 0)
@@ -52,4 +63,5 @@ private:
     UniqueFd fd_;
     std::queue<UniqueFd> receivedFds_;
     WriteBuffer sendBuffer_;
+    std::uint64_t flushSendCount_ = 0;
 };
@@ -0,0 +1,49 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "Arena.hpp"
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+void* Arena::Allocate(std::size_t size, std::size_t alignment)
+{
+    // Chunks are aligned as operator new[] does.
+    assert(alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    if (!chunk_)
+    {
+        // NOTE: Not zero-initialized.
+        chunk_.reset(new std::byte[chunkSize_]);
+    }
+
+    const std::size_t offset = (used_ + alignment - 1) / alignment * alignment;
+    if (offset <= chunkSize_ && size <= chunkSize_ - offset)
+    {
+        used_ = offset + size;
+        return &chunk_[offset];
+    }
+
+    overflowChunks_.push_back(std::unique_ptr<std::byte[]>(new std::byte[size]));
+    overflowSize_ += size;
+    return overflowChunks_.back().get();
+}
+
+void Arena::Reset() noexcept
+{
+    if (!overflowChunks_.empty())
+    {
+        overflowChunks_.clear();
+        const std::size_t newSize = chunkSize_ + overflowSize_;
+        overflowSize_ = 0;
+
+        // Enlarge the chunk so that the next request of this size fits. Allocated lazily by Allocate.
+        if (newSize <= MaxRetainedSize)
+        {
+            chunk_.reset();
+            chunkSize_ = newSize;
+        }
+    }
+
+    used_ = 0;
+}
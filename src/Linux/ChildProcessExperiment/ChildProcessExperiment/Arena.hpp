@@ -0,0 +1,82 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// A bump allocator for objects that live only while a request is being handled.
+// Memory is kept across Reset so that handling requests of a similar size allocates nothing from the heap.
+// Not thread-safe.
+class Arena final
+{
+public:
+    // initialSize: The size of the chunk allocated on the first use.
+    explicit Arena(std::size_t initialSize) noexcept : chunkSize_(initialSize) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Throws std::bad_alloc.
+    [[nodiscard]] void* Allocate(std::size_t size, std::size_t alignment);
+    // Frees everything allocated so far.
+    void Reset() noexcept;
+
+private:
+    // Do not keep more than this after Reset.
+    static const constexpr std::size_t MaxRetainedSize = 1024 * 1024;
+
+    std::unique_ptr<std::byte[]> chunk_;
+    std::size_t chunkSize_;
+    std::size_t used_ = 0;
+    // Allocations that did not fit in chunk_ since the last Reset. chunk_ will be enlarged to hold them next time.
+    std::vector<std::unique_ptr<std::byte[]>> overflowChunks_;
+    std::size_t overflowSize_ = 0;
+};
+
+// Allocates from an Arena, or from the heap if constructed with nullptr.
+// Propagates on move assignment so that a container assigned from another adopts its arena.
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() noexcept = default;
+    explicit ArenaAllocator(Arena* pArena) noexcept : pArena_(pArena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : pArena_(other.GetArena()) {}
+
+    [[nodiscard]] T* allocate(std::size_t n)
+    {
+        if (pArena_ == nullptr)
+        {
+            return std::allocator<T>().allocate(n);
+        }
+
+        return static_cast<T*>(pArena_->Allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        // Memory of an arena is freed all at once by Reset.
+        if (pArena_ == nullptr)
+        {
+            std::allocator<T>().deallocate(p, n);
+        }
+    }
+
+    [[nodiscard]] Arena* GetArena() const noexcept { return pArena_; }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return pArena_ == other.GetArena(); }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept { return pArena_ != other.GetArena(); }
+
+private:
+    Arena* pArena_ = nullptr;
+};
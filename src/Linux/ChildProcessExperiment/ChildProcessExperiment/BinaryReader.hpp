@@ -47,6 +47,12 @@ public:
         return p;
     }
 
+    // NOTE: The returned pointer will become invalid When data becomes invalid.
+    const std::byte* GetBytesAndAdvance(std::size_t bytes)
+    {
+        return GetCurrentAndAdvance(bytes);
+    }
+
 private:
     const std::byte* GetCurrentAndAdvance(std::size_t bytesRead)
     {
@@ -2,36 +2,165 @@
 
 #include "ChildProcessState.hpp"
 #include "Base.hpp"
+#include "Globals.hpp"
+#include "MiscHelpers.hpp"
+#include "Request.hpp"
+#include "ServiceOptions.hpp"
+#include "SlabAllocator.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <utility>
 
-void ChildProcessStateMap::Allocate(int pid, std::uint64_t token)
+std::shared_ptr<ChildProcessState> ChildProcessStateMap::Allocate(int pid, UniqueFd pidFd, std::uint64_t token, std::uint32_t groupTag)
 {
-    const auto pState = std::make_shared<ChildProcessState>(pid, token);
+    assert(!IsServiceAssignedToken(token));
+    const auto pState = std::allocate_shared<ChildProcessState>(SlabAllocator<ChildProcessState>(), pid, std::move(pidFd), token, groupTag);
 
-    const std::lock_guard<std::mutex> guard(mapMutex_);
+    InsertByPid(pState);
 
-    const auto [pidIt, pidInserted] = byPid_.insert(std::pair{pid, pState});
-    const auto [tokenIt, tokenInserted] = byToken_.insert(std::pair{token, pState});
+    {
+        auto& shard = byToken_[GetShardIndex(token)];
+        const std::lock_guard<std::mutex> guard(shard.Mutex);
+        [[maybe_unused]] const auto [tokenIt, tokenInserted] = shard.Map.insert(std::pair{token, pState});
+        assert(tokenInserted);
+    }
+
+    return pState;
+}
+
+std::shared_ptr<ChildProcessState> ChildProcessStateMap::AllocateWithServiceAssignedToken(int pid, UniqueFd pidFd, std::uint32_t groupTag)
+{
+    const auto token = ReserveTokenSlot();
+    const auto pState = std::allocate_shared<ChildProcessState>(SlabAllocator<ChildProcessState>(), pid, std::move(pidFd), token, groupTag);
+
+    InsertByPid(pState);
+
+    {
+        TokenSlot* const pSlot = GetTokenSlot(token);
+        auto& stripe = tokenSlotStripes_[GetTokenSlotIndex(token) % ShardCount];
+        const std::lock_guard<std::mutex> guard(stripe.Mutex);
+        pSlot->State = pState;
+    }
+
+    return pState;
+}
 
-    assert(pidInserted && tokenInserted);
+void ChildProcessStateMap::InsertByPid(const std::shared_ptr<ChildProcessState>& pState)
+{
+    const int pid = pState->GetPid();
+    auto& shard = byPid_[GetShardIndex(static_cast<std::uint64_t>(pid))];
+    const std::lock_guard<std::mutex> guard(shard.Mutex);
+    const auto [pidIt, pidInserted] = shard.Map.insert(std::pair{pid, pState});
+    assert(pidInserted);
     if (!pidInserted)
     {
         FatalErrorAbort("We must not reap a child before we remove its PID from the map.");
     }
 }
 
+std::uint64_t ChildProcessStateMap::ReserveTokenSlot()
+{
+    std::uint32_t index;
+    {
+        const std::lock_guard<std::mutex> guard(freeTokenSlotsMutex_);
+        if (!freeTokenSlots_.empty())
+        {
+            index = freeTokenSlots_.front();
+            freeTokenSlots_.pop_front();
+        }
+        else
+        {
+            if (tokenSlotCount_ == TokenSlotsPerChunk * MaxTokenSlotChunks)
+            {
+                FatalErrorAbort("Too many children.");
+            }
+
+            index = tokenSlotCount_++;
+            if (index % TokenSlotsPerChunk == 0)
+            {
+                tokenSlotChunks_[index / TokenSlotsPerChunk].store(new TokenSlot[TokenSlotsPerChunk](), std::memory_order_release);
+            }
+        }
+    }
+
+    // NOTE: The generation of a free slot is updated before the slot is put back to freeTokenSlots_.
+    const std::uint64_t shardIndex = static_cast<std::uint64_t>(g_ServiceOptions.ShardIndex) << ServiceAssignedTokenShardShift;
+    const std::uint64_t generation = GetTokenSlot(ServiceAssignedTokenBit | shardIndex | index)->Generation;
+    return ServiceAssignedTokenBit | shardIndex | (generation << TokenGenerationShift) | index;
+}
+
+ChildProcessStateMap::TokenSlot* ChildProcessStateMap::GetTokenSlot(std::uint64_t token) const noexcept
+{
+    // A token assigned by another helper shard may have the index and the generation of one of our slots.
+    if (GetShardOfToken(token, MaxShardCount) != g_ServiceOptions.ShardIndex)
+    {
+        return nullptr;
+    }
+
+    const std::size_t index = GetTokenSlotIndex(token);
+    TokenSlot* const pChunk = tokenSlotChunks_[index / TokenSlotsPerChunk].load(std::memory_order_acquire);
+    return pChunk != nullptr ? &pChunk[index % TokenSlotsPerChunk] : nullptr;
+}
+
+std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByServiceAssignedToken(std::uint64_t token) const
+{
+    auto& stripe = tokenSlotStripes_[GetTokenSlotIndex(token) % ShardCount];
+    const std::lock_guard<std::mutex> guard(stripe.Mutex);
+    return GetByServiceAssignedTokenLocked(token);
+}
+
+std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByServiceAssignedTokenLocked(std::uint64_t token) const
+{
+    TokenSlot* const pSlot = GetTokenSlot(token);
+    if (pSlot == nullptr)
+    {
+        return {};
+    }
+
+    const std::uint64_t generation = (token >> TokenGenerationShift) & TokenGenerationMask;
+    if (pSlot->Generation != generation)
+    {
+        return {};
+    }
+    else
+    {
+        return pSlot->State;
+    }
+}
+
+void ChildProcessStateMap::ReleaseTokenSlot(ChildProcessState* pState)
+{
+    const auto token = pState->GetToken();
+    TokenSlot* const pSlot = GetTokenSlot(token);
+    assert(pSlot != nullptr);
+
+    {
+        auto& stripe = tokenSlotStripes_[GetTokenSlotIndex(token) % ShardCount];
+        const std::lock_guard<std::mutex> guard(stripe.Mutex);
+        assert(pSlot->State.get() == pState);
+        pSlot->State.reset();
+        pSlot->Generation = (pSlot->Generation + 1) & TokenGenerationMask;
+    }
+
+    const std::lock_guard<std::mutex> guard(freeTokenSlotsMutex_);
+    freeTokenSlots_.push_back(GetTokenSlotIndex(token));
+}
+
 std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByPid(int pid) const
 {
-    const std::lock_guard<std::mutex> guard(mapMutex_);
-    const auto it = byPid_.find(pid);
-    if (it == byPid_.end())
+    const auto& shard = byPid_[GetShardIndex(static_cast<std::uint64_t>(pid))];
+    const std::lock_guard<std::mutex> guard(shard.Mutex);
+    const auto it = shard.Map.find(pid);
+    if (it == shard.Map.end())
     {
         return {};
     }
@@ -43,9 +172,15 @@ std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByPid(int pid) const
 
 std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByToken(std::uint64_t token) const
 {
-    const std::lock_guard<std::mutex> guard(mapMutex_);
-    const auto it = byToken_.find(token);
-    if (it == byToken_.end())
+    if (IsServiceAssignedToken(token))
+    {
+        return GetByServiceAssignedToken(token);
+    }
+
+    const auto& shard = byToken_[GetShardIndex(token)];
+    const std::lock_guard<std::mutex> guard(shard.Mutex);
+    const auto it = shard.Map.find(token);
+    if (it == shard.Map.end())
     {
         return {};
     }
@@ -55,24 +190,129 @@ std::shared_ptr<ChildProcessState> ChildProcessStateMap::GetByToken(std::uint64_
     }
 }
 
-void ChildProcessStateMap::Delete(ChildProcessState* pState)
+void ChildProcessStateMap::GetByTokens(const std::vector<std::uint64_t>& tokens, std::vector<std::shared_ptr<ChildProcessState>>* pStates) const
+{
+    // Lock i < ShardCount is byToken_[i]; lock ShardCount + i is tokenSlotStripes_[i].
+    const auto getLockIndex = [](std::uint64_t token) {
+        return IsServiceAssignedToken(token)
+            ? ShardCount + static_cast<std::size_t>(GetTokenSlotIndex(token) % ShardCount)
+            : GetShardIndex(token);
+    };
+
+    // Sort the indexes of tokens by lock (counting sort).
+    std::size_t lockBegins[ShardCount * 2 + 1]{};
+    for (const auto token : tokens)
+    {
+        lockBegins[getLockIndex(token) + 1]++;
+    }
+    for (std::size_t i = 0; i < ShardCount * 2; i++)
+    {
+        lockBegins[i + 1] += lockBegins[i];
+    }
+
+    std::vector<std::uint32_t> order(tokens.size());
+    {
+        std::size_t positions[ShardCount * 2];
+        std::copy(lockBegins, lockBegins + ShardCount * 2, positions);
+        for (std::size_t i = 0; i < tokens.size(); i++)
+        {
+            order[positions[getLockIndex(tokens[i])]++] = static_cast<std::uint32_t>(i);
+        }
+    }
+
+    pStates->clear();
+    pStates->resize(tokens.size());
+    for (std::size_t lock = 0; lock < ShardCount * 2; lock++)
+    {
+        if (lockBegins[lock] == lockBegins[lock + 1])
+        {
+            continue;
+        }
+
+        if (lock < ShardCount)
+        {
+            const auto& shard = byToken_[lock];
+            const std::lock_guard<std::mutex> guard(shard.Mutex);
+            for (std::size_t i = lockBegins[lock]; i < lockBegins[lock + 1]; i++)
+            {
+                const auto it = shard.Map.find(tokens[order[i]]);
+                if (it != shard.Map.end())
+                {
+                    (*pStates)[order[i]] = it->second;
+                }
+            }
+        }
+        else
+        {
+            const std::lock_guard<std::mutex> guard(tokenSlotStripes_[lock - ShardCount].Mutex);
+            for (std::size_t i = lockBegins[lock]; i < lockBegins[lock + 1]; i++)
+            {
+                (*pStates)[order[i]] = GetByServiceAssignedTokenLocked(tokens[order[i]]);
+            }
+        }
+    }
+}
+
+template<typename TPredicate>
+void ChildProcessStateMap::CollectByPid(std::vector<std::shared_ptr<ChildProcessState>>* pStates, TPredicate predicate) const
+{
+    // byPid_ holds every child regardless of the kind of its token.
+    for (const auto& shard : byPid_)
+    {
+        const std::lock_guard<std::mutex> guard(shard.Mutex);
+        for (const auto& [pid, pState] : shard.Map)
+        {
+            if (predicate(*pState))
+            {
+                pStates->push_back(pState);
+            }
+        }
+    }
+}
+
+void ChildProcessStateMap::GetAll(std::vector<std::shared_ptr<ChildProcessState>>* pStates) const
+{
+    CollectByPid(pStates, [](const ChildProcessState&) { return true; });
+}
+
+void ChildProcessStateMap::GetByGroupTag(std::uint32_t groupTag, std::vector<std::shared_ptr<ChildProcessState>>* pStates) const
+{
+    CollectByPid(pStates, [groupTag](const ChildProcessState& state) { return state.GetGroupTag() == groupTag; });
+}
+
+std::shared_ptr<ChildProcessState> ChildProcessStateMap::Delete(ChildProcessState* pState)
 {
     const auto pid = pState->GetPid();
     const auto token = pState->GetToken();
 
-    const std::lock_guard<std::mutex> guard(mapMutex_);
-
-    const auto pidIt = byPid_.find(pid);
-    assert(pidIt != byPid_.end());
+    // Remove the token first so that no new signal request finds the element being reaped.
+    if (IsServiceAssignedToken(token))
+    {
+        ReleaseTokenSlot(pState);
+    }
+    else
+    {
+        auto& shard = byToken_[GetShardIndex(token)];
+        const std::lock_guard<std::mutex> guard(shard.Mutex);
+        const auto tokenIt = shard.Map.find(token);
+        assert(tokenIt != shard.Map.end());
+        if (tokenIt != shard.Map.end() && tokenIt->second.get() == pState)
+        {
+            shard.Map.erase(tokenIt);
+        }
+    }
 
-    const auto tokenIt = byToken_.find(token);
-    assert(tokenIt != byToken_.end());
+    auto& shard = byPid_[GetShardIndex(static_cast<std::uint64_t>(pid))];
+    const std::lock_guard<std::mutex> guard(shard.Mutex);
+    const auto pidIt = shard.Map.find(pid);
+    assert(pidIt != shard.Map.end());
 
-    byPid_.erase(pidIt);
-    byToken_.erase(tokenIt);
+    auto pRemovedState = std::move(pidIt->second);
+    shard.Map.erase(pidIt);
+    return pRemovedState;
 }
 
-void ChildProcessState::Reap()
+void ChildProcessState::Reap(struct rusage* pUsage)
 {
     const std::lock_guard<std::mutex> guard(mutex_);
     assert(!isReaped_);
@@ -82,13 +322,23 @@ void ChildProcessState::Reap()
     }
 
     siginfo_t siginfo;
-    int ret = waitid(P_PID, pid_, &siginfo, WEXITED | WNOHANG);
+    int ret = -1;
+    if (pidFd_.IsValid())
+    {
+        ret = sys_waitid(IdTypePidFd, static_cast<id_t>(pidFd_.Get()), &siginfo, WEXITED | WNOHANG, pUsage);
+    }
+    if (ret < 0 && (!pidFd_.IsValid() || errno == EINVAL))
+    {
+        // No pidfd, or the kernel supports pidfds but not P_PIDFD (5.3).
+        ret = sys_waitid(P_PID, pid_, &siginfo, WEXITED | WNOHANG, pUsage);
+    }
     if (ret < 0)
     {
         FatalErrorAbort(errno, "waitpid");
     }
 
     isReaped_ = true;
+    pidFd_.Reset();
 }
 
 bool ChildProcessState::SendSignal(int sig)
@@ -2,35 +2,55 @@
 
 #pragma once
 
+#include "MiscHelpers.hpp"
+#include "Request.hpp"
+#include "UniqueResource.hpp"
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <poll.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
 
 class ChildProcessState final
 {
 public:
-    ChildProcessState(int pid, std::uint64_t token)
-        : token_(token), pid_(pid), isReaped_(false) {}
+    ChildProcessState(int pid, UniqueFd pidFd, std::uint64_t token, std::uint32_t groupTag)
+        : token_(token), pid_(pid), groupTag_(groupTag), registrationTime_(GetMonotonicTimeNanoseconds()), pidFd_(std::move(pidFd)), isReaped_(false) {}
 
     std::uint64_t GetToken() const { return token_; }
     int GetPid() const { return pid_; }
-    void Reap();
+    // RequestFlagsGroupTag
+    std::uint32_t GetGroupTag() const { return groupTag_; }
+    // GetMonotonicTimeNanoseconds when the child was registered (just after it was spawned).
+    std::uint64_t GetRegistrationTime() const { return registrationTime_; }
+    // Returns -1 if the kernel does not support pidfds. Valid until Reap.
+    int GetPidFd() const { return pidFd_.Get(); }
+    // pUsage: If not nullptr, receives the resource usage of the child.
+    void Reap(struct rusage* pUsage = nullptr);
     [[nodiscard]] bool SendSignal(int sig);
 
 private:
     // Serializes all accesses to the process (signal, reap, etc.).
     // NOTE: We must not access a process after we reap it. Otherwise we are vulnerable to PID recycling.
+    //       A pidfd does not help here: we signal the whole process group with kill(-pid), and pidfd_send_signal
+    //       cannot target a process group. The group ID is safe to use only while we keep the leader unreaped.
     std::mutex mutex_;
     const std::uint64_t token_;
     const int pid_;
+    const std::uint32_t groupTag_;
+    const std::uint64_t registrationTime_;
+    UniqueFd pidFd_;
     bool isReaped_;
 };
 
@@ -42,14 +62,84 @@ private:
 class ChildProcessStateMap final
 {
 public:
-    void Allocate(int pid, std::uint64_t token);
+    std::shared_ptr<ChildProcessState> Allocate(int pid, UniqueFd pidFd, std::uint64_t token, std::uint32_t groupTag);
+    // Allocates an element with a new service-assigned token (see IsServiceAssignedToken).
+    std::shared_ptr<ChildProcessState> AllocateWithServiceAssignedToken(int pid, UniqueFd pidFd, std::uint32_t groupTag);
     [[nodiscard]] std::shared_ptr<ChildProcessState> GetByPid(int pid) const; // Used by the reaping process only.
     [[nodiscard]] std::shared_ptr<ChildProcessState> GetByToken(std::uint64_t token) const;
-    void Delete(ChildProcessState* pState);
+    // Looks up tokens locking each shard (or stripe) once. (*pStates)[i] is nullptr if tokens[i] is not found.
+    void GetByTokens(const std::vector<std::uint64_t>& tokens, std::vector<std::shared_ptr<ChildProcessState>>* pStates) const;
+    // Append the elements of all children (or of the children with groupTag) to pStates, locking each shard once.
+    void GetAll(std::vector<std::shared_ptr<ChildProcessState>>* pStates) const;
+    void GetByGroupTag(std::uint32_t groupTag, std::vector<std::shared_ptr<ChildProcessState>>* pStates) const;
+    // Returns the removed element so that the caller can keep it alive until it reaps the child.
+    std::shared_ptr<ChildProcessState> Delete(ChildProcessState* pState);
 
 private:
-    // Serializes lookup, insertion and removal.
-    mutable std::mutex mapMutex_;
-    std::unordered_map<int, std::shared_ptr<ChildProcessState>> byPid_;
-    std::unordered_map<std::uint64_t, std::shared_ptr<ChildProcessState>> byToken_;
+    // Both indexes are split into shards with their own locks so that spawns (Allocate), signals (GetByToken)
+    // and the reaper (GetByPid, Delete) rarely contend. An operation locks one shard of one index at a time.
+    static const constexpr std::size_t ShardCount = 16;
+    static const constexpr std::size_t CacheLineSize = 64;
+
+    template<typename TKey>
+    struct alignas(CacheLineSize) Shard final
+    {
+        mutable std::mutex Mutex;
+        std::unordered_map<TKey, std::shared_ptr<ChildProcessState>> Map;
+    };
+
+    // Service-assigned tokens index into an array of slots instead of byToken_.
+    // A token holds the slot index in bits 0-21, the generation of the slot in bits 22-55
+    // and the index of this helper shard in bits 56-62.
+    // A stale token matches a reused slot only after the slot has been reused 2^34 times.
+    struct TokenSlot final
+    {
+        std::uint64_t Generation;
+        std::shared_ptr<ChildProcessState> State;
+    };
+
+    struct alignas(CacheLineSize) TokenSlotStripe final
+    {
+        mutable std::mutex Mutex;
+    };
+
+    static const constexpr int TokenGenerationShift = 22;
+    static const constexpr std::uint64_t TokenSlotIndexMask = (1ull << TokenGenerationShift) - 1;
+    static const constexpr std::uint64_t TokenGenerationMask = (1ull << (ServiceAssignedTokenShardShift - TokenGenerationShift)) - 1;
+    static const constexpr std::size_t TokenSlotsPerChunk = 4096;
+    // Enough for every PID (PID_MAX_LIMIT is 2^22); a slot is freed before its child is reaped.
+    static const constexpr std::size_t MaxTokenSlotChunks = 1024;
+    static_assert(TokenSlotsPerChunk * MaxTokenSlotChunks == TokenSlotIndexMask + 1);
+
+    void InsertByPid(const std::shared_ptr<ChildProcessState>& pState);
+    [[nodiscard]] static std::uint32_t GetTokenSlotIndex(std::uint64_t token) noexcept
+    {
+        return static_cast<std::uint32_t>(token & TokenSlotIndexMask);
+    }
+    [[nodiscard]] std::uint64_t ReserveTokenSlot();
+    [[nodiscard]] TokenSlot* GetTokenSlot(std::uint64_t token) const noexcept;
+    [[nodiscard]] std::shared_ptr<ChildProcessState> GetByServiceAssignedToken(std::uint64_t token) const;
+    // Requires the stripe of token to be locked.
+    [[nodiscard]] std::shared_ptr<ChildProcessState> GetByServiceAssignedTokenLocked(std::uint64_t token) const;
+    template<typename TPredicate>
+    void CollectByPid(std::vector<std::shared_ptr<ChildProcessState>>* pStates, TPredicate predicate) const;
+    void ReleaseTokenSlot(ChildProcessState* pState);
+
+    [[nodiscard]] static std::size_t GetShardIndex(std::uint64_t key) noexcept
+    {
+        // Fibonacci hashing; PIDs and tokens tend to be sequential.
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> 60);
+    }
+
+    Shard<int> byPid_[ShardCount];
+    Shard<std::uint64_t> byToken_[ShardCount];
+
+    // Chunks are allocated on demand and never freed so that lookups need no lock to find a slot.
+    std::atomic<TokenSlot*> tokenSlotChunks_[MaxTokenSlotChunks]{};
+    // Slot i is guarded by tokenSlotStripes_[i % ShardCount].
+    TokenSlotStripe tokenSlotStripes_[ShardCount];
+    std::mutex freeTokenSlotsMutex_;
+    // FIFO so that a slot is reused as late as possible.
+    std::deque<std::uint32_t> freeTokenSlots_;
+    std::uint32_t tokenSlotCount_ = 0;
 };
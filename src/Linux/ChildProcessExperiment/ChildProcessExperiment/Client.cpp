@@ -4,14 +4,18 @@
 #include "AncillaryDataSocket.hpp"
 #include "Base.hpp"
 #include "BinaryWriter.hpp"
+#include "Globals.hpp"
+#include "JobGroup.hpp"
 #include "MiscHelpers.hpp"
 #include "Request.hpp"
 #include "Service.hpp"
+#include "ServiceOptions.hpp"
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <memory>
+#include <optional>
 #include <pthread.h>
 #include <stdexcept>
 #include <vector>
@@ -19,7 +23,7 @@
 
 namespace
 {
-    void WriteStringArray(BinaryWriter& bw, const std::vector<const char*>& data)
+    void WriteStringArray(BinaryWriter& bw, const StringArray& data)
     {
         if (data.size() > MaxStringArrayCount)
         {
@@ -42,38 +46,486 @@ namespace
         bw.WriteString(r.ExecutablePath);
         WriteStringArray(bw, r.Argv);
         WriteStringArray(bw, r.Envp);
+        if (r.Flags & RequestFlagsEnvironmentBlock)
+        {
+            bw.Write(r.EnvironmentId);
+        }
+        if (r.Flags & RequestFlagsDeadline)
+        {
+            bw.Write(r.DeadlineMilliseconds);
+            bw.Write(r.GracePeriodMilliseconds);
+        }
+        if (r.Flags & RequestFlagsGroupTag)
+        {
+            bw.Write(r.GroupTag);
+        }
+        if (r.Flags & RequestFlagsJobGroup)
+        {
+            bw.Write(r.JobGroupId);
+        }
         return bw.Detach();
     }
+
+    // With --shard=INDEX/COUNT, a spawn request must carry a token that GetShardOfToken routes to this shard.
+    // Returns the n-th such token (n itself without shards).
+    std::uint64_t GetShardToken(std::uint64_t n)
+    {
+        for (std::uint64_t token = 0, found = 0;; token++)
+        {
+            if (GetShardOfToken(token, g_ServiceOptions.ShardCount) == g_ServiceOptions.ShardIndex && found++ == n)
+            {
+                return token;
+            }
+        }
+    }
+
+    // environmentId: If specified, uses the registered environment block instead of sending environ.
+    SpawnProcessRequest MakeEchoRequest(std::uint64_t token, char* arg1, std::optional<std::uint32_t> environmentId = std::nullopt)
+    {
+        SpawnProcessRequest r{};
+        r.Token = GetShardToken(token);
+        r.Flags = 0;
+        r.ExecutablePath = "/bin/echo";
+        r.Argv.push_back(r.ExecutablePath);
+        r.Argv.push_back(arg1);
+        r.Argv.push_back(nullptr);
+        if (environmentId)
+        {
+            // No overlay.
+            r.Flags |= RequestFlagsEnvironmentBlock;
+            r.EnvironmentId = *environmentId;
+        }
+        else
+        {
+            for (const char* const* p = environ; *p != nullptr; p++)
+            {
+                r.Envp.push_back(*p);
+            }
+            r.Envp.push_back(nullptr);
+        }
+        return r;
+    }
+
+    SpawnProcessRequest MakeSleepRequest(std::uint64_t token, char* seconds)
+    {
+        SpawnProcessRequest r{};
+        r.Token = GetShardToken(token);
+        r.Flags = 0;
+        r.ExecutablePath = "/bin/sleep";
+        r.Argv.push_back(r.ExecutablePath);
+        r.Argv.push_back(seconds);
+        r.Argv.push_back(nullptr);
+        r.Envp.push_back(nullptr);
+        return r;
+    }
+
+    // Registers environ to the subchannel. On success, returns the ID.
+    std::optional<std::uint32_t> RegisterEnvironment(AncillaryDataSocket* pSubchannel)
+    {
+        StringArray envp;
+        for (const char* const* p = environ; *p != nullptr; p++)
+        {
+            envp.push_back(*p);
+        }
+
+        BinaryWriter bw;
+        bw.Write(std::uint32_t{0});
+        WriteStringArray(bw, envp);
+
+        const auto message = bw.Detach();
+        const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+        const std::uint32_t header[2]{static_cast<std::uint32_t>(RequestCommand::RegisterEnvironment), messageBodyLength};
+        std::int32_t response[2];
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || !pSubchannel->SendExactBytes(&message[0], messageBodyLength)
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            perror("client: RegisterEnvironment");
+            return std::nullopt;
+        }
+
+        if (response[0] != 0)
+        {
+            std::printf("client: RegisterEnvironment failed: %d\n", response[0]);
+            return std::nullopt;
+        }
+
+        return static_cast<std::uint32_t>(response[1]);
+    }
+
+    void PrintChildExitNotification(const std::byte* p)
+    {
+        if (g_ServiceOptions.ExitNotifications == ExitNotificationFormat::Extended)
+        {
+            ExtendedChildExitNotification n;
+            std::memcpy(&n, p, sizeof(n));
+            std::printf("client: child %d exited: %u (user %llu us, sys %llu us, maxrss %llu KiB, wall %llu us)\n",
+                n.ProcessID,
+                n.Status,
+                static_cast<unsigned long long>(n.UserTimeMicroseconds),
+                static_cast<unsigned long long>(n.SystemTimeMicroseconds),
+                static_cast<unsigned long long>(n.MaxRssKilobytes),
+                static_cast<unsigned long long>(n.WallTimeMicroseconds));
+        }
+        else
+        {
+            ChildExitNotification n;
+            std::memcpy(&n, p, sizeof(n));
+            std::printf("client: child %d exited: %u\n", n.ProcessID, n.Status);
+        }
+    }
+
+    // The service sends the notifications of one reap pass together; receive as many as available with each recv.
+    [[nodiscard]] bool RecvChildExitNotifications(AncillaryDataSocket* pMainChannel, std::size_t count)
+    {
+        const std::size_t MaxBatchCount = 64;
+        const std::size_t notificationSize = g_ServiceOptions.ExitNotifications == ExitNotificationFormat::Extended
+            ? sizeof(ExtendedChildExitNotification)
+            : sizeof(ChildExitNotification);
+        std::byte batch[MaxBatchCount * sizeof(ExtendedChildExitNotification)];
+        std::size_t bytesReceived = 0;
+        std::size_t notificationsParsed = 0;
+        while (notificationsParsed < count)
+        {
+            const std::size_t bytesToReceive = std::min(count - notificationsParsed, MaxBatchCount) * notificationSize;
+            const ssize_t n = pMainChannel->Recv(batch + bytesReceived, bytesToReceive - bytesReceived, BlockingFlag::Blocking);
+            if (n <= 0)
+            {
+                perror("client: recv");
+                return false;
+            }
+
+            bytesReceived += static_cast<std::size_t>(n);
+
+            // Parse whole notifications and keep a partial one for the next recv.
+            const std::size_t wholeCount = bytesReceived / notificationSize;
+            for (std::size_t i = 0; i < wholeCount; i++)
+            {
+                PrintChildExitNotification(batch + i * notificationSize);
+            }
+
+            notificationsParsed += wholeCount;
+            bytesReceived -= wholeCount * notificationSize;
+            std::memmove(batch, batch + wholeCount * notificationSize, bytesReceived);
+        }
+
+        return true;
+    }
+
+    // Spawns processes with one request.
+    int DoBatchRequest(AncillaryDataSocket* pMainChannel, AncillaryDataSocket* pSubchannel)
+    {
+        const std::uint32_t EntryCount = 3;
+        char args[EntryCount][7];
+
+        BinaryWriter bw;
+        bw.Write(EntryCount);
+        for (std::uint32_t i = 0; i < EntryCount; i++)
+        {
+            std::strcpy(args[i], "piyo A");
+            args[i][5] += i;
+
+            const auto entry = SerializeRequest(MakeEchoRequest(461 + i, args[i]));
+            bw.Write(static_cast<std::uint32_t>(entry.size()));
+            bw.Write(entry.data(), entry.size());
+        }
+
+        const auto message = bw.Detach();
+        const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+        const std::uint32_t header[2]{static_cast<std::uint32_t>(RequestCommand::SpawnProcessBatch), messageBodyLength};
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || !pSubchannel->SendExactBytes(&message[0], messageBodyLength))
+        {
+            perror("client: send");
+            return 1;
+        }
+
+        // Error code, count, (error code, pid) * count
+        std::int32_t response[2 + EntryCount * 2];
+        if (!pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            perror("client: recv");
+            return 1;
+        }
+
+        for (std::uint32_t i = 0; i < EntryCount; i++)
+        {
+            std::printf("client: got batch response %u: %d, %d\n", i, response[2 + i * 2], response[3 + i * 2]);
+        }
+
+        if (!RecvChildExitNotifications(pMainChannel, EntryCount))
+        {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Spawns a process that outlives its deadline. The service terminates it.
+    int DoDeadlineRequest(AncillaryDataSocket* pMainChannel, AncillaryDataSocket* pSubchannel)
+    {
+        char arg1[] = "10";
+        SpawnProcessRequest r = MakeSleepRequest(464, arg1);
+        r.Flags |= RequestFlagsDeadline;
+        r.DeadlineMilliseconds = 50;
+        r.GracePeriodMilliseconds = 50;
+
+        auto message = SerializeRequest(r);
+        const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+        const std::uint32_t header[2]{0, messageBodyLength};
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || !pSubchannel->SendExactBytes(&message[0], messageBodyLength))
+        {
+            perror("client: send");
+            return 1;
+        }
+
+        std::int32_t response[2];
+        if (!pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            perror("client: recv");
+            return 1;
+        }
+
+        std::printf("client: got deadline response: %d, %d\n", response[0], response[1]);
+
+        // Expect -15 (SIGTERM).
+        if (!RecvChildExitNotifications(pMainChannel, 1))
+        {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Spawns processes with a group tag and terminates them with one request.
+    int DoSignalBulkRequest(AncillaryDataSocket* pMainChannel, AncillaryDataSocket* pSubchannel)
+    {
+        const std::uint32_t ProcessCount = 3;
+        const std::uint32_t GroupTag = 7;
+        char arg1[] = "10";
+
+        for (std::uint32_t i = 0; i < ProcessCount; i++)
+        {
+            SpawnProcessRequest r = MakeSleepRequest(465 + i, arg1);
+            r.Flags |= RequestFlagsGroupTag;
+            r.GroupTag = GroupTag;
+
+            auto message = SerializeRequest(r);
+            const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+            const std::uint32_t header[2]{0, messageBodyLength};
+            std::int32_t response[2];
+            if (!pSubchannel->SendExactBytes(header, sizeof(header))
+                || !pSubchannel->SendExactBytes(&message[0], messageBodyLength)
+                || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+            {
+                perror("client: SpawnProcess");
+                return 1;
+            }
+        }
+
+        BinaryWriter bw;
+        bw.Write(static_cast<std::uint32_t>(AbstractSignal::Termination));
+        bw.Write(static_cast<std::uint32_t>(SendSignalBulkTarget::GroupTag));
+        bw.Write(GroupTag);
+
+        const auto message = bw.Detach();
+        const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+        const std::uint32_t header[2]{static_cast<std::uint32_t>(RequestCommand::SendSignalBulk), messageBodyLength};
+        // Error code, count, (error code, pid, token) * count
+        std::int32_t response[2 + ProcessCount * 4];
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || !pSubchannel->SendExactBytes(&message[0], messageBodyLength)
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            perror("client: SendSignalBulk");
+            return 1;
+        }
+
+        for (std::uint32_t i = 0; i < ProcessCount; i++)
+        {
+            std::printf("client: got signal bulk response %u: %d, %d\n", i, response[2 + i * 4], response[3 + i * 4]);
+        }
+
+        if (!RecvChildExitNotifications(pMainChannel, ProcessCount))
+        {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Sends a job group request. Returns the error code and stores the data to *pData.
+    // pStats: GetJobGroupStats only. Receives the stats on success.
+    [[nodiscard]] std::optional<std::int32_t> SendJobGroupRequest(
+        AncillaryDataSocket* pSubchannel, RequestCommand command, const std::vector<std::uint32_t>& body, std::int32_t* pData, JobGroupStats* pStats = nullptr)
+    {
+        const auto messageBodyLength = static_cast<std::uint32_t>(body.size() * sizeof(std::uint32_t));
+        const std::uint32_t header[2]{static_cast<std::uint32_t>(command), messageBodyLength};
+        std::int32_t response[2];
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || (messageBodyLength != 0 && !pSubchannel->SendExactBytes(body.data(), messageBodyLength))
+            || !pSubchannel->RecvExactBytes(response, sizeof(response))
+            || (pStats != nullptr && response[0] == 0 && !pSubchannel->RecvExactBytes(pStats, sizeof(*pStats))))
+        {
+            perror("client: job group request");
+            return std::nullopt;
+        }
+
+        *pData = response[1];
+        return response[0];
+    }
+
+    // Spawns a process tree into a job group, one of which leaves the process group, and kills the whole tree.
+    int DoJobGroupRequests(AncillaryDataSocket* pMainChannel, AncillaryDataSocket* pSubchannel)
+    {
+        std::int32_t groupId = 0;
+        const auto maybeCreateError = SendJobGroupRequest(pSubchannel, RequestCommand::CreateJobGroup, {}, &groupId);
+        if (!maybeCreateError)
+        {
+            return 1;
+        }
+        else if (*maybeCreateError != 0)
+        {
+            // Not supported in this environment.
+            std::printf("client: CreateJobGroup failed: %d\n", *maybeCreateError);
+            return 0;
+        }
+
+        char arg1[] = "-c";
+        char arg2[] = "setsid sleep 10 & sleep 10";
+        SpawnProcessRequest r{};
+        r.Token = GetShardToken(468);
+        r.Flags = RequestFlagsJobGroup;
+        r.JobGroupId = static_cast<std::uint32_t>(groupId);
+        r.ExecutablePath = "/bin/sh";
+        r.Argv.push_back(r.ExecutablePath);
+        r.Argv.push_back(arg1);
+        r.Argv.push_back(arg2);
+        r.Argv.push_back(nullptr);
+        r.Envp.push_back(nullptr);
+
+        auto message = SerializeRequest(r);
+        const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+        const std::uint32_t header[2]{0, messageBodyLength};
+        std::int32_t response[2];
+        if (!pSubchannel->SendExactBytes(header, sizeof(header))
+            || !pSubchannel->SendExactBytes(&message[0], messageBodyLength)
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            perror("client: SpawnProcess");
+            return 1;
+        }
+
+        std::printf("client: got job group response: %d, %d\n", response[0], response[1]);
+
+        const auto id = static_cast<std::uint32_t>(groupId);
+        std::int32_t reserved;
+        JobGroupStats s{};
+        const auto maybeFreezeError = SendJobGroupRequest(pSubchannel, RequestCommand::FreezeJobGroup, {id, 1}, &reserved);
+        const auto maybeStatsError = SendJobGroupRequest(pSubchannel, RequestCommand::GetJobGroupStats, {id}, &reserved, &s);
+        const auto maybeKillError = SendJobGroupRequest(pSubchannel, RequestCommand::KillJobGroup, {id}, &reserved);
+        if (!maybeFreezeError || !maybeStatsError || !maybeKillError)
+        {
+            return 1;
+        }
+
+        std::printf("client: job group: freeze %d, stats %d (usage %llu us, flags %x), kill %d\n",
+            *maybeFreezeError,
+            *maybeStatsError,
+            static_cast<unsigned long long>(s.UsageMicroseconds),
+            s.Flags,
+            *maybeKillError);
+
+        if (!RecvChildExitNotifications(pMainChannel, 1))
+        {
+            return 1;
+        }
+
+        // The killed descendants leave the group asynchronously.
+        for (int i = 0; i < 100; i++)
+        {
+            const auto maybeDeleteError = SendJobGroupRequest(pSubchannel, RequestCommand::DeleteJobGroup, {id}, &reserved);
+            if (!maybeDeleteError)
+            {
+                return 1;
+            }
+            else if (*maybeDeleteError != EBUSY)
+            {
+                std::printf("client: job group: delete %d\n", *maybeDeleteError);
+                break;
+            }
+
+            usleep(10 * 1000);
+        }
+
+        return 0;
+    }
+
+    // Sends all requests before receiving any response. Responses may arrive out of order.
+    int DoPipelinedRequests(AncillaryDataSocket* pMainChannel, AncillaryDataSocket* pSubchannel)
+    {
+        const std::uint32_t RequestCount = 3;
+        char args[RequestCount][7];
+
+        for (std::uint32_t i = 0; i < RequestCount; i++)
+        {
+            std::strcpy(args[i], "fuga A");
+            args[i][5] += i;
+
+            auto message = SerializeRequest(MakeEchoRequest(458 + i, args[i]));
+            const auto messageBodyLength = static_cast<std::uint32_t>(message.size());
+            const std::uint32_t header[3]{0, messageBodyLength, i};
+            if (!pSubchannel->SendExactBytes(header, sizeof(header))
+                || !pSubchannel->SendExactBytes(&message[0], messageBodyLength))
+            {
+                perror("client: send");
+                return 1;
+            }
+        }
+
+        for (std::uint32_t i = 0; i < RequestCount; i++)
+        {
+            // Request ID, response length, error code, pid
+            std::int32_t response[4];
+            if (!pSubchannel->RecvExactBytes(response, sizeof(response)))
+            {
+                perror("client: recv");
+                return 1;
+            }
+
+            std::printf("client: got response to request %d: %d, %d\n", response[0], response[2], response[3]);
+        }
+
+        if (!RecvChildExitNotifications(pMainChannel, RequestCount))
+        {
+            return 1;
+        }
+
+        return 0;
+    }
 } // namespace
 
-AncillaryDataSocket CreateSubchannel(AncillaryDataSocket* pMainChannel);
+AncillaryDataSocket CreateSubchannel(AncillaryDataSocket* pMainChannel, std::uint8_t flags);
 
 int DoClient(UniqueFd sockFd)
 {
     try
     {
         auto pMainChannel = std::make_unique<AncillaryDataSocket>(std::move(sockFd));
-        auto localSock = CreateSubchannel(pMainChannel.get());
+        auto localSock = CreateSubchannel(pMainChannel.get(), 0);
+        const auto maybeEnvironmentId = RegisterEnvironment(&localSock);
+        if (!maybeEnvironmentId)
+        {
+            return 1;
+        }
 
         for (int i = 0; i < 3; i++)
         {
             char arg1[] = "hoge A";
             arg1[5] += i;
 
-            SpawnProcessRequest r{};
-            r.Token = 457;
-            r.Flags = 0;
-            r.ExecutablePath = "/bin/echo";
-            r.Argv.push_back(r.ExecutablePath);
-            r.Argv.push_back(arg1);
-            r.Argv.push_back(nullptr);
-            for (const char* const* p = environ; *p != nullptr; p++)
-            {
-                r.Envp.push_back(*p);
-            }
-            r.Envp.push_back(nullptr);
-
-            auto message = SerializeRequest(r);
+            auto message = SerializeRequest(MakeEchoRequest(457, arg1, maybeEnvironmentId));
             if (message.size() > MaxMessageLength)
             {
                 std::puts("client: message too long.");
@@ -98,17 +550,34 @@ int DoClient(UniqueFd sockFd)
 
             std::printf("client: got response: %d, %d\n", response[0], response[1]);
 
-            ChildExitNotification data;
-            if (!pMainChannel->RecvExactBytes(&data, sizeof(data)))
+            if (!RecvChildExitNotifications(pMainChannel.get(), 1))
             {
-                perror("client: recv");
                 return 1;
             }
+        }
 
-            std::printf("client: child %d exited: %u\n", data.ProcessID, data.Status);
+        if (DoBatchRequest(pMainChannel.get(), &localSock) != 0)
+        {
+            return 1;
         }
 
-        return 0;
+        if (DoDeadlineRequest(pMainChannel.get(), &localSock) != 0)
+        {
+            return 1;
+        }
+
+        if (DoSignalBulkRequest(pMainChannel.get(), &localSock) != 0)
+        {
+            return 1;
+        }
+
+        if (DoJobGroupRequests(pMainChannel.get(), &localSock) != 0)
+        {
+            return 1;
+        }
+
+        auto pipelinedSock = CreateSubchannel(pMainChannel.get(), SubchannelFlagsPipelined);
+        return DoPipelinedRequests(pMainChannel.get(), &pipelinedSock);
     }
     catch (const std::exception& exn)
     {
@@ -117,7 +586,7 @@ int DoClient(UniqueFd sockFd)
     }
 }
 
-AncillaryDataSocket CreateSubchannel(AncillaryDataSocket* pMainChannel)
+AncillaryDataSocket CreateSubchannel(AncillaryDataSocket* pMainChannel, std::uint8_t flags)
 {
     auto maybeSockerPair = CreateUnixStreamSocketPair();
     if (!maybeSockerPair)
@@ -130,7 +599,7 @@ AncillaryDataSocket CreateSubchannel(AncillaryDataSocket* pMainChannel)
     auto remoteSock = std::move((*maybeSockerPair)[1]);
 
     const int fds[1]{remoteSock.Get()};
-    if (!pMainChannel->SendExactBytesWithFd("", 1, fds, 1))
+    if (!pMainChannel->SendExactBytesWithFd(&flags, 1, fds, 1))
     {
         perror("client: SendExactBytesWithFd");
         throw MyException("CreateSubchannel");
@@ -0,0 +1,118 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "DeadlineScheduler.hpp"
+#include "Base.hpp"
+#include "ChildProcessState.hpp"
+#include "MiscHelpers.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    const std::uint64_t NanosecondsPerTick = 1000000;
+
+    [[nodiscard]] std::uint64_t GetCurrentTick() noexcept
+    {
+        return GetMonotonicTimeNanoseconds() / NanosecondsPerTick;
+    }
+} // namespace
+
+DeadlineScheduler::DeadlineScheduler()
+    : timerFd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)), wheel_(GetCurrentTick())
+{
+    if (!timerFd_.IsValid())
+    {
+        FatalErrorAbort(errno, "timerfd_create");
+    }
+}
+
+void DeadlineScheduler::Schedule(const std::shared_ptr<ChildProcessState>& pState, std::uint32_t deadlineMilliseconds, std::uint32_t gracePeriodMilliseconds)
+{
+    // Round up so that the timer never fires before the deadline.
+    const std::uint64_t deadline = pState->GetRegistrationTime() + std::uint64_t{deadlineMilliseconds} * NanosecondsPerTick;
+    const std::uint64_t expiry = (deadline + NanosecondsPerTick - 1) / NanosecondsPerTick;
+
+    const std::lock_guard<std::mutex> guard(mutex_);
+    wheel_.Add(expiry, Timer{pState, DeadlinePhase::Terminate, gracePeriodMilliseconds});
+    UpdateTimerFd();
+}
+
+void DeadlineScheduler::HandleExpiration()
+{
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        const std::uint64_t now = GetCurrentTick();
+        wheel_.Advance(now, &expired_);
+
+        for (const auto& timer : expired_)
+        {
+            if (timer.Phase == DeadlinePhase::Terminate && timer.GracePeriodMilliseconds != 0)
+            {
+                wheel_.Add(now + timer.GracePeriodMilliseconds, Timer{timer.State, DeadlinePhase::Kill, 0});
+            }
+        }
+
+        // A timerfd fires only once per arming.
+        armedTick_.reset();
+        UpdateTimerFd();
+    }
+
+    // Signal outside the lock. SendSignal is a no-op once the child has been reaped.
+    for (const auto& timer : expired_)
+    {
+        const auto pState = timer.State.lock();
+        if (!pState)
+        {
+            continue;
+        }
+
+        if (timer.Phase == DeadlinePhase::Terminate && timer.GracePeriodMilliseconds != 0)
+        {
+            if (pState->SendSignal(SIGTERM))
+            {
+                // Also send SIGCONT to ensure termination.
+                static_cast<void>(pState->SendSignal(SIGCONT));
+            }
+        }
+        else
+        {
+            static_cast<void>(pState->SendSignal(SIGKILL));
+        }
+    }
+
+    expired_.clear();
+}
+
+void DeadlineScheduler::UpdateTimerFd()
+{
+    const auto maybeNext = wheel_.GetNextEventTime();
+    if (!maybeNext || (armedTick_ && *armedTick_ <= *maybeNext))
+    {
+        // Already armed early enough. A spurious wakeup just re-arms the timerfd.
+        return;
+    }
+
+    itimerspec spec{};
+    spec.it_value.tv_sec = static_cast<time_t>(*maybeNext / 1000);
+    spec.it_value.tv_nsec = static_cast<long>(*maybeNext % 1000 * NanosecondsPerTick);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    {
+        // Zero would disarm the timerfd.
+        spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(timerFd_.Get(), TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+    {
+        FatalErrorAbort(errno, "timerfd_settime");
+    }
+
+    armedTick_ = *maybeNext;
+}
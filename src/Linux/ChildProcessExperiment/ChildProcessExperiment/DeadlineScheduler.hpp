@@ -0,0 +1,59 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "TimerWheel.hpp"
+#include "UniqueResource.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+class ChildProcessState;
+
+// Enforces RequestFlagsDeadline. Timers are kept in a TimerWheel with 1ms ticks and fire through a timerfd
+// that the service loop polls (see GetFd). On the deadline, the child is sent SIGTERM (plus SIGCONT) and then
+// SIGKILL after the grace period.
+class DeadlineScheduler final
+{
+public:
+    DeadlineScheduler();
+
+    DeadlineScheduler(const DeadlineScheduler&) = delete;
+    DeadlineScheduler& operator=(const DeadlineScheduler&) = delete;
+
+    // A nonblocking timerfd. Call HandleExpiration after reading its expiration count.
+    [[nodiscard]] int GetFd() const noexcept { return timerFd_.Get(); }
+
+    // deadlineMilliseconds: From the registration of the child. Thread-safe.
+    void Schedule(const std::shared_ptr<ChildProcessState>& pState, std::uint32_t deadlineMilliseconds, std::uint32_t gracePeriodMilliseconds);
+    // Sends the signals of expired timers and rearms the timerfd.
+    void HandleExpiration();
+
+private:
+    enum class DeadlinePhase
+    {
+        Terminate,
+        Kill,
+    };
+
+    struct Timer final
+    {
+        // NOTE: Does not keep the element alive. A reaped child needs no signal, and the token may be reused.
+        std::weak_ptr<ChildProcessState> State;
+        DeadlinePhase Phase;
+        std::uint32_t GracePeriodMilliseconds;
+    };
+
+    // Requires mutex_ to be held.
+    void UpdateTimerFd();
+
+    UniqueFd timerFd_;
+    std::mutex mutex_;
+    TimerWheel<Timer> wheel_;
+    // The tick the timerfd is armed for.
+    std::optional<std::uint64_t> armedTick_;
+    // Reused by HandleExpiration.
+    std::vector<Timer> expired_;
+};
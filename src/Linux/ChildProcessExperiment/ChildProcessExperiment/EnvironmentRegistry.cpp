@@ -0,0 +1,74 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "EnvironmentRegistry.hpp"
+#include "Base.hpp"
+#include "ErrorCodeExceptions.hpp"
+#include "Globals.hpp"
+#include "Request.hpp"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    // Returns the length of the name part of "NAME=VALUE".
+    [[nodiscard]] std::size_t GetVariableNameLength(const char* variable) noexcept
+    {
+        const char* const p = std::strchr(variable, '=');
+        return p != nullptr ? static_cast<std::size_t>(p - variable) : std::strlen(variable);
+    }
+
+    [[nodiscard]] bool IsOverridden(const char* variable, const StringArray& overlay) noexcept
+    {
+        const std::size_t nameLength = GetVariableNameLength(variable);
+        for (const char* overlayVariable : overlay)
+        {
+            if (overlayVariable != nullptr
+                && GetVariableNameLength(overlayVariable) == nameLength
+                && std::memcmp(overlayVariable, variable, nameLength) == 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+} // namespace
+
+void ResolveEnvironment(SpawnProcessRequest* r, const EnvironmentRegistry& subchannelRegistry)
+{
+    if (!(r->Flags & RequestFlagsEnvironmentBlock))
+    {
+        return;
+    }
+
+    r->Environment = (r->EnvironmentId & ServiceScopeIdBit)
+        ? g_ServiceEnvironmentRegistry.Get(r->EnvironmentId)
+        : subchannelRegistry.Get(r->EnvironmentId);
+    if (!r->Environment)
+    {
+        TRACE_ERROR("Unknown environment ID: %x\n", static_cast<unsigned int>(r->EnvironmentId));
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+
+    // Without an overlay, the block is used as is (GetEnvp).
+    if (r->Envp.size() == 1)
+    {
+        return;
+    }
+
+    // Allocated the same way as the overlay.
+    StringArray envp{r->Envp.get_allocator()};
+    envp.reserve(r->Environment->Envp.size() + r->Envp.size());
+    for (const char* variable : r->Environment->Envp)
+    {
+        if (variable != nullptr && !IsOverridden(variable, r->Envp))
+        {
+            envp.push_back(variable);
+        }
+    }
+
+    envp.insert(envp.end(), r->Envp.begin(), r->Envp.end());
+    r->Envp = std::move(envp);
+}
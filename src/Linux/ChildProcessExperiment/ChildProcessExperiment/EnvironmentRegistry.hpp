@@ -0,0 +1,14 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "ObjectRegistry.hpp"
+#include "Request.hpp"
+
+// Environment blocks registered by RequestCommand::RegisterEnvironment.
+using EnvironmentRegistry = ObjectRegistry<EnvironmentBlock>;
+
+// RequestFlagsEnvironmentBlock: Looks up r->EnvironmentId and applies the overlay (r->Envp) to it.
+// A variable in the overlay replaces the variable of the same name in the block.
+// Throws BadRequestError if the ID is not registered.
+void ResolveEnvironment(SpawnProcessRequest* r, const EnvironmentRegistry& subchannelRegistry);
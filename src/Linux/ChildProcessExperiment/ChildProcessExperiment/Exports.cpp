@@ -9,13 +9,17 @@
 #include "Service.hpp"
 #include "SocketHelpers.hpp"
 #include "UniqueResource.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <limits>
 #include <memory>
+#include <poll.h>
 #include <stdexcept>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -34,6 +38,87 @@ namespace
     {
         return 0 <= fd && fd <= std::numeric_limits<int>::max();
     }
+
+    [[nodiscard]] bool IsValidShardSet(const std::intptr_t* mainChannelFds, std::uint32_t shardCount) noexcept
+    {
+        if (shardCount == 0 || shardCount > MaxShardCount)
+        {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < shardCount; i++)
+        {
+            if (!IsWithinFdRange(mainChannelFds[i]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Receives fixed-size records (exit notifications) from the main channels of all helper shards.
+    [[nodiscard]] bool RecvRecordsFromShards(
+        const std::intptr_t* mainChannelFds, std::uint32_t shardCount, void* buf, std::size_t recordSize, std::size_t maxCount, std::size_t* count) noexcept
+    {
+        if (!IsValidShardSet(mainChannelFds, shardCount) || maxCount == 0)
+        {
+            errno = EINVAL;
+            return false;
+        }
+
+        struct pollfd pollFds[MaxShardCount];
+        for (std::uint32_t i = 0; i < shardCount; i++)
+        {
+            pollFds[i].fd = static_cast<int>(mainChannelFds[i]);
+            pollFds[i].events = POLLIN;
+            pollFds[i].revents = 0;
+        }
+
+        if (poll_restarting(pollFds, shardCount, -1) == -1)
+        {
+            return false;
+        }
+
+        auto* const records = static_cast<std::byte*>(buf);
+        std::size_t received = 0;
+        for (std::uint32_t i = 0; i < shardCount && received < maxCount; i++)
+        {
+            if (pollFds[i].revents == 0)
+            {
+                continue;
+            }
+
+            // Only take whole records so that no shard is left with a partial one.
+            int bytesAvailable;
+            if (ioctl(pollFds[i].fd, FIONREAD, &bytesAvailable) == -1)
+            {
+                return false;
+            }
+
+            std::size_t n = std::min(static_cast<std::size_t>(bytesAvailable) / recordSize, maxCount - received);
+            if (n == 0)
+            {
+                if (received != 0)
+                {
+                    continue;
+                }
+
+                // A partial record or EOF. The rest of a record follows shortly.
+                n = 1;
+            }
+
+            if (!RecvExactBytes(pollFds[i].fd, records + received * recordSize, n * recordSize))
+            {
+                return false;
+            }
+
+            received += n;
+        }
+
+        *count = received;
+        return true;
+    }
 } // namespace
 
 extern "C" bool ConnectToUnixSocket(const char* path, intptr_t* outSock)
@@ -168,11 +253,17 @@ extern "C" std::intptr_t OpenNullDevice(int fileAccess)
     return open("/dev/null", O_CLOEXEC, mode);
 }
 
-// Creates a subchannel.
+// Creates a subchannel with SubchannelCreationFlags.
 // On success, returns the subchannel fd.
 // On error, sets errno and returns -1.
-extern "C" std::intptr_t SubchannelCreate(std::intptr_t mainChannelFd)
+extern "C" std::intptr_t SubchannelCreateWithFlags(std::intptr_t mainChannelFd, std::uint32_t flags)
 {
+    if ((flags & ~SubchannelFlagsPipelined) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
     if (!IsWithinFdRange(mainChannelFd))
     {
         errno = EINVAL;
@@ -191,8 +282,8 @@ extern "C" std::intptr_t SubchannelCreate(std::intptr_t mainChannelFd)
 
     // Send remoteSock to the helper process and request subchannel creation.
     const int fds[1]{remoteSock.Get()};
-    const char dummyData = 0;
-    if (!SendExactBytesWithFd(static_cast<int>(mainChannelFd), &dummyData, 1, fds, 1))
+    const std::uint8_t flagsData = static_cast<std::uint8_t>(flags);
+    if (!SendExactBytesWithFd(static_cast<int>(mainChannelFd), &flagsData, 1, fds, 1))
     {
         return -1;
     }
@@ -215,6 +306,53 @@ extern "C" std::intptr_t SubchannelCreate(std::intptr_t mainChannelFd)
     return localSock.Release();
 }
 
+// Creates a subchannel.
+// On success, returns the subchannel fd.
+// On error, sets errno and returns -1.
+extern "C" std::intptr_t SubchannelCreate(std::intptr_t mainChannelFd)
+{
+    return SubchannelCreateWithFlags(mainChannelFd, 0);
+}
+
+// Returns the index of the helper shard that requests concerning token shall be sent to (see Protocol.md).
+extern "C" std::uint32_t GetHelperShardOfToken(std::uint64_t token, std::uint32_t shardCount)
+{
+    return GetShardOfToken(token, shardCount);
+}
+
+// Creates a subchannel on the helper shard that token is routed to.
+// mainChannelFds: The main channels of the shards, indexed by shard index.
+// On success, returns the subchannel fd.
+// On error, sets errno and returns -1.
+extern "C" std::intptr_t SubchannelCreateForToken(const std::intptr_t* mainChannelFds, std::uint32_t shardCount, std::uint64_t token, std::uint32_t flags)
+{
+    if (!IsValidShardSet(mainChannelFds, shardCount))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return SubchannelCreateWithFlags(mainChannelFds[GetShardOfToken(token, shardCount)], flags);
+}
+
+// Receives ChildExitNotification structs from the main channels of all helper shards.
+// Blocks until at least one is available, then receives as many as are available (up to maxCount) without blocking.
+// On success, stores the number of notifications received and returns true.
+// On error, sets errno and returns false. On a normal shutdown of any shard, sets errno to 0 and returns false.
+extern "C" bool RecvChildExitNotificationsFromShards(
+    const std::intptr_t* mainChannelFds, std::uint32_t shardCount, void* buf, std::size_t maxCount, std::size_t* count) noexcept
+{
+    return RecvRecordsFromShards(mainChannelFds, shardCount, buf, sizeof(ChildExitNotification), maxCount, count);
+}
+
+// Same as RecvChildExitNotificationsFromShards, but receives ExtendedChildExitNotification structs
+// (helpers started with --exit-notification=extended).
+extern "C" bool RecvExtendedChildExitNotificationsFromShards(
+    const std::intptr_t* mainChannelFds, std::uint32_t shardCount, void* buf, std::size_t maxCount, std::size_t* count) noexcept
+{
+    return RecvRecordsFromShards(mainChannelFds, shardCount, buf, sizeof(ExtendedChildExitNotification), maxCount, count);
+}
+
 // Closes a subchannel.
 extern "C" bool SubchannelDestroy(std::intptr_t subchannelFd)
 {
@@ -244,6 +382,39 @@ extern "C" bool SubchannelRecvExactBytes(std::intptr_t subchannelFd, void* buf,
     return RecvExactBytes(static_cast<int>(subchannelFd), buf, len);
 }
 
+// Receives a response on a pipelined subchannel (SubchannelFlagsPipelined).
+// On success, stores the request ID and the length of the response and returns true.
+// If the response does not fit in buf, sets errno to EMSGSIZE and returns false; the subchannel is no longer usable.
+extern "C" bool SubchannelRecvTaggedResponse(std::intptr_t subchannelFd, std::uint32_t* requestId, void* buf, std::size_t len, std::size_t* responseLength) noexcept
+{
+    if (!IsWithinFdRange(subchannelFd))
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    std::uint32_t header[2];
+    if (!RecvExactBytes(static_cast<int>(subchannelFd), header, sizeof(header)))
+    {
+        return false;
+    }
+
+    if (header[1] > len)
+    {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    if (!RecvExactBytes(static_cast<int>(subchannelFd), buf, header[1]))
+    {
+        return false;
+    }
+
+    *requestId = header[0];
+    *responseLength = header[1];
+    return true;
+}
+
 // Sends entire data
 extern "C" bool SubchannelSendExactBytes(std::intptr_t subchannelFd, const void* buf, std::size_t len) noexcept
 {
@@ -2,5 +2,13 @@
 
 #include "Globals.hpp"
 #include "ChildProcessState.hpp"
+#include "EnvironmentRegistry.hpp"
+#include "JobGroup.hpp"
+#include "ServiceOptions.hpp"
+#include "SpawnTemplate.hpp"
 
 ChildProcessStateMap g_ChildProcessStateMap;
+ServiceOptions g_ServiceOptions;
+EnvironmentRegistry g_ServiceEnvironmentRegistry{ServiceScopeIdBit, MaxEnvironmentBlockCount};
+SpawnTemplateRegistry g_ServiceSpawnTemplateRegistry{ServiceScopeIdBit, MaxSpawnTemplateCount};
+JobGroupRegistry g_JobGroupRegistry{0, MaxJobGroupCount};
@@ -4,3 +4,15 @@
 
 class ChildProcessStateMap;
 extern ChildProcessStateMap g_ChildProcessStateMap;
+
+struct ServiceOptions;
+extern ServiceOptions g_ServiceOptions;
+
+template<typename T>
+class ObjectRegistry;
+struct EnvironmentBlock;
+struct SpawnTemplate;
+extern ObjectRegistry<EnvironmentBlock> g_ServiceEnvironmentRegistry;
+extern ObjectRegistry<SpawnTemplate> g_ServiceSpawnTemplateRegistry;
+class JobGroup;
+extern ObjectRegistry<JobGroup> g_JobGroupRegistry;
@@ -3,8 +3,11 @@
 #include "Base.hpp"
 #include "ExactBytesIO.hpp"
 #include "MiscHelpers.hpp"
+#include "Globals.hpp"
 #include "Service.hpp"
+#include "ServiceOptions.hpp"
 #include "SocketHelpers.hpp"
+#include "Zygote.hpp"
 #include <cstdio>
 #include <cstring>
 #include <sys/socket.h>
@@ -23,13 +26,26 @@ static_assert(sizeof(HelperHello) == HelperHelloBytes);
 // this process inherit fds from the parent process.
 extern "C" int HelperMain(int argc, const char** argv)
 {
-    // Usage: AsmichiChildProcessHelper socket_path
-    if (argc != 2)
+    // Usage: AsmichiChildProcessHelper socket_path [options]
+    if (argc < 2)
     {
         PutFatalError("Invalid argc.");
         return 1;
     }
 
+    if (!ParseServiceOptions(&g_ServiceOptions, argc - 2, argv + 2))
+    {
+        PutFatalError("Invalid options.");
+        return 1;
+    }
+
+    // Fork the zygote while our image is still small (and before we connect to the parent).
+    if (g_ServiceOptions.DefaultSpawnMethod == SpawnMethod::Zygote && !StartZygote())
+    {
+        PutFatalError(errno, "StartZygote");
+        return 1;
+    }
+
     const auto* path = argv[1];
 
     struct sockaddr_un addr;
@@ -0,0 +1,166 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "IoUring.hpp"
+#include "Base.hpp"
+#include "MiscHelpers.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
+
+std::unique_ptr<IoUring> IoUring::Create(unsigned int entries) noexcept
+{
+    io_uring_params params{};
+    UniqueFd ringFd{sys_io_uring_setup(entries, &params)};
+    if (!ringFd.IsValid())
+    {
+        return nullptr;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        // Linux 5.4 or later.
+        errno = ENOSYS;
+        return nullptr;
+    }
+
+    std::unique_ptr<IoUring> pRing{new IoUring()};
+
+    // The submission queue ring and the completion queue ring share one mapping.
+    pRing->ringSize_ = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    void* const ringPtr = mmap(nullptr, pRing->ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd.Get(), IORING_OFF_SQ_RING);
+    if (ringPtr == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    pRing->ringPtr_ = ringPtr;
+
+    pRing->sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* const sqesPtr = mmap(nullptr, pRing->sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd.Get(), IORING_OFF_SQES);
+    if (sqesPtr == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    pRing->sqes_ = static_cast<io_uring_sqe*>(sqesPtr);
+
+    auto* const p = static_cast<std::byte*>(ringPtr);
+    pRing->sqHead_ = reinterpret_cast<unsigned int*>(p + params.sq_off.head);
+    pRing->sqTail_ = reinterpret_cast<unsigned int*>(p + params.sq_off.tail);
+    pRing->sqArray_ = reinterpret_cast<unsigned int*>(p + params.sq_off.array);
+    pRing->sqMask_ = *reinterpret_cast<unsigned int*>(p + params.sq_off.ring_mask);
+    pRing->sqEntries_ = params.sq_entries;
+    pRing->cqHead_ = reinterpret_cast<unsigned int*>(p + params.cq_off.head);
+    pRing->cqTail_ = reinterpret_cast<unsigned int*>(p + params.cq_off.tail);
+    pRing->cqes_ = reinterpret_cast<io_uring_cqe*>(p + params.cq_off.cqes);
+    pRing->cqMask_ = *reinterpret_cast<unsigned int*>(p + params.cq_off.ring_mask);
+
+    pRing->ringFd_ = std::move(ringFd);
+    return pRing;
+}
+
+bool IoUring::IsSupported(const std::uint8_t* opcodes, std::size_t opcodeCount) noexcept
+{
+    io_uring_params params{};
+    const UniqueFd ringFd{sys_io_uring_setup(1, &params)};
+    if (!ringFd.IsValid())
+    {
+        return false;
+    }
+
+    const std::size_t probeSize = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+    std::vector<std::byte> probeBuffer(probeSize);
+    auto* const pProbe = reinterpret_cast<io_uring_probe*>(probeBuffer.data());
+    if (sys_io_uring_register(ringFd.Get(), IORING_REGISTER_PROBE, pProbe, IORING_OP_LAST) == -1)
+    {
+        // IORING_REGISTER_PROBE requires Linux 5.6.
+        return false;
+    }
+
+    for (std::size_t i = 0; i < opcodeCount; i++)
+    {
+        const auto op = opcodes[i];
+        if (op > pProbe->last_op || !(pProbe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+IoUring::~IoUring()
+{
+    if (sqes_ != nullptr)
+    {
+        munmap(sqes_, sqesSize_);
+    }
+
+    if (ringPtr_ != nullptr)
+    {
+        munmap(ringPtr_, ringSize_);
+    }
+}
+
+io_uring_sqe* IoUring::GetSqe() noexcept
+{
+    const unsigned int tail = *sqTail_;
+    if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_)
+    {
+        if (!Enter(0, 0))
+        {
+            FatalErrorAbort(errno, "io_uring_enter");
+        }
+    }
+
+    const unsigned int index = tail & sqMask_;
+    io_uring_sqe* const pSqe = &sqes_[index];
+    std::memset(pSqe, 0, sizeof(io_uring_sqe));
+    sqArray_[index] = index;
+
+    // NOTE: The caller fills the SQE before the next Enter; the kernel reads SQEs only in io_uring_enter.
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    toSubmit_++;
+    return pSqe;
+}
+
+bool IoUring::SubmitAndWait() noexcept
+{
+    return Enter(1, IORING_ENTER_GETEVENTS);
+}
+
+bool IoUring::PopCqe(io_uring_cqe* pCqe) noexcept
+{
+    const unsigned int head = *cqHead_;
+    if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    *pCqe = cqes_[head & cqMask_];
+    __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool IoUring::Enter(unsigned int minComplete, unsigned int flags) noexcept
+{
+    while (true)
+    {
+        const int ret = sys_io_uring_enter(ringFd_.Get(), toSubmit_, minComplete, flags);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        toSubmit_ -= static_cast<unsigned int>(ret);
+        return true;
+    }
+}
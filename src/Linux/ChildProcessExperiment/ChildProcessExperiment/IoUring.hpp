@@ -0,0 +1,60 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "UniqueResource.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <memory>
+
+// A minimal io_uring instance implemented with raw system calls (we do not depend on liburing).
+// NOTE: Not thread-safe.
+class IoUring final
+{
+public:
+    // On error, sets errno and returns nullptr.
+    [[nodiscard]] static std::unique_ptr<IoUring> Create(unsigned int entries) noexcept;
+
+    // Whether the kernel supports the operations listed in opcodes (and io_uring itself).
+    // io_uring may also be disabled by kernel.io_uring_disabled or seccomp.
+    [[nodiscard]] static bool IsSupported(const std::uint8_t* opcodes, std::size_t opcodeCount) noexcept;
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring();
+
+    // Returns a zero-filled SQE to be submitted by the next SubmitAndWait.
+    // If the submission queue is full, submits queued SQEs first.
+    [[nodiscard]] io_uring_sqe* GetSqe() noexcept;
+
+    // Submits queued SQEs and waits for at least one completion. On error, sets errno and returns false.
+    [[nodiscard]] bool SubmitAndWait() noexcept;
+
+    // Pops a completion. Returns false if the completion queue is empty.
+    [[nodiscard]] bool PopCqe(io_uring_cqe* pCqe) noexcept;
+
+private:
+    IoUring() noexcept = default;
+
+    [[nodiscard]] bool Enter(unsigned int minComplete, unsigned int flags) noexcept;
+
+    UniqueFd ringFd_;
+    void* ringPtr_ = nullptr;
+    std::size_t ringSize_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqesSize_ = 0;
+
+    unsigned int* sqHead_ = nullptr;
+    unsigned int* sqTail_ = nullptr;
+    unsigned int* sqArray_ = nullptr;
+    unsigned int sqMask_ = 0;
+    unsigned int sqEntries_ = 0;
+    unsigned int* cqHead_ = nullptr;
+    unsigned int* cqTail_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned int cqMask_ = 0;
+
+    // SQEs published to the submission queue but not submitted yet.
+    unsigned int toSubmit_ = 0;
+};
@@ -0,0 +1,262 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "JobGroup.hpp"
+#include "Base.hpp"
+#include "ErrorCodeExceptions.hpp"
+#include "Globals.hpp"
+#include "MiscHelpers.hpp"
+#include "Request.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // Large enough for cpu.stat and cgroup.events.
+    const std::size_t ControlFileBufferSize = 1024;
+    // How long ShutdownJobGroups waits for the killed groups to become empty.
+    const std::uint64_t ShutdownTimeoutMilliseconds = 1000;
+
+    // -1 if job groups are unavailable.
+    int g_JobGroupRootFd = -1;
+    std::atomic<std::uint32_t> g_NextJobGroupSerial{0};
+
+    // Returns the number of bytes read (the contents are terminated by '\0'), or -1 and sets errno.
+    [[nodiscard]] ssize_t ReadControlFile(int dirFd, const char* name, char* buf, std::size_t size) noexcept
+    {
+        const UniqueFd fd{openat(dirFd, name, O_RDONLY | O_CLOEXEC)};
+        if (!fd.IsValid())
+        {
+            return -1;
+        }
+
+        const ssize_t bytesRead = read_restarting(fd.Get(), buf, size - 1);
+        if (bytesRead == -1)
+        {
+            return -1;
+        }
+
+        buf[bytesRead] = '\0';
+        return bytesRead;
+    }
+
+    [[nodiscard]] bool WriteControlFile(int dirFd, const char* name, const char* value) noexcept
+    {
+        const UniqueFd fd{openat(dirFd, name, O_WRONLY | O_CLOEXEC)};
+        return fd.IsValid() && WriteExactBytes(fd.Get(), value, std::strlen(value));
+    }
+
+    // Finds "key value" in the contents of a flat-keyed control file (cpu.stat, cgroup.events).
+    [[nodiscard]] std::uint64_t GetKeyedValue(const char* contents, const char* key) noexcept
+    {
+        const std::size_t keyLength = std::strlen(key);
+        for (const char* line = contents; *line != '\0';)
+        {
+            if (std::strncmp(line, key, keyLength) == 0 && line[keyLength] == ' ')
+            {
+                return std::strtoull(line + keyLength + 1, nullptr, 10);
+            }
+
+            const char* const next = std::strchr(line, '\n');
+            if (next == nullptr)
+            {
+                break;
+            }
+            line = next + 1;
+        }
+
+        return 0;
+    }
+
+    // Waits until cgroup.events reports "populated 0" or the deadline passes.
+    [[nodiscard]] bool WaitUntilUnpopulated(int dirFd, std::uint64_t deadlineNanoseconds) noexcept
+    {
+        const UniqueFd fd{openat(dirFd, "cgroup.events", O_RDONLY | O_CLOEXEC)};
+        if (!fd.IsValid())
+        {
+            return false;
+        }
+
+        char buf[ControlFileBufferSize];
+        while (true)
+        {
+            // Reading rearms the notification; a change after the read wakes poll with POLLPRI.
+            const ssize_t bytesRead = pread(fd.Get(), buf, sizeof(buf) - 1, 0);
+            if (bytesRead == -1)
+            {
+                return false;
+            }
+
+            buf[bytesRead] = '\0';
+            if (GetKeyedValue(buf, "populated") == 0)
+            {
+                return true;
+            }
+
+            const std::uint64_t now = GetMonotonicTimeNanoseconds();
+            if (now >= deadlineNanoseconds)
+            {
+                errno = ETIMEDOUT;
+                return false;
+            }
+
+            pollfd pfd{fd.Get(), POLLPRI, 0};
+            const int timeoutMilliseconds = static_cast<int>((deadlineNanoseconds - now + 999999) / 1000000);
+            if (poll_restarting(&pfd, 1, timeoutMilliseconds) == -1)
+            {
+                return false;
+            }
+        }
+    }
+} // namespace
+
+void SetupJobGroups(const char* root) noexcept
+{
+    if (root == nullptr)
+    {
+        TRACE_INFO("No job group root specified. Job groups are not available.\n");
+        return;
+    }
+
+    g_JobGroupRootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_JobGroupRootFd == -1)
+    {
+        TRACE_INFO("Cannot open the job group root %s (%d). Job groups are not available.\n", root, errno);
+        return;
+    }
+
+    // Separately so that a controller unavailable here does not keep the other from being enabled.
+    for (const char* controller : {"+cpu", "+memory"})
+    {
+        if (!WriteControlFile(g_JobGroupRootFd, "cgroup.subtree_control", controller))
+        {
+            TRACE_INFO("Cannot enable %s for job groups (%d).\n", controller + 1, errno);
+        }
+    }
+}
+
+void ShutdownJobGroups() noexcept
+{
+    const auto groups = g_JobGroupRegistry.UnregisterAll();
+    for (const auto& pGroup : groups)
+    {
+        if (!pGroup->Kill())
+        {
+            TRACE_ERROR("Cannot kill a job group (%d).\n", errno);
+        }
+    }
+
+    // The killed processes leave the groups asynchronously.
+    const std::uint64_t deadline = GetMonotonicTimeNanoseconds() + ShutdownTimeoutMilliseconds * 1000000;
+    for (const auto& pGroup : groups)
+    {
+        if (!WaitUntilUnpopulated(pGroup->GetFd(), deadline) || !pGroup->Remove())
+        {
+            TRACE_ERROR("Cannot remove a job group (%d).\n", errno);
+        }
+    }
+}
+
+std::shared_ptr<JobGroup> JobGroup::Create()
+{
+    if (g_JobGroupRootFd == -1)
+    {
+        errno = ENOTSUP;
+        return nullptr;
+    }
+
+    // Unique among helpers sharing the root.
+    char name[64];
+    std::snprintf(name, sizeof(name), "childprocess-%d-%u", static_cast<int>(getpid()), g_NextJobGroupSerial.fetch_add(1));
+    if (mkdirat(g_JobGroupRootFd, name, 0755) == -1)
+    {
+        return nullptr;
+    }
+
+    UniqueFd dirFd{openat(g_JobGroupRootFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (!dirFd.IsValid())
+    {
+        const int err = errno;
+        unlinkat(g_JobGroupRootFd, name, AT_REMOVEDIR);
+        errno = err;
+        return nullptr;
+    }
+
+    return std::make_shared<JobGroup>(std::move(dirFd), name);
+}
+
+bool JobGroup::Freeze(bool frozen) const noexcept
+{
+    return WriteControlFile(dirFd_.Get(), "cgroup.freeze", frozen ? "1" : "0");
+}
+
+bool JobGroup::Kill() const noexcept
+{
+    return WriteControlFile(dirFd_.Get(), "cgroup.kill", "1");
+}
+
+bool JobGroup::GetStats(JobGroupStats* pStats) const noexcept
+{
+    *pStats = {};
+    char buf[ControlFileBufferSize];
+
+    // cpu.stat always has the usage fields, with or without the cpu controller.
+    if (ReadControlFile(dirFd_.Get(), "cpu.stat", buf, sizeof(buf)) == -1)
+    {
+        return false;
+    }
+    pStats->UsageMicroseconds = GetKeyedValue(buf, "usage_usec");
+    pStats->UserMicroseconds = GetKeyedValue(buf, "user_usec");
+    pStats->SystemMicroseconds = GetKeyedValue(buf, "system_usec");
+
+    if (ReadControlFile(dirFd_.Get(), "cgroup.events", buf, sizeof(buf)) == -1)
+    {
+        return false;
+    }
+    pStats->Flags |= GetKeyedValue(buf, "populated") != 0 ? JobGroupStatsPopulated : 0;
+    pStats->Flags |= GetKeyedValue(buf, "frozen") != 0 ? JobGroupStatsFrozen : 0;
+
+    // Present only if the memory controller is enabled in the subtree_control of the root.
+    if (ReadControlFile(dirFd_.Get(), "memory.current", buf, sizeof(buf)) != -1)
+    {
+        pStats->MemoryCurrentBytes = std::strtoull(buf, nullptr, 10);
+        pStats->Flags |= JobGroupStatsMemory;
+
+        // memory.peak: Linux 5.19.
+        if (ReadControlFile(dirFd_.Get(), "memory.peak", buf, sizeof(buf)) != -1)
+        {
+            pStats->MemoryPeakBytes = std::strtoull(buf, nullptr, 10);
+        }
+    }
+
+    return true;
+}
+
+bool JobGroup::Remove() const noexcept
+{
+    return unlinkat(g_JobGroupRootFd, name_.c_str(), AT_REMOVEDIR) == 0;
+}
+
+void ResolveJobGroup(SpawnProcessRequest* r)
+{
+    if (!(r->Flags & RequestFlagsJobGroup))
+    {
+        return;
+    }
+
+    r->Job = g_JobGroupRegistry.Get(r->JobGroupId);
+    if (!r->Job)
+    {
+        TRACE_ERROR("Unknown job group ID: %x\n", static_cast<unsigned int>(r->JobGroupId));
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
@@ -0,0 +1,80 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "ObjectRegistry.hpp"
+#include "Request.hpp"
+#include "UniqueResource.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+// NOTE: Make sure to sync with the client.
+enum JobGroupStatsFlags
+{
+    JobGroupStatsPopulated = 1 << 0,
+    JobGroupStatsFrozen = 1 << 1,
+    // MemoryCurrentBytes and MemoryPeakBytes are valid (the memory controller is enabled for the group).
+    JobGroupStatsMemory = 1 << 2,
+};
+
+// RequestCommand::GetJobGroupStats. Aggregated over every process that has ever been in the group.
+struct JobGroupStats
+{
+    // cpu.stat
+    std::uint64_t UsageMicroseconds;
+    std::uint64_t UserMicroseconds;
+    std::uint64_t SystemMicroseconds;
+    // memory.current, memory.peak
+    std::uint64_t MemoryCurrentBytes;
+    std::uint64_t MemoryPeakBytes;
+    // JobGroupStatsFlags
+    std::uint32_t Flags;
+    std::uint32_t Reserved;
+};
+static_assert(sizeof(JobGroupStats) == 48);
+
+// A cgroup v2 leaf created by RequestCommand::CreateJobGroup under the job group root (--job-group-root).
+// Children spawned with RequestFlagsJobGroup are placed in it by clone3(CLONE_INTO_CGROUP),
+// so that the whole tree including descendants that leave the process group can be frozen, killed and accounted.
+// NOTE: The service does not notify the client when a group becomes empty. The client waits for the exit
+// notifications of its children and then polls JobGroupStatsPopulated (or retries DeleteJobGroup on EBUSY).
+class JobGroup final
+{
+public:
+    // name: Relative to the job group root.
+    JobGroup(UniqueFd dirFd, std::string name) noexcept : dirFd_(std::move(dirFd)), name_(std::move(name)) {}
+
+    // Creates a new leaf. On error, returns nullptr and sets errno (ENOTSUP if cgroup v2 is not available).
+    [[nodiscard]] static std::shared_ptr<JobGroup> Create();
+
+    // A directory fd for clone_args.cgroup.
+    [[nodiscard]] int GetFd() const noexcept { return dirFd_.Get(); }
+
+    // The following return false and set errno on error.
+    [[nodiscard]] bool Freeze(bool frozen) const noexcept;
+    // SIGKILL to every process in the group (cgroup.kill; Linux 5.14).
+    [[nodiscard]] bool Kill() const noexcept;
+    [[nodiscard]] bool GetStats(JobGroupStats* pStats) const noexcept;
+    // Removes the leaf. Fails with EBUSY while the group has processes.
+    [[nodiscard]] bool Remove() const noexcept;
+
+private:
+    UniqueFd dirFd_;
+    const std::string name_;
+};
+
+// Job groups registered by RequestCommand::CreateJobGroup. Service-wide.
+using JobGroupRegistry = ObjectRegistry<JobGroup>;
+
+// Opens the job group root and enables the cpu and memory controllers for its children where possible.
+// Job groups are unavailable if root is nullptr or cannot be opened.
+// NOTE: The root must not contain processes (unless it is the root cgroup); otherwise the controllers
+// cannot be enabled. This is why the cgroup of the helper is not used by default.
+void SetupJobGroups(const char* root) noexcept;
+// Kills the groups still registered, waits a while for them to become empty and removes them.
+void ShutdownJobGroups() noexcept;
+
+// RequestFlagsJobGroup: Looks up r->JobGroupId. Throws BadRequestError if the ID is not registered.
+void ResolveJobGroup(SpawnProcessRequest* r);
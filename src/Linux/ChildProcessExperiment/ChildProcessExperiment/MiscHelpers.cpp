@@ -7,10 +7,14 @@
 #include <array>
 #include <cerrno>
 #include <cstddef>
+#include <cstdint>
 #include <fcntl.h>
 #include <optional>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace
@@ -85,6 +89,16 @@ int poll_restarting(struct pollfd* fds, unsigned int nfds, int timeout) noexcept
     return ret;
 }
 
+int epoll_wait_restarting(int epfd, struct epoll_event* events, int maxevents, int timeout) noexcept
+{
+    int ret;
+    do
+    {
+        ret = epoll_wait(epfd, events, maxevents, timeout);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
 int chdir_restarting(const char* path) noexcept
 {
     int ret;
@@ -95,6 +109,72 @@ int chdir_restarting(const char* path) noexcept
     return ret;
 }
 
+int sys_pidfd_open(int pid, unsigned int flags) noexcept
+{
+#if defined(SYS_pidfd_open)
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, flags));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+long sys_clone3(struct clone_args* args, std::size_t size) noexcept
+{
+#if defined(SYS_clone3)
+    return syscall(SYS_clone3, args, size);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int sys_io_uring_setup(unsigned int entries, struct io_uring_params* params) noexcept
+{
+#if defined(SYS_io_uring_setup)
+    return static_cast<int>(syscall(SYS_io_uring_setup, entries, params));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int sys_io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) noexcept
+{
+#if defined(SYS_io_uring_enter)
+    return static_cast<int>(syscall(SYS_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int argCount) noexcept
+{
+#if defined(SYS_io_uring_register)
+    return static_cast<int>(syscall(SYS_io_uring_register, fd, opcode, arg, argCount));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int sys_waitid(idtype_t idtype, id_t id, siginfo_t* infop, int options, struct rusage* usage) noexcept
+{
+    return static_cast<int>(syscall(SYS_waitid, idtype, id, infop, options, usage));
+}
+
+std::uint64_t GetMonotonicTimeNanoseconds() noexcept
+{
+    timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    {
+        FatalErrorAbort(errno, "clock_gettime");
+    }
+
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
 std::optional<PipeEnds> CreatePipe() noexcept
 {
     int pipes[2];
@@ -6,10 +6,16 @@
 
 #include "UniqueResource.hpp"
 #include <array>
+#include <cstdint>
 #include <optional>
 #include <pthread.h>
+#include <sys/wait.h>
 
+struct clone_args;
+struct epoll_event;
+struct io_uring_params;
 struct pollfd;
+struct rusage;
 
 // Wrappers that restarts the operation on EINTR.
 [[nodiscard]] ssize_t recv_restarting(int fd, void* buf, size_t len, int flags) noexcept;
@@ -21,8 +27,25 @@ struct pollfd;
 [[nodiscard]] bool ReadExactBytes(int fd, void* buf, std::size_t len) noexcept;
 [[nodiscard]] bool WriteExactBytes(int fd, const void* buf, std::size_t len) noexcept;
 [[nodiscard]] int poll_restarting(struct pollfd* fds, unsigned int nfds, int timeout) noexcept;
+[[nodiscard]] int epoll_wait_restarting(int epfd, struct epoll_event* events, int maxevents, int timeout) noexcept;
 [[nodiscard]] int chdir_restarting(const char* path) noexcept;
 
+// System calls without glibc wrappers (on the glibc versions we support).
+// On error (including ENOSYS on older kernels), sets errno and returns -1.
+[[nodiscard]] int sys_pidfd_open(int pid, unsigned int flags) noexcept;
+[[nodiscard]] long sys_clone3(struct clone_args* args, std::size_t size) noexcept;
+[[nodiscard]] int sys_io_uring_setup(unsigned int entries, struct io_uring_params* params) noexcept;
+[[nodiscard]] int sys_io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) noexcept;
+[[nodiscard]] int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int argCount) noexcept;
+// The raw waitid also reports the resource usage of the child (glibc does not expose the fifth argument).
+[[nodiscard]] int sys_waitid(idtype_t idtype, id_t id, siginfo_t* infop, int options, struct rusage* usage) noexcept;
+
+// CLOCK_MONOTONIC in nanoseconds.
+[[nodiscard]] std::uint64_t GetMonotonicTimeNanoseconds() noexcept;
+
+// P_PIDFD; not defined by older glibc.
+const idtype_t IdTypePidFd = static_cast<idtype_t>(3);
+
 // RAII wrappers.
 struct PipeEnds
 {
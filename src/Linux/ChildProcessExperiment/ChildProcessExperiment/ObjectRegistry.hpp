@@ -0,0 +1,84 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// IDs of objects registered to the service (rather than to a subchannel) have this bit set.
+const std::uint32_t ServiceScopeIdBit = 1u << 31;
+
+// Objects registered by the client and referenced by ID, either per subchannel or per service.
+// A request that refers to an object keeps it alive even if the object is unregistered in the meantime.
+template<typename T>
+class ObjectRegistry final
+{
+public:
+    // idBit: Set in every ID assigned by this registry.
+    ObjectRegistry(std::uint32_t idBit, std::size_t maxCount) noexcept : idBit_(idBit), maxCount_(maxCount) {}
+
+    ObjectRegistry(const ObjectRegistry&) = delete;
+    ObjectRegistry& operator=(const ObjectRegistry&) = delete;
+
+    // Returns the ID of the object. Returns std::nullopt if maxCount objects are registered.
+    [[nodiscard]] std::optional<std::uint32_t> Register(std::shared_ptr<const T> pObject)
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        if (objects_.size() >= maxCount_)
+        {
+            return std::nullopt;
+        }
+
+        // Skip IDs still in use after wrapping around.
+        std::uint32_t id;
+        do
+        {
+            id = (nextId_++ & ~ServiceScopeIdBit) | idBit_;
+        } while (objects_.find(id) != objects_.end());
+
+        objects_.emplace(id, std::move(pObject));
+        return id;
+    }
+
+    // Returns false if not registered.
+    [[nodiscard]] bool Unregister(std::uint32_t id)
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        return objects_.erase(id) != 0;
+    }
+
+    // Returns nullptr if not registered.
+    [[nodiscard]] std::shared_ptr<const T> Get(std::uint32_t id) const
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        const auto it = objects_.find(id);
+        return it != objects_.end() ? it->second : nullptr;
+    }
+
+    // Unregisters every object and returns them.
+    [[nodiscard]] std::vector<std::shared_ptr<const T>> UnregisterAll()
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        std::vector<std::shared_ptr<const T>> objects;
+        objects.reserve(objects_.size());
+        for (auto& entry : objects_)
+        {
+            objects.push_back(std::move(entry.second));
+        }
+
+        objects_.clear();
+        return objects;
+    }
+
+private:
+    const std::uint32_t idBit_;
+    const std::size_t maxCount_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::uint32_t, std::shared_ptr<const T>> objects_;
+    std::uint32_t nextId_ = 0;
+};
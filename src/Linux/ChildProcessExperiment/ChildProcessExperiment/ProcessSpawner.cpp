@@ -0,0 +1,551 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "ProcessSpawner.hpp"
+#include "Base.hpp"
+#include "ChildProcessState.hpp"
+#include "Globals.hpp"
+#include "JobGroup.hpp"
+#include "MiscHelpers.hpp"
+#include "Request.hpp"
+#include "Service.hpp"
+#include "ServiceOptions.hpp"
+#include "SignalHandler.hpp"
+#include "UniqueResource.hpp"
+#include "Zygote.hpp"
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <linux/sched.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 29)
+#define HAS_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP 1
+#endif
+
+namespace
+{
+    // The child only performs a handful of system calls before exec.
+    const std::size_t CloneVforkChildStackSize = 64 * 1024;
+
+    // Set when clone3 turns out to be unavailable.
+    std::atomic<bool> g_IsClone3Unsupported{false};
+
+    struct CloneVforkChildArgs final
+    {
+        const SpawnProcessRequest* Request;
+        const sigset_t* OriginalSignalMask;
+        // Written by the child on failure.
+        int Error;
+    };
+
+    [[nodiscard]] SpawnProcessResult SpawnProcessWithFork(const SpawnProcessRequest& r);
+    [[nodiscard]] SpawnProcessResult SpawnProcessWithZygote(const SpawnProcessRequest& r);
+    [[nodiscard]] SpawnProcessResult CompleteForkedChild(int childPid, UniqueFd pidFd, int readyPipeWriteEnd, int errorPipeReadEnd, const SpawnProcessRequest& r);
+    [[nodiscard]] int ForkWithPidFd(UniqueFd* pPidFd, int cgroupFd) noexcept;
+    [[nodiscard]] SpawnProcessResult SpawnProcessWithCloneVfork(const SpawnProcessRequest& r);
+    int CloneVforkChildFunc(void* arg);
+    [[nodiscard]] SpawnProcessResult SpawnProcessWithPosixSpawn(const SpawnProcessRequest& r);
+    [[nodiscard]] int InitializePosixSpawnFileActions(posix_spawn_file_actions_t* pFileActions, const SpawnProcessRequest& r) noexcept;
+    // Returns the token of the child.
+    [[nodiscard]] std::uint64_t RegisterChild(int childPid, UniqueFd pidFd, const SpawnProcessRequest& r);
+
+    SpawnProcessResult SpawnProcessWithFork(const SpawnProcessRequest& r)
+    {
+        auto maybeOutPipe = CreatePipe();
+        if (!maybeOutPipe)
+        {
+            return {errno, 0, 0, false};
+        }
+        auto maybeInPipe = CreatePipe();
+        if (!maybeInPipe)
+        {
+            return {errno, 0, 0, false};
+        }
+
+        // NOTE: These fds may be inherited by multiple forked processes.
+        // parent -> child : To signal "the parent is ready; perform exec"
+        auto outPipe = std::move(*maybeOutPipe);
+        // child -> parent : To signal exec error (or no write on success)
+        auto inPipe = std::move(*maybeInPipe);
+
+        UniqueFd pidFd;
+        int childPid = ForkWithPidFd(&pidFd, r.Job ? r.Job->GetFd() : -1);
+        if (childPid == -1)
+        {
+            return {errno, 0, 0, false};
+        }
+        else if (childPid == 0)
+        {
+            // child
+            outPipe.WriteEnd.Reset();
+            inPipe.ReadEnd.Reset();
+            ExecuteForkedChild(r, outPipe.ReadEnd.Get(), inPipe.WriteEnd.Get());
+        }
+        else
+        {
+            // parent
+            outPipe.ReadEnd.Reset();
+            inPipe.WriteEnd.Reset();
+            return CompleteForkedChild(childPid, std::move(pidFd), outPipe.WriteEnd.Get(), inPipe.ReadEnd.Get(), r);
+        }
+    }
+
+    // The child of the zygote is our child (CLONE_PARENT) and waits for us to register it just like SpawnProcessWithFork.
+    SpawnProcessResult SpawnProcessWithZygote(const SpawnProcessRequest& r)
+    {
+        auto maybeOutPipe = CreatePipe();
+        if (!maybeOutPipe)
+        {
+            return {errno, 0, 0, false};
+        }
+        auto maybeInPipe = CreatePipe();
+        if (!maybeInPipe)
+        {
+            return {errno, 0, 0, false};
+        }
+
+        auto outPipe = std::move(*maybeOutPipe);
+        auto inPipe = std::move(*maybeInPipe);
+
+        const int childPid = SpawnChildInZygote(r, outPipe.ReadEnd.Get(), inPipe.WriteEnd.Get());
+        if (childPid == -1)
+        {
+            if (!IsZygoteAvailable())
+            {
+                // The zygote has exited.
+                return SpawnProcessWithFork(r);
+            }
+
+            return {errno, 0, 0, false};
+        }
+
+        outPipe.ReadEnd.Reset();
+        inPipe.WriteEnd.Reset();
+
+        // The child cannot be reaped (and its PID cannot be recycled) until we register it.
+        return CompleteForkedChild(childPid, UniqueFd(sys_pidfd_open(childPid, 0)), outPipe.WriteEnd.Get(), inPipe.ReadEnd.Get(), r);
+    }
+
+    // Registers a child waiting in ExecuteForkedChild and lets it perform exec.
+    SpawnProcessResult CompleteForkedChild(int childPid, UniqueFd pidFd, int readyPipeWriteEnd, int errorPipeReadEnd, const SpawnProcessRequest& r)
+    {
+        // Register the child before the child performs exec.
+        const auto token = RegisterChild(childPid, std::move(pidFd), r);
+
+        // Make the child to perform exec.
+        // The child may have already exited after reporting an error (e.g. chdir); prefer that error.
+        const bool isChildWaiting = WriteExactBytes(readyPipeWriteEnd, "", 1);
+        const int writeError = errno;
+
+        int err = 0;
+        const bool execSuccessful = !ReadExactBytes(errorPipeReadEnd, &err, sizeof(err));
+        if (!isChildWaiting && execSuccessful)
+        {
+            // The child has already been killed. It has been registered; its exit will be reported with token.
+            return {writeError, 0, token, false};
+        }
+        else if (execSuccessful)
+        {
+            return {0, childPid, token, false};
+        }
+        else
+        {
+            // Failed to execute the program: failed to dup2 or execve. Its exit will be reported with token.
+            return {err, 0, token, false};
+        }
+    }
+
+    // fork that also obtains a pidfd of the child (invalid if the kernel does not support pidfds or we are out of fds).
+    // cgroupFd: If not -1, the child is created in the cgroup (CLONE_INTO_CGROUP); fails with ENOTSUP without clone3.
+    //
+    // NOTE: Unlike fork, clone3 does not run atfork handlers. The child must only call async-signal-safe functions,
+    //       which is the case in a multithreaded process anyway.
+    int ForkWithPidFd(UniqueFd* pPidFd, int cgroupFd) noexcept
+    {
+        if (!g_IsClone3Unsupported.load(std::memory_order_relaxed))
+        {
+            int pidFd = -1;
+            struct clone_args args = {};
+            args.flags = CLONE_PIDFD;
+            args.pidfd = reinterpret_cast<std::uintptr_t>(&pidFd);
+            args.exit_signal = SIGCHLD;
+            if (cgroupFd != -1)
+            {
+                args.flags |= CLONE_INTO_CGROUP;
+                args.cgroup = static_cast<std::uint64_t>(cgroupFd);
+            }
+
+            long ret = sys_clone3(&args, sizeof(args));
+            if (ret == -1 && (errno == EMFILE || errno == ENFILE))
+            {
+                // No fd left for the pidfd. Spawn without it as fork would; the child will be reaped on SIGCHLD.
+                args.flags &= ~static_cast<std::uint64_t>(CLONE_PIDFD);
+                args.pidfd = 0;
+                ret = sys_clone3(&args, sizeof(args));
+            }
+
+            if (ret > 0)
+            {
+                *pPidFd = UniqueFd(pidFd);
+                return static_cast<int>(ret);
+            }
+            else if (ret == 0 || errno != ENOSYS)
+            {
+                return static_cast<int>(ret);
+            }
+
+            g_IsClone3Unsupported.store(true, std::memory_order_relaxed);
+        }
+
+        if (cgroupFd != -1)
+        {
+            // Moving the child after fork would let it (or its descendants) escape the group.
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        const int childPid = fork();
+        if (childPid > 0)
+        {
+            // The child cannot be reaped (and its PID cannot be recycled) until we register it.
+            *pPidFd = UniqueFd(sys_pidfd_open(childPid, 0));
+        }
+        return childPid;
+    }
+
+    // Spawns a child with clone(CLONE_VM | CLONE_VFORK) so that we do not need to copy our page tables.
+    //
+    // Because we are suspended until the child performs exec (or exits), the child cannot wait for us to register it;
+    // it is registered just after it performs exec. Also the child reports errors through the shared memory, not pipes.
+    SpawnProcessResult SpawnProcessWithCloneVfork(const SpawnProcessRequest& r)
+    {
+        void* const stack = mmap(nullptr, CloneVforkChildStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED)
+        {
+            return {errno, 0, 0, false};
+        }
+
+        // Block all signals so that our signal handlers will not run on the child (sharing our memory).
+        // The child will restore the mask after resetting the handlers.
+        sigset_t allSignals;
+        sigset_t originalSignalMask;
+        sigfillset(&allSignals);
+        pthread_sigmask(SIG_SETMASK, &allSignals, &originalSignalMask);
+
+        // The program should inherit the signal mask of the helper, not the one modified for the signalfd.
+        const auto* pOriginalSignalMask = GetOriginalSignalMask();
+        CloneVforkChildArgs args{&r, pOriginalSignalMask != nullptr ? pOriginalSignalMask : &originalSignalMask, 0};
+        // NOTE: The stack grows downward on all architectures we support.
+        void* const stackTop = static_cast<std::byte*>(stack) + CloneVforkChildStackSize;
+        // NOTE: With CLONE_PIDFD, the kernel stores the pidfd to the parent_tid argument.
+        //       Kernels older than 5.2 ignore the flag and leave pidFd untouched.
+        int pidFd = -1;
+        int childPid = clone(CloneVforkChildFunc, stackTop, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &args, &pidFd);
+        if (childPid == -1 && (errno == EMFILE || errno == ENFILE))
+        {
+            // No fd left for the pidfd; see ForkWithPidFd.
+            childPid = clone(CloneVforkChildFunc, stackTop, CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+        }
+        const int cloneError = errno;
+
+        pthread_sigmask(SIG_SETMASK, &originalSignalMask, nullptr);
+        munmap(stack, CloneVforkChildStackSize);
+
+        if (childPid == -1)
+        {
+            return {cloneError, 0, 0, false};
+        }
+
+        // The child has performed exec or has exited.
+        const auto token = RegisterChild(childPid, UniqueFd(pidFd != -1 ? pidFd : sys_pidfd_open(childPid, 0)), r);
+
+        if (args.Error != 0)
+        {
+            // Failed to execute the program: failed to dup2, chdir or execve. Its exit will be reported with token.
+            return {args.Error, 0, token, false};
+        }
+
+        return {0, childPid, token, false};
+    }
+
+    // NOTE: Runs on the child sharing our memory. Only async-signal-safe functions are allowed.
+    int CloneVforkChildFunc(void* arg)
+    {
+        auto* const pArgs = static_cast<CloneVforkChildArgs*>(arg);
+        const auto& r = *pArgs->Request;
+
+        ResetSignalHandlersToDefault();
+        pthread_sigmask(SIG_SETMASK, pArgs->OriginalSignalMask, nullptr);
+
+        auto dup2OrFail = [pArgs](const UniqueFd& src, int dst) {
+            if (src.IsValid())
+            {
+                if (dup2(src.Get(), dst) == -1)
+                {
+                    pArgs->Error = errno;
+                    _exit(1);
+                }
+            }
+        };
+
+        dup2OrFail(r.StdinFd, STDIN_FILENO);
+        dup2OrFail(r.StdoutFd, STDOUT_FILENO);
+        dup2OrFail(r.StderrFd, STDERR_FILENO);
+
+        if (r.WorkingDirectory != nullptr)
+        {
+            if (chdir_restarting(r.WorkingDirectory) == -1)
+            {
+                pArgs->Error = errno;
+                _exit(1);
+            }
+        }
+
+        // Always create a new process group.
+        setpgid(0, 0);
+        // NOTE: POSIX specifies execve shall not modify argv and envp.
+        execve(r.ExecutablePath, const_cast<char* const*>(&r.Argv[0]), const_cast<char* const*>(GetEnvp(r)));
+
+        pArgs->Error = errno;
+        _exit(1);
+    }
+
+    // Spawns a child with posix_spawn. glibc implements it with clone(CLONE_VM | CLONE_VFORK) and reports exec errors by itself,
+    // so no handshake is needed. Like SpawnProcessWithCloneVfork, the child is registered after it performs exec.
+    //
+    // NOTE: On exec failure, posix_spawn reaps the child by itself; no exit notification will be sent for it.
+    SpawnProcessResult SpawnProcessWithPosixSpawn(const SpawnProcessRequest& r)
+    {
+#if !defined(HAS_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP)
+        if (r.WorkingDirectory != nullptr)
+        {
+            // No way to change the working directory of the child.
+            return SpawnProcessWithCloneVfork(r);
+        }
+#endif
+
+        posix_spawn_file_actions_t fileActions;
+        int err = posix_spawn_file_actions_init(&fileActions);
+        if (err != 0)
+        {
+            return {err, 0, 0, false};
+        }
+
+        err = InitializePosixSpawnFileActions(&fileActions, r);
+        if (err != 0)
+        {
+            posix_spawn_file_actions_destroy(&fileActions);
+            return {err, 0, 0, false};
+        }
+
+        posix_spawnattr_t attr;
+        err = posix_spawnattr_init(&attr);
+        if (err != 0)
+        {
+            posix_spawn_file_actions_destroy(&fileActions);
+            return {err, 0, 0, false};
+        }
+
+        // Always create a new process group.
+        // NOTE: The child resets signals handled by us to SIG_DFL by itself and inherits our signal mask.
+        //       The signal mask modified for the signalfd must not be inherited.
+        short flags = POSIX_SPAWN_SETPGROUP;
+        const auto* pOriginalSignalMask = GetOriginalSignalMask();
+        if (pOriginalSignalMask != nullptr)
+        {
+            flags |= POSIX_SPAWN_SETSIGMASK;
+            err = posix_spawnattr_setsigmask(&attr, pOriginalSignalMask);
+        }
+        if (err == 0)
+        {
+            err = posix_spawnattr_setflags(&attr, flags);
+        }
+        if (err == 0)
+        {
+            err = posix_spawnattr_setpgroup(&attr, 0);
+        }
+        if (err != 0)
+        {
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&fileActions);
+            return {err, 0, 0, false};
+        }
+
+        pid_t childPid;
+        // NOTE: POSIX specifies posix_spawn shall not modify argv and envp.
+        err = posix_spawn(&childPid, r.ExecutablePath, &fileActions, &attr, const_cast<char* const*>(&r.Argv[0]), const_cast<char* const*>(GetEnvp(r)));
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fileActions);
+
+        if (err != 0)
+        {
+            // The child (if any) has been reaped by posix_spawn. The service may have delayed reaping other children
+            // because it found this unregistered child; let it retry.
+            if (!NotifyServiceOfChildRegistration())
+            {
+                FatalErrorAbort(errno, "write");
+            }
+
+            return {err, 0, 0, false};
+        }
+
+        const auto token = RegisterChild(childPid, UniqueFd(sys_pidfd_open(childPid, 0)), r);
+        return {0, childPid, token, false};
+    }
+
+    int InitializePosixSpawnFileActions(posix_spawn_file_actions_t* pFileActions, const SpawnProcessRequest& r) noexcept
+    {
+        const std::pair<const UniqueFd*, int> redirections[]{
+            {&r.StdinFd, STDIN_FILENO},
+            {&r.StdoutFd, STDOUT_FILENO},
+            {&r.StderrFd, STDERR_FILENO},
+        };
+
+        for (const auto& [pSrc, dst] : redirections)
+        {
+            if (pSrc->IsValid())
+            {
+                const int err = posix_spawn_file_actions_adddup2(pFileActions, pSrc->Get(), dst);
+                if (err != 0)
+                {
+                    return err;
+                }
+            }
+        }
+
+#if defined(HAS_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP)
+        if (r.WorkingDirectory != nullptr)
+        {
+            const int err = posix_spawn_file_actions_addchdir_np(pFileActions, r.WorkingDirectory);
+            if (err != 0)
+            {
+                return err;
+            }
+        }
+#endif
+
+        return 0;
+    }
+
+    // NOTE: Since we never reap an unregistered child, its PID is stable until this point.
+    std::uint64_t RegisterChild(int childPid, UniqueFd pidFd, const SpawnProcessRequest& r)
+    {
+        const std::uint32_t groupTag = (r.Flags & RequestFlagsGroupTag) ? r.GroupTag : 0;
+        const auto pState = (r.Flags & RequestFlagsServiceAssignedToken)
+            ? g_ChildProcessStateMap.AllocateWithServiceAssignedToken(childPid, std::move(pidFd), groupTag)
+            : g_ChildProcessStateMap.Allocate(childPid, std::move(pidFd), r.Token, groupTag);
+
+        // Send a reap request in case the child has already been killed and we have delayed reaping.
+        if (!NotifyServiceOfChildRegistration(pState.get()))
+        {
+            FatalErrorAbort(errno, "write");
+        }
+
+        if (r.Flags & RequestFlagsDeadline)
+        {
+            ScheduleChildDeadline(pState, r.DeadlineMilliseconds, r.GracePeriodMilliseconds);
+        }
+
+        return pState->GetToken();
+    }
+} // namespace
+
+[[noreturn]] void ExecuteForkedChild(const SpawnProcessRequest& r, int readyPipeReadEnd, int errorPipeWriteEnd) noexcept
+{
+    auto reportError = [](int fd, int err) {
+        static_cast<void>(WriteExactBytes(fd, &err, sizeof(err)));
+    };
+
+    auto dup2OrFail = [&](const UniqueFd& src, int dst) {
+        if (src.IsValid())
+        {
+            if (dup2(src.Get(), dst) == -1)
+            {
+                reportError(errorPipeWriteEnd, errno);
+                _exit(1);
+            }
+        }
+    };
+
+    dup2OrFail(r.StdinFd, STDIN_FILENO);
+    dup2OrFail(r.StdoutFd, STDOUT_FILENO);
+    dup2OrFail(r.StderrFd, STDERR_FILENO);
+
+    if (r.WorkingDirectory != nullptr)
+    {
+        if (chdir_restarting(r.WorkingDirectory) == -1)
+        {
+            reportError(errorPipeWriteEnd, errno);
+            _exit(1);
+        }
+    }
+
+    // Wait for the parent to be ready
+    char c;
+    if (!ReadExactBytes(readyPipeReadEnd, &c, 1))
+    {
+        // The parent has been killed; no point in continuing.
+        _exit(1);
+    }
+
+    // Let the program inherit the signal mask of the helper, not the one modified for the signalfd.
+    if (const auto* pOriginalSignalMask = GetOriginalSignalMask())
+    {
+        pthread_sigmask(SIG_SETMASK, pOriginalSignalMask, nullptr);
+    }
+
+    // Always create a new process group.
+    setpgid(0, 0);
+    // NOTE: POSIX specifies execve shall not modify argv and envp.
+    execve(r.ExecutablePath, const_cast<char* const*>(&r.Argv[0]), const_cast<char* const*>(GetEnvp(r)));
+
+    reportError(errorPipeWriteEnd, errno);
+    _exit(1);
+}
+
+SpawnProcessResult SpawnProcess(const SpawnProcessRequest& r)
+{
+    auto spawnMethod = GetSpawnMethod(r);
+    if (spawnMethod == SpawnMethod::Default)
+    {
+        spawnMethod = g_ServiceOptions.DefaultSpawnMethod;
+    }
+
+    if (r.Job)
+    {
+        // Only clone3 can place the child in the job group.
+        spawnMethod = SpawnMethod::Fork;
+    }
+
+    SpawnProcessResult result;
+    switch (spawnMethod)
+    {
+    case SpawnMethod::CloneVfork:
+        result = SpawnProcessWithCloneVfork(r);
+        break;
+
+    case SpawnMethod::PosixSpawn:
+        result = SpawnProcessWithPosixSpawn(r);
+        break;
+
+    case SpawnMethod::Zygote:
+        result = IsZygoteAvailable() ? SpawnProcessWithZygote(r) : SpawnProcessWithFork(r);
+        break;
+
+    case SpawnMethod::Fork:
+    default:
+        result = SpawnProcessWithFork(r);
+        break;
+    }
+
+    result.HasServiceAssignedToken = (r.Flags & RequestFlagsServiceAssignedToken) != 0;
+    return result;
+}
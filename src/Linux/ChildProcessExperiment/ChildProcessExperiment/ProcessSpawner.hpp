@@ -0,0 +1,26 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "Request.hpp"
+#include <cstdint>
+
+struct SpawnProcessResult final
+{
+    // 0 on success; otherwise errno.
+    int Error;
+    int ProcessID;
+    // The token of the child (service-assigned or taken from the request).
+    // Set whenever the child has been registered, including when it failed to execute the program.
+    std::uint64_t Token;
+    // The response must carry Token (RequestFlagsServiceAssignedToken).
+    bool HasServiceAssignedToken;
+};
+
+// Spawns a child process and registers it to g_ChildProcessStateMap.
+// NOTE: The child is registered even if it failed to perform exec so that it will be reaped.
+[[nodiscard]] SpawnProcessResult SpawnProcess(const SpawnProcessRequest& r);
+
+// The child half of fork-based spawning: redirects stdio, waits for the parent to register us and performs exec.
+// Errors are reported as errno through errorPipeWriteEnd. Also used by the children of the zygote.
+[[noreturn]] void ExecuteForkedChild(const SpawnProcessRequest& r, int readyPipeReadEnd, int errorPipeWriteEnd) noexcept;
@@ -0,0 +1,643 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "Reactor.hpp"
+#include "Base.hpp"
+#include "IoUring.hpp"
+#include "MiscHelpers.hpp"
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <utility>
+
+namespace
+{
+    // user_data of IORING_OP_ASYNC_CANCEL. Its completion is ignored.
+    const std::uint64_t CancelUserData = 0;
+
+    const std::uint8_t RequiredIoUringOpcodes[] = {
+        IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL,
+        IORING_OP_READ,
+        IORING_OP_RECVMSG,
+        IORING_OP_SENDMSG,
+    };
+
+    // On big-endian machines, the kernel swaps the 16-bit halves of poll32_events (see io_poll_parse_events).
+    [[nodiscard]] constexpr std::uint32_t ToPoll32Events(std::uint32_t events) noexcept
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return (events << 16) | (events >> 16);
+#else
+        return events;
+#endif
+    }
+} // namespace
+
+Reactor::Reactor(ReactorBackend backend)
+{
+    if (backend == ReactorBackend::IoUring)
+    {
+        ring_ = IoUring::Create(IoUringEntries);
+        if (!ring_)
+        {
+            FatalErrorAbort(errno, "io_uring_setup");
+        }
+    }
+    else
+    {
+        epollFd_ = UniqueFd{epoll_create1(EPOLL_CLOEXEC)};
+        if (!epollFd_.IsValid())
+        {
+            FatalErrorAbort(errno, "epoll_create1");
+        }
+    }
+}
+
+Reactor::~Reactor() = default;
+
+bool Reactor::IsIoUringSupported() noexcept
+{
+    return IoUring::IsSupported(RequiredIoUringOpcodes, sizeof(RequiredIoUringOpcodes));
+}
+
+void Reactor::Add(int fd, std::uint32_t events, Handler handler)
+{
+    auto pEntry = std::make_unique<Entry>();
+    pEntry->Fd = fd;
+    pEntry->Kind = EntryKind::Poll;
+    pEntry->Callback = std::move(handler);
+    pEntry->Events = events;
+    AddEntry(std::move(pEntry));
+}
+
+void Reactor::AddReader(int fd, void* buf, std::size_t len, TransferHandler handler)
+{
+    auto pEntry = std::make_unique<Entry>();
+    pEntry->Fd = fd;
+    pEntry->Kind = EntryKind::Read;
+    pEntry->TransferCallback = std::move(handler);
+    pEntry->Events = EPOLLIN;
+    pEntry->Buffer = buf;
+    pEntry->Length = len;
+    AddEntry(std::move(pEntry));
+}
+
+void Reactor::AddMessageReader(int fd, msghdr* pMsg, TransferHandler handler)
+{
+    auto pEntry = std::make_unique<Entry>();
+    pEntry->Fd = fd;
+    pEntry->Kind = EntryKind::RecvMsg;
+    pEntry->TransferCallback = std::move(handler);
+    pEntry->Events = EPOLLIN;
+    pEntry->Message = pMsg;
+    pEntry->ControlLength = pMsg->msg_controllen;
+    AddEntry(std::move(pEntry));
+}
+
+void Reactor::SetReaderPaused(int fd, bool paused)
+{
+    Entry* const pEntry = GetEntry(fd);
+    assert(pEntry->Kind == EntryKind::Read || pEntry->Kind == EntryKind::RecvMsg);
+    if (pEntry->IsPaused == paused)
+    {
+        return;
+    }
+
+    pEntry->IsPaused = paused;
+
+    if (ring_)
+    {
+        // If still pending on resume, the completion of the cancelled request resubmits it.
+        if (paused && pEntry->IsPending)
+        {
+            Cancel(pEntry);
+        }
+        else if (!paused && !pEntry->IsPending)
+        {
+            SubmitTransfer(pEntry);
+        }
+    }
+    else
+    {
+        epoll_event ev{};
+        ev.events = pEntry->Events;
+        ev.data.ptr = pEntry;
+        if (epoll_ctl(epollFd_.Get(), paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
+        }
+    }
+}
+
+void Reactor::AddWriter(int fd, TransferHandler handler)
+{
+    auto pEntry = std::make_unique<Entry>();
+    pEntry->Fd = fd;
+    pEntry->Kind = EntryKind::Write;
+    pEntry->TransferCallback = std::move(handler);
+    // NOTE: EPOLLERR and EPOLLHUP are always reported. EPOLLOUT is added while data is pending.
+    pEntry->Events = EPOLLET;
+    pEntry->Writer = std::make_unique<WriterState>();
+    AddEntry(std::move(pEntry));
+}
+
+void Reactor::AddEntry(std::unique_ptr<Entry> pEntry)
+{
+    assert(entries_.find(pEntry->Fd) == entries_.end());
+
+    if (ring_)
+    {
+        if (pEntry->Kind == EntryKind::Poll)
+        {
+            ArmPoll(pEntry.get(), pEntry->Events);
+        }
+        else if (pEntry->Kind != EntryKind::Write)
+        {
+            SubmitTransfer(pEntry.get());
+        }
+    }
+    else
+    {
+        epoll_event ev{};
+        ev.events = pEntry->Events;
+        ev.data.ptr = pEntry.get();
+        if (epoll_ctl(epollFd_.Get(), EPOLL_CTL_ADD, pEntry->Fd, &ev) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
+        }
+    }
+
+    const int fd = pEntry->Fd;
+    entries_.emplace(fd, std::move(pEntry));
+}
+
+Reactor::Entry* Reactor::GetEntry(int fd) const noexcept
+{
+    const auto it = entries_.find(fd);
+    assert(it != entries_.end());
+    return it->second.get();
+}
+
+void Reactor::Modify(int fd, std::uint32_t events)
+{
+    Entry* const pEntry = GetEntry(fd);
+    assert(pEntry->Kind == EntryKind::Poll);
+    pEntry->Events = events;
+
+    if (ring_)
+    {
+        // The poll request will be rearmed with the new events on its completion.
+        if (pEntry->IsPending)
+        {
+            Cancel(pEntry);
+        }
+        else
+        {
+            ArmPoll(pEntry, events);
+        }
+    }
+    else
+    {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.ptr = pEntry;
+        if (epoll_ctl(epollFd_.Get(), EPOLL_CTL_MOD, fd, &ev) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
+        }
+    }
+}
+
+void Reactor::Remove(int fd)
+{
+    const auto it = entries_.find(fd);
+    assert(it != entries_.end());
+    auto pEntry = std::move(it->second);
+    entries_.erase(it);
+    pEntry->IsRemoved = true;
+
+    if (ring_)
+    {
+        if (pEntry->IsPending)
+        {
+            // The completion of the request is the last reference; HandleIoUringCompletion deletes the entry.
+            Cancel(pEntry.get());
+            static_cast<void>(pEntry.release());
+            return;
+        }
+    }
+    else if (!pEntry->IsPaused)
+    {
+        if (epoll_ctl(epollFd_.Get(), EPOLL_CTL_DEL, fd, nullptr) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
+        }
+    }
+
+    removedEntries_.push_back(std::move(pEntry));
+}
+
+bool Reactor::Send(int fd, const void* buf, std::size_t len)
+{
+    Entry* const pEntry = GetEntry(fd);
+    assert(pEntry->Kind == EntryKind::Write);
+
+    WriteBuffer& buffer = pEntry->Writer->Buffer;
+    const bool isIdle = !buffer.HasPendingData();
+    buffer.Enqueue(buf, len);
+    if (!isIdle)
+    {
+        // Sent after the pending data: on the completion of the send in flight, or on EPOLLOUT.
+        return true;
+    }
+
+    if (ring_)
+    {
+        // Submitted by the next io_uring_enter along with the wait.
+        SubmitTransfer(pEntry);
+        return true;
+    }
+
+    return FlushWriter(pEntry);
+}
+
+std::size_t Reactor::GetPendingSendBytes(int fd) const noexcept
+{
+    const Entry* const pEntry = GetEntry(fd);
+    assert(pEntry->Kind == EntryKind::Write);
+    return pEntry->Writer->Buffer.GetPendingBytes();
+}
+
+void Reactor::Run()
+{
+    if (ring_)
+    {
+        RunIoUring();
+    }
+    else
+    {
+        RunEpoll();
+    }
+}
+
+void Reactor::RunEpoll()
+{
+    epoll_event events[MaxEvents];
+
+    while (true)
+    {
+        const int count = epoll_wait_restarting(epollFd_.Get(), events, MaxEvents, -1);
+        if (count == -1)
+        {
+            FatalErrorAbort(errno, "epoll_wait");
+        }
+
+        bool shouldContinue = true;
+        for (int i = 0; i < count && shouldContinue; i++)
+        {
+            auto* const pEntry = static_cast<Entry*>(events[i].data.ptr);
+            // A handler of this batch may have paused the entry.
+            if (!pEntry->IsRemoved && !pEntry->IsPaused)
+            {
+                shouldContinue = DispatchEpollEvent(pEntry, events[i].events);
+            }
+        }
+
+        removedEntries_.clear();
+
+        if (!shouldContinue)
+        {
+            return;
+        }
+    }
+}
+
+bool Reactor::DispatchEpollEvent(Entry* pEntry, std::uint32_t events)
+{
+    switch (pEntry->Kind)
+    {
+    case EntryKind::Poll:
+        return pEntry->Callback(events);
+
+    case EntryKind::Read:
+    case EntryKind::RecvMsg:
+    {
+        const ssize_t result = PerformTransfer(pEntry);
+        if (result == -1 && IsWouldBlockError(errno))
+        {
+            // Drained in the meantime (e.g. a timerfd rearmed by another thread).
+            return true;
+        }
+
+        return pEntry->TransferCallback(result);
+    }
+
+    case EntryKind::Write:
+    default:
+    {
+        const bool hadPendingData = pEntry->Writer->Buffer.HasPendingData();
+        if (!FlushWriter(pEntry))
+        {
+            return pEntry->TransferCallback(-1);
+        }
+
+        if (hadPendingData && !pEntry->Writer->Buffer.HasPendingData())
+        {
+            return pEntry->TransferCallback(0);
+        }
+
+        return true;
+    }
+    }
+}
+
+// ReactorBackend::Epoll: Performs the transfer of the entry with a nonblocking system call.
+ssize_t Reactor::PerformTransfer(Entry* pEntry) noexcept
+{
+    switch (pEntry->Kind)
+    {
+    case EntryKind::Read:
+        return read_restarting(pEntry->Fd, pEntry->Buffer, pEntry->Length);
+
+    case EntryKind::RecvMsg:
+        pEntry->Message->msg_controllen = pEntry->ControlLength;
+        pEntry->Message->msg_flags = 0;
+        return recvmsg_restarting(pEntry->Fd, pEntry->Message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+    case EntryKind::Write:
+        PrepareSendMessage(pEntry->Writer.get());
+        return sendmsg_restarting(pEntry->Fd, &pEntry->Writer->Message, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    case EntryKind::Poll:
+    default:
+        assert(false);
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+// ReactorBackend::Epoll: Sends pending data until it would block. Returns false and sets errno on error.
+bool Reactor::FlushWriter(Entry* pEntry)
+{
+    WriterState& writer = *pEntry->Writer;
+    while (writer.Buffer.HasPendingData())
+    {
+        const ssize_t bytesSent = PerformTransfer(pEntry);
+        if (bytesSent == -1)
+        {
+            if (!IsWouldBlockError(errno))
+            {
+                return false;
+            }
+
+            break;
+        }
+
+        writer.Buffer.Dequeue(static_cast<std::size_t>(bytesSent));
+    }
+
+    // NOTE: Arming re-evaluates the readiness; an edge is reported if the socket is already writable.
+    const bool hasPendingData = writer.Buffer.HasPendingData();
+    if (hasPendingData != writer.IsOutputArmed)
+    {
+        epoll_event ev{};
+        ev.events = hasPendingData ? (EPOLLOUT | EPOLLET) : EPOLLET;
+        ev.data.ptr = pEntry;
+        if (epoll_ctl(epollFd_.Get(), EPOLL_CTL_MOD, pEntry->Fd, &ev) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
+        }
+
+        writer.IsOutputArmed = hasPendingData;
+    }
+
+    return true;
+}
+
+void Reactor::RunIoUring()
+{
+    while (true)
+    {
+        // Submits the requests queued by the handlers and waits in one system call.
+        if (!ring_->SubmitAndWait())
+        {
+            FatalErrorAbort(errno, "io_uring_enter");
+        }
+
+        bool shouldContinue = true;
+        io_uring_cqe cqe;
+        while (shouldContinue && ring_->PopCqe(&cqe))
+        {
+            shouldContinue = HandleIoUringCompletion(cqe);
+        }
+
+        removedEntries_.clear();
+
+        if (!shouldContinue)
+        {
+            return;
+        }
+    }
+}
+
+bool Reactor::HandleIoUringCompletion(const io_uring_cqe& cqe)
+{
+    if (cqe.user_data == CancelUserData)
+    {
+        // The completion of the cancelled request itself tells the result.
+        return true;
+    }
+
+    auto* const pEntry = reinterpret_cast<Entry*>(static_cast<std::uintptr_t>(cqe.user_data));
+    pEntry->IsPending = false;
+
+    if (pEntry->IsRemoved)
+    {
+        delete pEntry;
+        return true;
+    }
+
+    if (pEntry->IsWaitingForReadiness)
+    {
+        pEntry->IsWaitingForReadiness = false;
+        if (cqe.res < 0 && cqe.res != -ECANCELED)
+        {
+            FatalErrorAbort(-cqe.res, "io_uring poll");
+        }
+
+        // Cancelled by SetReaderPaused, or resumed since.
+        if (!pEntry->IsPaused)
+        {
+            SubmitTransfer(pEntry);
+        }
+
+        return true;
+    }
+
+    if (pEntry->Kind != EntryKind::Poll)
+    {
+        return HandleTransferCompletion(pEntry, cqe.res);
+    }
+
+    if (cqe.res < 0)
+    {
+        if (cqe.res != -ECANCELED)
+        {
+            FatalErrorAbort(-cqe.res, "io_uring poll");
+        }
+
+        // Cancelled by Modify.
+        ArmPoll(pEntry, pEntry->Events);
+        return true;
+    }
+
+    const bool shouldContinue = pEntry->Callback(static_cast<std::uint32_t>(cqe.res));
+
+    // The handler may have removed or rearmed (through Modify) the entry.
+    if (!pEntry->IsRemoved)
+    {
+        ArmPoll(pEntry, pEntry->Events);
+    }
+
+    return shouldContinue;
+}
+
+bool Reactor::HandleTransferCompletion(Entry* pEntry, int res)
+{
+    if (res == -ECANCELED)
+    {
+        // Cancelled by SetReaderPaused. Resubmit if resumed in the meantime.
+        if (!pEntry->IsPaused)
+        {
+            SubmitTransfer(pEntry);
+        }
+
+        return true;
+    }
+
+    if (res == -EAGAIN || res == -EINTR)
+    {
+        // A nonblocking fd that is not ready. Retry on readiness (after the reader is resumed if paused).
+        if (!pEntry->IsPaused)
+        {
+            pEntry->IsWaitingForReadiness = true;
+            ArmPoll(pEntry, pEntry->Kind == EntryKind::Write ? EPOLLOUT : EPOLLIN);
+        }
+
+        return true;
+    }
+
+    if (res < 0)
+    {
+        errno = -res;
+    }
+    const ssize_t result = res < 0 ? -1 : res;
+
+    if (pEntry->Kind == EntryKind::Write)
+    {
+        if (result == -1)
+        {
+            return pEntry->TransferCallback(-1);
+        }
+
+        // Send the rest (a partial send) and the data queued in the meantime.
+        WriteBuffer& buffer = pEntry->Writer->Buffer;
+        buffer.Dequeue(static_cast<std::size_t>(result));
+        if (buffer.HasPendingData())
+        {
+            SubmitTransfer(pEntry);
+            return true;
+        }
+
+        return pEntry->TransferCallback(0);
+    }
+
+    const bool shouldContinue = pEntry->TransferCallback(result);
+
+    // The handler may have removed or paused the entry.
+    if (!pEntry->IsRemoved && !pEntry->IsPaused)
+    {
+        SubmitTransfer(pEntry);
+    }
+
+    return shouldContinue;
+}
+
+void Reactor::ArmPoll(Entry* pEntry, std::uint32_t events)
+{
+    // Only EPOLLERR or EPOLLHUP would be reported. Arm again when the interest is modified.
+    if (pEntry->IsPending || !(events & (EPOLLIN | EPOLLOUT)))
+    {
+        return;
+    }
+
+    io_uring_sqe* const pSqe = ring_->GetSqe();
+    pSqe->opcode = IORING_OP_POLL_ADD;
+    pSqe->fd = pEntry->Fd;
+    pSqe->poll32_events = ToPoll32Events(events & ~static_cast<std::uint32_t>(EPOLLET));
+    pSqe->user_data = reinterpret_cast<std::uintptr_t>(pEntry);
+    pEntry->IsPending = true;
+}
+
+void Reactor::SubmitTransfer(Entry* pEntry)
+{
+    assert(!pEntry->IsPending);
+
+    io_uring_sqe* const pSqe = ring_->GetSqe();
+    pSqe->fd = pEntry->Fd;
+    pSqe->user_data = reinterpret_cast<std::uintptr_t>(pEntry);
+
+    switch (pEntry->Kind)
+    {
+    case EntryKind::Read:
+        pSqe->opcode = IORING_OP_READ;
+        pSqe->addr = reinterpret_cast<std::uintptr_t>(pEntry->Buffer);
+        pSqe->len = static_cast<std::uint32_t>(pEntry->Length);
+        // The current position. Our fds (pipes, signalfds, timerfds) have none anyway.
+        pSqe->off = ~std::uint64_t{0};
+        break;
+
+    case EntryKind::RecvMsg:
+        pEntry->Message->msg_controllen = pEntry->ControlLength;
+        pEntry->Message->msg_flags = 0;
+        pSqe->opcode = IORING_OP_RECVMSG;
+        pSqe->addr = reinterpret_cast<std::uintptr_t>(pEntry->Message);
+        pSqe->len = 1;
+        pSqe->msg_flags = MSG_CMSG_CLOEXEC;
+        break;
+
+    case EntryKind::Write:
+        PrepareSendMessage(pEntry->Writer.get());
+        pSqe->opcode = IORING_OP_SENDMSG;
+        pSqe->addr = reinterpret_cast<std::uintptr_t>(&pEntry->Writer->Message);
+        pSqe->len = 1;
+        pSqe->msg_flags = MSG_NOSIGNAL;
+        break;
+
+    case EntryKind::Poll:
+    default:
+        assert(false);
+        break;
+    }
+
+    pEntry->IsPending = true;
+}
+
+void Reactor::PrepareSendMessage(WriterState* pWriter) noexcept
+{
+    // NOTE: Data enqueued while the send is in flight goes after the ranges captured here.
+    pWriter->Message = {};
+    pWriter->Message.msg_iov = pWriter->Iov;
+    pWriter->Message.msg_iovlen = pWriter->Buffer.GetPendingData(pWriter->Iov, MaxSendIovCount);
+}
+
+void Reactor::Cancel(Entry* pEntry)
+{
+    io_uring_sqe* const pSqe = ring_->GetSqe();
+    pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+    pSqe->fd = -1;
+    pSqe->addr = reinterpret_cast<std::uintptr_t>(pEntry);
+    pSqe->user_data = CancelUserData;
+}
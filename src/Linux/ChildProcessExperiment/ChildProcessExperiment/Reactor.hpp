@@ -0,0 +1,143 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "UniqueResource.hpp"
+#include "WriteBuffer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+class IoUring;
+struct io_uring_cqe;
+
+enum class ReactorBackend
+{
+    Epoll,
+    // Transfers (AddReader, AddMessageReader, AddWriter) are submitted as IORING_OP_READ/RECVMSG/SENDMSG,
+    // and fds registered with Add have a oneshot IORING_OP_POLL_ADD in flight.
+    // All submissions are batched into the io_uring_enter that waits.
+    IoUring,
+};
+
+// Dispatches events to handlers registered per fd.
+// NOTE: Not thread-safe. Register, modify and remove fds only on the thread running Run (including from handlers).
+class Reactor final
+{
+public:
+    // Receives the epoll events of the fd. Returns false to stop the reactor.
+    using Handler = std::function<bool(std::uint32_t events)>;
+    // Receives the result of a transfer performed by the reactor: the number of bytes, or -1 with errno set.
+    // Returns false to stop the reactor.
+    using TransferHandler = std::function<bool(ssize_t result)>;
+
+    explicit Reactor(ReactorBackend backend);
+    ~Reactor();
+
+    // Whether the kernel supports ReactorBackend::IoUring.
+    [[nodiscard]] static bool IsIoUringSupported() noexcept;
+
+    // The caller keeps the ownership of fd and must remove it before closing it.
+    // NOTE: With ReactorBackend::IoUring, EPOLLET is treated as level-triggered. Handlers must make progress
+    //       (or modify the interest) on each event.
+    void Add(int fd, std::uint32_t events, Handler handler);
+    void Modify(int fd, std::uint32_t events);
+    void Remove(int fd);
+
+    // Reads up to len bytes into buf whenever fd has data and passes the result to handler.
+    // buf must stay valid until the handler is destroyed, which can be after Remove with ReactorBackend::IoUring
+    // (a receive in flight). The handler should stop the reactor on 0 (end of file).
+    void AddReader(int fd, void* buf, std::size_t len, TransferHandler handler);
+    // AddReader with recvmsg (MSG_CMSG_CLOEXEC). msg_controllen is restored before each receive.
+    // *pMsg is read at each receive; the handler may point it elsewhere for the next one.
+    void AddMessageReader(int fd, msghdr* pMsg, TransferHandler handler);
+    // Stops or resumes receiving on a reader. A receive already in flight may still complete after pausing.
+    void SetReaderPaused(int fd, bool paused);
+    // Registers fd for Send. handler receives -1 if a background send fails,
+    // or 0 when data that could not be sent immediately has all been sent.
+    void AddWriter(int fd, TransferHandler handler);
+    // Sends the data on fd after the data of previous calls. The data is copied.
+    // Returns false and sets errno if an immediate send fails.
+    [[nodiscard]] bool Send(int fd, const void* buf, std::size_t len);
+    // The number of bytes passed to Send on fd and not sent yet.
+    [[nodiscard]] std::size_t GetPendingSendBytes(int fd) const noexcept;
+
+    // Dispatches events until a handler returns false.
+    void Run();
+
+private:
+    enum class EntryKind
+    {
+        Poll,
+        Read,
+        RecvMsg,
+        Write,
+    };
+
+    static const constexpr std::size_t MaxSendIovCount = 64;
+
+    struct WriterState final
+    {
+        WriteBuffer Buffer;
+        // The sendmsg in flight (ReactorBackend::IoUring) refers to these.
+        msghdr Message;
+        iovec Iov[MaxSendIovCount];
+        // ReactorBackend::Epoll: EPOLLOUT is registered.
+        bool IsOutputArmed;
+    };
+
+    struct Entry final
+    {
+        int Fd;
+        EntryKind Kind;
+        // EntryKind::Poll
+        Handler Callback;
+        // The other kinds
+        TransferHandler TransferCallback;
+        std::uint32_t Events;
+        // EntryKind::Read
+        void* Buffer;
+        std::size_t Length;
+        // EntryKind::RecvMsg
+        msghdr* Message;
+        std::size_t ControlLength;
+        // EntryKind::Write
+        std::unique_ptr<WriterState> Writer;
+        bool IsRemoved;
+        // EntryKind::Read, RecvMsg: SetReaderPaused. With ReactorBackend::Epoll, the fd is not in the epoll set.
+        bool IsPaused;
+        // ReactorBackend::IoUring: A request for this entry is in flight.
+        bool IsPending;
+        // ReactorBackend::IoUring: The request in flight is a poll for a transfer that returned EAGAIN.
+        bool IsWaitingForReadiness;
+    };
+
+    static const constexpr int MaxEvents = 16;
+    static const constexpr unsigned int IoUringEntries = 64;
+
+    void AddEntry(std::unique_ptr<Entry> pEntry);
+    [[nodiscard]] Entry* GetEntry(int fd) const noexcept;
+    void RunEpoll();
+    [[nodiscard]] bool DispatchEpollEvent(Entry* pEntry, std::uint32_t events);
+    [[nodiscard]] ssize_t PerformTransfer(Entry* pEntry) noexcept;
+    [[nodiscard]] bool FlushWriter(Entry* pEntry);
+    void RunIoUring();
+    [[nodiscard]] bool HandleIoUringCompletion(const io_uring_cqe& cqe);
+    [[nodiscard]] bool HandleTransferCompletion(Entry* pEntry, int res);
+    void ArmPoll(Entry* pEntry, std::uint32_t events);
+    void SubmitTransfer(Entry* pEntry);
+    static void PrepareSendMessage(WriterState* pWriter) noexcept;
+    void Cancel(Entry* pEntry);
+
+    UniqueFd epollFd_;
+    std::unique_ptr<IoUring> ring_;
+    std::unordered_map<int, std::unique_ptr<Entry>> entries_;
+    // Entries removed while dispatching; pending events of the same batch may still refer to them.
+    std::vector<std::unique_ptr<Entry>> removedEntries_;
+};
@@ -11,7 +11,8 @@
 
 namespace
 {
-    void GetStringArrayAndAdvance(BinaryReader& br, std::vector<const char*>* buf)
+    // Also reserves room for the terminating nullptr so that the array is allocated exactly once.
+    void GetStringArrayAndAdvance(BinaryReader& br, StringArray* buf, Arena* pArena)
     {
         const auto count = br.Read<std::uint32_t>();
         if (count > MaxStringArrayCount)
@@ -20,25 +21,52 @@ namespace
             throw BadRequestError(E2BIG);
         }
 
+        *buf = StringArray(ArenaAllocator<const char*>(pArena));
+        buf->reserve(count + 1);
         for (std::uint32_t i = 0; i < count; i++)
         {
             buf->push_back(br.GetStringAndAdvance());
         }
     }
-} // namespace
 
-void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length)
-{
-    try
+    // RegisterFlags. Reserved bits must be clear so that they can be given a meaning later.
+    [[nodiscard]] std::uint32_t ReadRegisterFlags(BinaryReader& br)
+    {
+        const auto flags = br.Read<std::uint32_t>();
+        if ((flags & ~static_cast<std::uint32_t>(RegisterFlagsServiceScope)) != 0)
+        {
+            TRACE_ERROR("Unknown register flags: %x\n", static_cast<unsigned int>(flags));
+            throw BadRequestError(ErrorCode::InvalidRequest);
+        }
+
+        return flags;
+    }
+
+    void ReadSpawnProcessRequest(SpawnProcessRequest* r, BinaryReader& br, Arena* pArena)
     {
-        BinaryReader br{data.get(), length};
-        r->Data = std::move(data);
         r->Token = br.Read<std::uint64_t>();
         r->Flags = br.Read<std::uint32_t>();
         r->WorkingDirectory = br.GetStringAndAdvance();
         r->ExecutablePath = br.GetStringAndAdvance();
-        GetStringArrayAndAdvance(br, &r->Argv);
-        GetStringArrayAndAdvance(br, &r->Envp);
+        GetStringArrayAndAdvance(br, &r->Argv, pArena);
+        GetStringArrayAndAdvance(br, &r->Envp, pArena);
+        if (r->Flags & RequestFlagsEnvironmentBlock)
+        {
+            r->EnvironmentId = br.Read<std::uint32_t>();
+        }
+        if (r->Flags & RequestFlagsDeadline)
+        {
+            r->DeadlineMilliseconds = br.Read<std::uint32_t>();
+            r->GracePeriodMilliseconds = br.Read<std::uint32_t>();
+        }
+        if (r->Flags & RequestFlagsGroupTag)
+        {
+            r->GroupTag = br.Read<std::uint32_t>();
+        }
+        if (r->Flags & RequestFlagsJobGroup)
+        {
+            r->JobGroupId = br.Read<std::uint32_t>();
+        }
 
         r->Argv.push_back(nullptr);
         r->Envp.push_back(nullptr);
@@ -48,6 +76,27 @@ void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, std::unique_ptr<cons
             TRACE_ERROR("ExecutablePath was nullptr.\n");
             throw BadRequestError(ErrorCode::InvalidRequest);
         }
+
+        if (!(r->Flags & RequestFlagsServiceAssignedToken) && IsServiceAssignedToken(r->Token))
+        {
+            TRACE_ERROR("Token reserved for the service: %llx\n", static_cast<unsigned long long>(r->Token));
+            throw BadRequestError(ErrorCode::InvalidRequest);
+        }
+
+        if (GetSpawnMethod(*r) > SpawnMethod::Zygote)
+        {
+            TRACE_ERROR("Unknown spawn method: %u\n", static_cast<unsigned int>(GetSpawnMethod(*r)));
+            throw BadRequestError(ErrorCode::InvalidRequest);
+        }
+    }
+} // namespace
+
+void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, const std::byte* data, std::size_t length, Arena* pArena)
+{
+    try
+    {
+        BinaryReader br{data, length};
+        ReadSpawnProcessRequest(r, br, pArena);
     }
     catch ([[maybe_unused]] const BadBinaryError& exn)
     {
@@ -56,11 +105,104 @@ void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, std::unique_ptr<cons
     }
 }
 
-void DeserializeSendSignalRequest(SendSignalRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length)
+void DeserializeSpawnProcessBatchRequest(std::vector<SpawnProcessRequest>* entries, const std::byte* data, std::size_t length, Arena* pArena)
+{
+    try
+    {
+        BinaryReader br{data, length};
+
+        const auto count = br.Read<std::uint32_t>();
+        if (count > MaxSpawnProcessBatchCount)
+        {
+            TRACE_ERROR("count > MaxSpawnProcessBatchCount: %u\n", static_cast<unsigned int>(count));
+            throw BadRequestError(E2BIG);
+        }
+
+        entries->resize(count);
+        for (auto& r : *entries)
+        {
+            const auto entryLength = br.Read<std::uint32_t>();
+            BinaryReader entryReader{br.GetBytesAndAdvance(entryLength), entryLength};
+            ReadSpawnProcessRequest(&r, entryReader, pArena);
+        }
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeRegisterEnvironmentRequest(RegisterEnvironmentRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length)
+{
+    try
+    {
+        BinaryReader br{data.get(), length};
+        auto pBlock = std::make_shared<EnvironmentBlock>();
+        r->Flags = ReadRegisterFlags(br);
+        GetStringArrayAndAdvance(br, &pBlock->Envp, nullptr);
+        pBlock->Envp.push_back(nullptr);
+        pBlock->Data = std::move(data);
+        r->Block = std::move(pBlock);
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeRegisterSpawnTemplateRequest(RegisterSpawnTemplateRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length)
 {
     try
     {
         BinaryReader br{data.get(), length};
+        r->Flags = ReadRegisterFlags(br);
+        r->Spawn.Data = std::move(data);
+        ReadSpawnProcessRequest(&r->Spawn, br, nullptr);
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeUnregisterRequest(UnregisterRequest* r, const std::byte* data, std::size_t length)
+{
+    try
+    {
+        BinaryReader br{data, length};
+        r->Id = br.Read<std::uint32_t>();
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeSpawnFromTemplateRequest(SpawnFromTemplateRequest* r, const std::byte* data, std::size_t length, Arena* pArena)
+{
+    try
+    {
+        BinaryReader br{data, length};
+        r->TemplateId = br.Read<std::uint32_t>();
+        r->Token = br.Read<std::uint64_t>();
+        GetStringArrayAndAdvance(br, &r->Argv, pArena);
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeSendSignalRequest(SendSignalRequest* r, const std::byte* data, std::size_t length)
+{
+    try
+    {
+        BinaryReader br{data, length};
         r->Token = br.Read<std::uint64_t>();
         r->Signal = static_cast<AbstractSignal>(br.Read<std::uint32_t>());
     }
@@ -70,3 +212,63 @@ void DeserializeSendSignalRequest(SendSignalRequest* r, std::unique_ptr<const st
         throw BadRequestError(ErrorCode::InvalidRequest);
     }
 }
+
+void DeserializeJobGroupRequest(JobGroupRequest* r, RequestCommand command, const std::byte* data, std::size_t length)
+{
+    try
+    {
+        BinaryReader br{data, length};
+        r->Id = br.Read<std::uint32_t>();
+        r->Frozen = command == RequestCommand::FreezeJobGroup && br.Read<std::uint32_t>() != 0;
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
+
+void DeserializeSendSignalBulkRequest(SendSignalBulkRequest* r, const std::byte* data, std::size_t length)
+{
+    try
+    {
+        BinaryReader br{data, length};
+        r->Signal = static_cast<AbstractSignal>(br.Read<std::uint32_t>());
+        r->Target = static_cast<SendSignalBulkTarget>(br.Read<std::uint32_t>());
+        switch (r->Target)
+        {
+        case SendSignalBulkTarget::Tokens:
+        {
+            const auto count = br.Read<std::uint32_t>();
+            if (count > MaxSendSignalBulkCount)
+            {
+                TRACE_ERROR("count > MaxSendSignalBulkCount: %u\n", static_cast<unsigned int>(count));
+                throw BadRequestError(E2BIG);
+            }
+
+            r->Tokens.resize(count);
+            for (auto& token : r->Tokens)
+            {
+                token = br.Read<std::uint64_t>();
+            }
+            break;
+        }
+
+        case SendSignalBulkTarget::AllChildren:
+            break;
+
+        case SendSignalBulkTarget::GroupTag:
+            r->GroupTag = br.Read<std::uint32_t>();
+            break;
+
+        default:
+            TRACE_ERROR("Unknown target: %u\n", static_cast<unsigned int>(r->Target));
+            throw BadRequestError(ErrorCode::InvalidRequest);
+        }
+    }
+    catch ([[maybe_unused]] const BadBinaryError& exn)
+    {
+        TRACE_ERROR("BadBinaryError: %s\n", exn.what());
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+}
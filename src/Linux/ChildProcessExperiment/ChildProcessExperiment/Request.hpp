@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include "Arena.hpp"
 #include "UniqueResource.hpp"
 #include <cstddef>
 #include <cstdint>
@@ -11,12 +12,40 @@
 // Limitations to prevent OOM errors.
 const std::uint32_t MaxMessageLength = 2 * 1024 * 1024;
 const std::uint32_t MaxStringArrayCount = 64 * 1024;
+const std::uint32_t MaxSpawnProcessBatchCount = 4 * 1024;
+const std::uint32_t MaxSendSignalBulkCount = 64 * 1024;
+// Per registry (subchannel or service).
+const std::uint32_t MaxEnvironmentBlockCount = 1024;
+const std::uint32_t MaxSpawnTemplateCount = 1024;
+// Per service.
+const std::uint32_t MaxJobGroupCount = 1024;
 
 // NOTE: Make sure to sync with the client.
 enum class RequestCommand : std::uint32_t
 {
     SpawnProcess = 0,
     SendSignal = 1,
+    SpawnProcessBatch = 2,
+    RegisterEnvironment = 3,
+    UnregisterEnvironment = 4,
+    RegisterSpawnTemplate = 5,
+    UnregisterSpawnTemplate = 6,
+    SpawnFromTemplate = 7,
+    SendSignalBulk = 8,
+    CreateJobGroup = 9,
+    DeleteJobGroup = 10,
+    FreezeJobGroup = 11,
+    KillJobGroup = 12,
+    GetJobGroupStats = 13,
+};
+
+// NOTE: Make sure to sync with the client.
+// Sent as the data byte of a subchannel creation request.
+enum SubchannelCreationFlags
+{
+    // Every request carries a request ID and every response is tagged with it.
+    // Requests may be processed concurrently and responses may be sent out of order.
+    SubchannelFlagsPipelined = 1 << 0,
 };
 
 enum class AbstractSignal : std::uint32_t
@@ -26,33 +55,195 @@ enum class AbstractSignal : std::uint32_t
     Termination = 15,
 };
 
+// NOTE: Make sure to sync with the client.
+enum class SpawnMethod : std::uint32_t
+{
+    // Use the default of the service.
+    Default = 0,
+    Fork = 1,
+    CloneVfork = 2,
+    PosixSpawn = 3,
+    // Falls back to Fork if the zygote is not running (see Zygote.hpp).
+    Zygote = 4,
+};
+
+// Tokens with this bit set are assigned by the service (RequestFlagsServiceAssignedToken).
+const std::uint64_t ServiceAssignedTokenBit = 1ull << 63;
+
+[[nodiscard]] inline bool IsServiceAssignedToken(std::uint64_t token) noexcept
+{
+    return (token & ServiceAssignedTokenBit) != 0;
+}
+
+// Helper shards (--shard=INDEX/COUNT). A service-assigned token carries the index of the shard that assigned it in bits 56-62.
+const std::uint32_t MaxShardCount = 128;
+const int ServiceAssignedTokenShardShift = 56;
+
+// Returns the shard a request concerning token shall be sent to.
+// Service-assigned tokens are routed to the shard that assigned them; others are routed by hash.
+[[nodiscard]] inline std::uint32_t GetShardOfToken(std::uint64_t token, std::uint32_t shardCount) noexcept
+{
+    if (IsServiceAssignedToken(token))
+    {
+        return static_cast<std::uint32_t>(token >> ServiceAssignedTokenShardShift) & (MaxShardCount - 1);
+    }
+
+    // Fibonacci hashing; tokens tend to be sequential.
+    return static_cast<std::uint32_t>(((token * 0x9E3779B97F4A7C15ull) >> 32) % shardCount);
+}
+
 enum SpawnProcessRequestFlags
 {
     RequestFlagsRedirectStdin = 1 << 0,
     RequestFlagsRedirectStdout = 1 << 1,
     RequestFlagsRedirectStderr = 1 << 2,
+    // Ignore Token and let the service assign one. The response will carry the token.
+    RequestFlagsServiceAssignedToken = 1 << 3,
+    // Use the registered environment block specified by EnvironmentId. Envp is an overlay on it.
+    RequestFlagsEnvironmentBlock = 1 << 4,
+    // The service terminates the child on DeadlineMilliseconds (see DeadlineScheduler).
+    RequestFlagsDeadline = 1 << 5,
+    // Tag the child with GroupTag (see SendSignalBulkTarget::GroupTag).
+    RequestFlagsGroupTag = 1 << 6,
+    // Place the child in the job group JobGroupId (see JobGroup). Always spawned with SpawnMethod::Fork.
+    RequestFlagsJobGroup = 1 << 7,
+    // Bits 8-11 specify a SpawnMethod.
+    RequestFlagsSpawnMethodShift = 8,
+    RequestFlagsSpawnMethodMask = 0xf << RequestFlagsSpawnMethodShift,
 };
 
+// Pointers into a request body. Allocated from the arena of the subchannel while the request is handled in place.
+using StringArray = std::vector<const char*, ArenaAllocator<const char*>>;
+
+// An environment registered by RequestCommand::RegisterEnvironment.
+struct EnvironmentBlock final
+{
+    std::shared_ptr<const std::byte[]> Data;
+    // Terminated by nullptr.
+    StringArray Envp;
+};
+
+struct SpawnTemplate;
+class JobGroup;
+
 struct SpawnProcessRequest final
 {
-    std::unique_ptr<const std::byte[]> Data;
+    // Shared among the entries of a batch.
+    std::shared_ptr<const std::byte[]> Data;
     std::uint64_t Token;
     std::uint32_t Flags;
     const char* WorkingDirectory;
     const char* ExecutablePath;
-    std::vector<const char*> Argv;
-    std::vector<const char*> Envp;
+    StringArray Argv;
+    StringArray Envp;
+    // RequestFlagsEnvironmentBlock
+    std::uint32_t EnvironmentId;
+    // RequestFlagsDeadline: From the spawn. The child is sent SIGKILL GracePeriodMilliseconds after SIGTERM.
+    std::uint32_t DeadlineMilliseconds = 0;
+    std::uint32_t GracePeriodMilliseconds = 0;
+    // RequestFlagsGroupTag. Children spawned without the flag have the tag 0.
+    std::uint32_t GroupTag = 0;
+    // RequestFlagsJobGroup
+    std::uint32_t JobGroupId = 0;
+    // Set by ResolveEnvironment. If Envp has no entries, Environment->Envp is used as is;
+    // otherwise Envp is the result of applying the overlay to Environment->Envp.
+    std::shared_ptr<const EnvironmentBlock> Environment;
+    // RequestCommand::SpawnFromTemplate: Owns WorkingDirectory, ExecutablePath and the prefix of Argv.
+    std::shared_ptr<const SpawnTemplate> Template;
+    // Set by ResolveJobGroup.
+    std::shared_ptr<const JobGroup> Job;
     UniqueFd StdinFd;
     UniqueFd StdoutFd;
     UniqueFd StderrFd;
 };
 
+[[nodiscard]] inline SpawnMethod GetSpawnMethod(const SpawnProcessRequest& r) noexcept
+{
+    return static_cast<SpawnMethod>((r.Flags & RequestFlagsSpawnMethodMask) >> RequestFlagsSpawnMethodShift);
+}
+
+[[nodiscard]] inline const char* const* GetEnvp(const SpawnProcessRequest& r) noexcept
+{
+    return r.Environment && r.Envp.size() == 1 ? &r.Environment->Envp[0] : &r.Envp[0];
+}
+
+// RegisterEnvironment, RegisterSpawnTemplate
+enum RegisterFlags
+{
+    // Available to all subchannels.
+    RegisterFlagsServiceScope = 1 << 0,
+};
+
+struct RegisterEnvironmentRequest final
+{
+    std::uint32_t Flags;
+    std::shared_ptr<EnvironmentBlock> Block;
+};
+
+struct RegisterSpawnTemplateRequest final
+{
+    std::uint32_t Flags;
+    // Token is ignored.
+    SpawnProcessRequest Spawn;
+};
+
+// UnregisterEnvironment, UnregisterSpawnTemplate
+struct UnregisterRequest final
+{
+    std::uint32_t Id;
+};
+
+struct SpawnFromTemplateRequest final
+{
+    std::shared_ptr<const std::byte[]> Data;
+    std::uint32_t TemplateId;
+    std::uint64_t Token;
+    // Appended to the argv prefix of the template. Not terminated by nullptr.
+    StringArray Argv;
+};
+
 struct SendSignalRequest final
 {
     std::uint64_t Token;
     AbstractSignal Signal;
 };
 
+// NOTE: Make sure to sync with the client.
+enum class SendSignalBulkTarget : std::uint32_t
+{
+    Tokens = 0,
+    AllChildren = 1,
+    // Children spawned with RequestFlagsGroupTag and GroupTag.
+    GroupTag = 2,
+};
+
+// DeleteJobGroup, FreezeJobGroup, KillJobGroup, GetJobGroupStats
+struct JobGroupRequest final
+{
+    std::uint32_t Id;
+    // FreezeJobGroup: Freeze if true; thaw otherwise.
+    bool Frozen;
+};
+
+struct SendSignalBulkRequest final
+{
+    AbstractSignal Signal;
+    SendSignalBulkTarget Target;
+    // SendSignalBulkTarget::GroupTag
+    std::uint32_t GroupTag;
+    // SendSignalBulkTarget::Tokens
+    std::vector<std::uint64_t> Tokens;
+};
+
 // NOTE: DeserializeSpawnProcessRequest does not set fds.
-void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length);
-void DeserializeSendSignalRequest(SendSignalRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length);
+// NOTE: Requests deserialized from a borrowed `const std::byte*` refer to data without owning it. Set Data to keep it alive.
+// pArena: Allocates the string arrays from it (from the heap if nullptr). The request must not outlive its next Reset.
+void DeserializeSpawnProcessRequest(SpawnProcessRequest* r, const std::byte* data, std::size_t length, Arena* pArena);
+void DeserializeSpawnProcessBatchRequest(std::vector<SpawnProcessRequest>* entries, const std::byte* data, std::size_t length, Arena* pArena);
+void DeserializeRegisterEnvironmentRequest(RegisterEnvironmentRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length);
+void DeserializeRegisterSpawnTemplateRequest(RegisterSpawnTemplateRequest* r, std::unique_ptr<const std::byte[]> data, std::size_t length);
+void DeserializeUnregisterRequest(UnregisterRequest* r, const std::byte* data, std::size_t length);
+void DeserializeSpawnFromTemplateRequest(SpawnFromTemplateRequest* r, const std::byte* data, std::size_t length, Arena* pArena);
+void DeserializeSendSignalRequest(SendSignalRequest* r, const std::byte* data, std::size_t length);
+void DeserializeJobGroupRequest(JobGroupRequest* r, RequestCommand command, const std::byte* data, std::size_t length);
+void DeserializeSendSignalBulkRequest(SendSignalBulkRequest* r, const std::byte* data, std::size_t length);
@@ -4,35 +4,48 @@
 #include "AncillaryDataSocket.hpp"
 #include "Base.hpp"
 #include "ChildProcessState.hpp"
+#include "DeadlineScheduler.hpp"
 #include "Globals.hpp"
+#include "JobGroup.hpp"
 #include "MiscHelpers.hpp"
+#include "Reactor.hpp"
+#include "Request.hpp"
+#include "ServiceOptions.hpp"
 #include "SignalHandler.hpp"
+#include "SpawnExecutor.hpp"
 #include "SocketHelpers.hpp"
 #include "Subchannel.hpp"
+#include "SubchannelWorkerPool.hpp"
 #include "UniqueResource.hpp"
 #include "WriteBuffer.hpp"
+#include "Zygote.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <memory>
-#include <poll.h>
+#include <mutex>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
 
 static_assert(sizeof(pid_t) == sizeof(int32_t));
 
 namespace
 {
-    enum
-    {
-        PollIndexSignalData = 0,
-        PollIndexChildCreation = 1,
-        PollIndexMainChannel = 2,
-    };
-    const int PollFdCount = 3;
+    const int ReaperMaxEvents = 64;
+    const int SignalFdMaxSignals = 16;
+    const int SignalDataMaxSignals = 16;
+    const std::size_t ReapRequestBufferSize = 256;
 
     static_assert(sizeof(pid_t) == sizeof(int));
 
@@ -40,20 +53,77 @@ namespace
     int g_SignalDataPipeReadEnd;
     int g_SignalDataPipeWriteEnd;
 
+    // SignalIntakeMode::SignalFd: SIGINT, SIGQUIT and SIGCHLD are read from here instead of the pipes. -1 otherwise.
+    int g_SignalFd = -1;
+
     // Subchannels will write a dummy byte here to request the service to reap children. SIGCHLD will also be written here.
     int g_ReapRequestPipeReadEnd;
     int g_ReapRequestPipeWriteEnd;
 
+    // ReaperMode::PidFd: pidfds of children are registered here with ChildProcessState* as the data
+    // (nullptr for g_ZygotePidFd). -1 otherwise.
+    int g_ReaperEpollFd = -1;
+    // ReaperMode::PidFd with SpawnMethod::Zygote: The zygote is not in g_ChildProcessStateMap, so it is watched separately.
+    UniqueFd g_ZygotePidFd;
+
+    // ReaperMode::PidFd: children we could not obtain pidfds for (EMFILE, etc.). These are reaped on SIGCHLD.
+    std::mutex g_UntrackedChildPidsMutex;
+    std::vector<int> g_UntrackedChildPids;
+    std::atomic<bool> g_IsSigchldHandlerInstalled{false};
+
     std::unique_ptr<AncillaryDataSocket> g_MainChannel;
+
+    // The reactor reads into these and then calls the handlers.
+    signalfd_siginfo g_SignalFdInfos[SignalFdMaxSignals];
+    int g_SignalData[SignalDataMaxSignals];
+    std::byte g_ReapRequestData[ReapRequestBufferSize];
+    std::uint64_t g_TimerExpirations;
+
+    // A subchannel creation request (1 byte of flags with a subchannel fd) received by the reactor.
+    std::uint8_t g_SubchannelFlags;
+    iovec g_MainChannelIov;
+    CmsgFds g_MainChannelCmsgFds;
+    msghdr g_MainChannelMessage;
+
+    // Exit notifications (in the format of g_ServiceOptions.ExitNotifications) produced during the current reap pass.
+    // Sent together by FlushExitNotifications.
+    std::vector<std::byte> g_PendingExitNotifications;
+
+    // A duplicate of the main channel fd registered as the reactor writer of exit notifications;
+    // the main channel fd itself is registered as a reader.
+    UniqueFd g_MainChannelOutputFd;
+
+    std::unique_ptr<Reactor> g_Reactor;
+
+    // RequestFlagsDeadline. Its timerfd is polled by the reactor.
+    std::unique_ptr<DeadlineScheduler> g_DeadlineScheduler;
+
+    // SubchannelMode::WorkerPool only.
+    // NOTE: Never deleted. The detached workers keep running until the process exits.
+    SubchannelWorkerPool* g_SubchannelWorkerPool = nullptr;
+    // NOTE: Never deleted. Destroying the condition variable its idle workers wait on would block at exit.
+    SpawnExecutor* g_SpawnExecutor = nullptr;
 } // namespace
 
 void SetupService(int mainChannelFd);
-[[nodiscard]] bool HandleSignalDataPipeInput();
-[[nodiscard]] bool HandleReapRequestPipeInput();
+[[nodiscard]] bool IsPidFdReaperSupported() noexcept;
+void WatchZygote();
+[[nodiscard]] bool HandleSignalDataPipeInput(ssize_t bytesRead);
+[[nodiscard]] bool HandleSignalFdInput(ssize_t bytesRead);
+[[nodiscard]] bool HandleSignal(int signum);
+[[nodiscard]] bool HandleReapRequestPipeInput(ssize_t bytesRead);
 [[nodiscard]] bool HandleReapRequest();
-[[nodiscard]] bool HandleMainChannelInput();
-[[nodiscard]] bool HandleMainChannelOutput();
-[[nodiscard]] bool NotifyClientOfExitedChild(ChildProcessState* pState, siginfo_t siginfo);
+[[nodiscard]] bool HandleTimerInput(ssize_t bytesRead);
+void ReapExitedChildren();
+void ReapUntrackedChildren();
+[[nodiscard]] bool HandleReaperInput();
+void ReapChildrenOfPidFdEvents(const epoll_event* events, int count);
+void ReapZygote();
+void ReapChild(ChildProcessState* pState, const siginfo_t& siginfo);
+[[nodiscard]] bool HandleMainChannelInput(ssize_t bytesReceived);
+[[nodiscard]] bool HandleMainChannelOutputError();
+void QueueExitNotification(ChildProcessState* pState, const siginfo_t& siginfo, const struct rusage* pUsage);
+[[nodiscard]] bool FlushExitNotifications();
 
 void SetupService(int mainChannelFd)
 {
@@ -81,7 +151,121 @@ void SetupService(int mainChannelFd)
         g_SignalDataPipeWriteEnd = maybePipe->WriteEnd.Release();
     }
 
-    SetupSignalHandlers();
+    if (g_ServiceOptions.Reaper == ReaperMode::PidFd)
+    {
+        if (IsPidFdReaperSupported())
+        {
+            g_ReaperEpollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (g_ReaperEpollFd == -1)
+            {
+                FatalErrorAbort(errno, "epoll_create1");
+            }
+        }
+        else
+        {
+            TRACE_INFO("pidfds not supported. Falling back to SIGCHLD.\n");
+        }
+    }
+
+    SetupJobGroups(g_ServiceOptions.JobGroupRoot);
+
+    // With the pidfd reaper, SIGCHLD is not needed as long as we can obtain pidfds.
+    g_SignalFd = SetupSignalHandlers(g_ServiceOptions.SignalIntake, g_ReaperEpollFd == -1);
+
+    auto reactorBackend = g_ServiceOptions.EventLoop;
+    if (reactorBackend == ReactorBackend::IoUring && !Reactor::IsIoUringSupported())
+    {
+        TRACE_INFO("io_uring not supported. Falling back to epoll.\n");
+        reactorBackend = ReactorBackend::Epoll;
+    }
+
+    // NOTE: Workers inherit the signal mask set up above.
+    if (g_ServiceOptions.Subchannels == SubchannelMode::WorkerPool)
+    {
+        if (g_ServiceOptions.SpawnExecutor == SpawnExecutorMode::WorkStealing)
+        {
+            g_SpawnExecutor = new SpawnExecutor(g_ServiceOptions.SpawnWorkerCount);
+        }
+
+        g_SubchannelWorkerPool = new SubchannelWorkerPool(g_ServiceOptions.SubchannelWorkerCount, g_SpawnExecutor, reactorBackend);
+    }
+
+    g_MainChannelOutputFd = UniqueFd{fcntl(g_MainChannel->GetFd(), F_DUPFD_CLOEXEC, 0)};
+    if (!g_MainChannelOutputFd.IsValid())
+    {
+        FatalErrorAbort(errno, "fcntl");
+    }
+
+    g_Reactor = std::make_unique<Reactor>(reactorBackend);
+
+    // With ReactorBackend::IoUring, these reads, the receive and the send are io_uring requests.
+    if (g_SignalFd != -1)
+    {
+        g_Reactor->AddReader(g_SignalFd, g_SignalFdInfos, sizeof(g_SignalFdInfos), HandleSignalFdInput);
+    }
+    else
+    {
+        g_Reactor->AddReader(g_SignalDataPipeReadEnd, g_SignalData, sizeof(g_SignalData), HandleSignalDataPipeInput);
+    }
+
+    g_Reactor->AddReader(g_ReapRequestPipeReadEnd, g_ReapRequestData, sizeof(g_ReapRequestData), HandleReapRequestPipeInput);
+
+    g_DeadlineScheduler = std::make_unique<DeadlineScheduler>();
+    g_Reactor->AddReader(g_DeadlineScheduler->GetFd(), &g_TimerExpirations, sizeof(g_TimerExpirations), HandleTimerInput);
+
+    if (g_ReaperEpollFd != -1)
+    {
+        if (GetZygotePid() != -1)
+        {
+            WatchZygote();
+        }
+
+        // epoll_wait cannot be submitted to io_uring; poll the epoll fd.
+        g_Reactor->Add(g_ReaperEpollFd, EPOLLIN, [](std::uint32_t) { return HandleReaperInput(); });
+    }
+
+    g_MainChannelIov.iov_base = &g_SubchannelFlags;
+    g_MainChannelIov.iov_len = sizeof(g_SubchannelFlags);
+    g_MainChannelMessage.msg_iov = &g_MainChannelIov;
+    g_MainChannelMessage.msg_iovlen = 1;
+    g_MainChannelMessage.msg_control = g_MainChannelCmsgFds.Buffer;
+    g_MainChannelMessage.msg_controllen = CmsgFds::BufferSize;
+    g_Reactor->AddMessageReader(g_MainChannel->GetFd(), &g_MainChannelMessage, HandleMainChannelInput);
+    g_Reactor->AddWriter(g_MainChannelOutputFd.Get(), [](ssize_t result) { return result != -1 || HandleMainChannelOutputError(); });
+}
+
+// ReaperMode::PidFd: Registers the pidfd of the zygote to the reaper. (There is no SIGCHLD to tell us it has exited.)
+void WatchZygote()
+{
+    // NOTE: Works even if the zygote has already exited; it is not reaped before this.
+    g_ZygotePidFd = UniqueFd{sys_pidfd_open(GetZygotePid(), 0)};
+    if (!g_ZygotePidFd.IsValid())
+    {
+        FatalErrorAbort(errno, "pidfd_open");
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(g_ReaperEpollFd, EPOLL_CTL_ADD, g_ZygotePidFd.Get(), &ev) == -1)
+    {
+        FatalErrorAbort(errno, "epoll_ctl");
+    }
+}
+
+// Requires pidfd_open and waitid(P_PIDFD) (Linux 5.4).
+bool IsPidFdReaperSupported() noexcept
+{
+    const UniqueFd selfPidFd{sys_pidfd_open(getpid(), 0)};
+    if (!selfPidFd.IsValid())
+    {
+        return false;
+    }
+
+    // We are not a child of ourselves. Without P_PIDFD support, this fails with EINVAL.
+    siginfo_t siginfo;
+    return waitid(IdTypePidFd, static_cast<id_t>(selfPidFd.Get()), &siginfo, WEXITED | WNOHANG) == -1
+        && errno == ECHILD;
 }
 
 void NotifyServiceOfSignal(int signum)
@@ -107,6 +291,39 @@ void NotifyServiceOfSignal(int signum)
     }
 }
 
+bool NotifyServiceOfChildRegistration(ChildProcessState* pState)
+{
+    if (g_ReaperEpollFd != -1)
+    {
+        if (pState->GetPidFd() != -1)
+        {
+            // NOTE: The element stays alive until the service reaps the child, which requires this registration.
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = pState;
+            if (epoll_ctl(g_ReaperEpollFd, EPOLL_CTL_ADD, pState->GetPidFd(), &ev) == -1)
+            {
+                FatalErrorAbort(errno, "epoll_ctl");
+            }
+
+            return true;
+        }
+
+        // Fall back to SIGCHLD for this child. A reap request below covers the case the child has already exited.
+        {
+            const std::lock_guard<std::mutex> guard(g_UntrackedChildPidsMutex);
+            g_UntrackedChildPids.push_back(pState->GetPid());
+        }
+
+        if (!g_IsSigchldHandlerInstalled.exchange(true))
+        {
+            SetupSigchldHandler();
+        }
+    }
+
+    return NotifyServiceOfChildRegistration();
+}
+
 [[nodiscard]] bool NotifyServiceOfChildRegistration()
 {
     std::uint8_t dummy = 0;
@@ -119,78 +336,78 @@ void NotifyServiceOfSignal(int signum)
     return true;
 }
 
+void ScheduleChildDeadline(const std::shared_ptr<ChildProcessState>& pState, std::uint32_t deadlineMilliseconds, std::uint32_t gracePeriodMilliseconds)
+{
+    g_DeadlineScheduler->Schedule(pState, deadlineMilliseconds, gracePeriodMilliseconds);
+}
+
 int ServiceMain(int mainChannelFd)
 {
     SetupService(mainChannelFd);
 
     // Main service loop
-    pollfd fds[PollFdCount]{};
-    fds[PollIndexSignalData].fd = g_SignalDataPipeReadEnd;
-    fds[PollIndexChildCreation].fd = g_ReapRequestPipeReadEnd;
-    fds[PollIndexMainChannel].fd = g_MainChannel->GetFd();
+    g_Reactor->Run();
 
-    while (true)
+    // Do not leave the leaves of the groups behind.
+    ShutdownJobGroups();
+    return 1;
+}
+
+bool HandleSignalDataPipeInput(ssize_t bytesRead)
+{
+    if (bytesRead <= 0)
     {
-        fds[PollIndexSignalData].events = POLLIN;
-        fds[PollIndexChildCreation].events = POLLIN;
-        fds[PollIndexMainChannel].events = POLLIN | (g_MainChannel->HasPendingData() ? POLLOUT : 0);
+        FatalErrorAbort(errno, "read");
+    }
 
-        int count = poll_restarting(fds, PollFdCount, -1);
-        if (count == -1)
-        {
-            FatalErrorAbort(errno, "poll");
-        }
+    // NOTE: Each signal number is written atomically (PIPE_BUF), so only whole ints are read.
+    assert(bytesRead % sizeof(int) == 0);
+    const std::size_t count = static_cast<std::size_t>(bytesRead) / sizeof(int);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        // SIGCHLD must be sent as a reap request.
+        assert(g_SignalData[i] != SIGCHLD);
 
-        if (fds[PollIndexSignalData].revents & POLLIN)
+        if (!HandleSignal(g_SignalData[i]))
         {
-            if (!HandleSignalDataPipeInput())
-            {
-                return 1;
-            }
+            return false;
         }
+    }
 
-        if (fds[PollIndexChildCreation].revents & POLLIN)
-        {
-            if (!HandleReapRequestPipeInput())
-            {
-                return 1;
-            }
-        }
+    return true;
+}
 
-        if (fds[PollIndexMainChannel].revents & POLLIN)
-        {
-            if (!HandleMainChannelInput())
-            {
-                return 1;
-            }
-        }
+bool HandleSignalFdInput(ssize_t bytesRead)
+{
+    // Pending signals are read in a batch. If more are pending, the reactor reads again.
+    if (bytesRead <= 0)
+    {
+        FatalErrorAbort(errno, "read");
+    }
 
-        if (fds[PollIndexMainChannel].revents & POLLOUT)
+    assert(bytesRead % sizeof(signalfd_siginfo) == 0);
+    const std::size_t count = static_cast<std::size_t>(bytesRead) / sizeof(signalfd_siginfo);
+
+    bool isReapRequested = false;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        const int signum = static_cast<int>(g_SignalFdInfos[i].ssi_signo);
+        if (signum == SIGCHLD)
         {
-            if (!HandleMainChannelOutput())
-            {
-                return 1;
-            }
+            // One scan covers all SIGCHLDs in this batch.
+            isReapRequested = true;
         }
-
-        if ((fds[PollIndexMainChannel].revents & (POLLHUP | POLLIN)) == POLLHUP)
+        else if (!HandleSignal(signum))
         {
-            // Connection closed.
-            return 1;
+            return false;
         }
     }
+
+    return !isReapRequested || HandleReapRequest();
 }
 
-bool HandleSignalDataPipeInput()
+bool HandleSignal(int signum)
 {
-    int signum;
-    ssize_t readBytes;
-
-    if (!ReadExactBytes(g_SignalDataPipeReadEnd, &signum, sizeof(int)))
-    {
-        FatalErrorAbort(errno, "read");
-    }
-
     switch (signum)
     {
     case SIGINT:
@@ -199,24 +416,16 @@ bool HandleSignalDataPipeInput()
         TRACE_INFO("Caught signal %d\n", signum);
         return false;
 
-    case SIGCHLD:
-        // SIGCHLD must be sent as a reap request.
-        assert(false);
-        break;
-
     default:
         // Ignored
-        break;
+        return true;
     }
-
-    return true;
 }
 
-bool HandleReapRequestPipeInput()
+bool HandleReapRequestPipeInput(ssize_t bytesRead)
 {
-    // Drain data from the pipe. If we have more than 256 bytes of pending data, we just re-poll and reexecute this.
-    std::byte buf[256];
-    if (read_restarting(g_ReapRequestPipeReadEnd, buf, sizeof(buf)) == -1)
+    // The data is just dummy bytes. If more than the buffer are pending, the reactor reads again.
+    if (bytesRead <= 0)
     {
         FatalErrorAbort(errno, "read");
     }
@@ -225,6 +434,31 @@ bool HandleReapRequestPipeInput()
 }
 
 bool HandleReapRequest()
+{
+    if (g_ReaperEpollFd != -1)
+    {
+        ReapUntrackedChildren();
+    }
+    else
+    {
+        ReapExitedChildren();
+    }
+
+    return FlushExitNotifications();
+}
+
+bool HandleTimerInput(ssize_t bytesRead)
+{
+    if (bytesRead != sizeof(g_TimerExpirations))
+    {
+        FatalErrorAbort(errno, "read");
+    }
+
+    g_DeadlineScheduler->HandleExpiration();
+    return true;
+}
+
+void ReapExitedChildren()
 {
     // Because SIGCHLD is a standard signal, only one SIGCHLD signal can be queued.
     // If the queue already has an instance, further SIGCHLD signals will be "lost".
@@ -240,7 +474,7 @@ bool HandleReapRequest()
         {
             if (errno == ECHILD)
             {
-                return true;
+                return;
             }
             else
             {
@@ -252,33 +486,171 @@ bool HandleReapRequest()
         if (pid == 0)
         {
             // No waitable child.
-            return true;
+            return;
         }
 
         auto pState = g_ChildProcessStateMap.GetByPid(pid);
+        if (!pState && IsZygotePid(pid))
+        {
+            // The zygote has been killed. Spawns will fall back to fork.
+            if (waitid(P_PID, static_cast<id_t>(pid), &siginfo, WEXITED | WNOHANG) < 0)
+            {
+                FatalErrorAbort(errno, "waitid");
+            }
+
+            MarkZygoteExited();
+            continue;
+        }
+
         if (!pState)
         {
             // This child process was killed before we register it to the map.
             // Delay the reaping process until we register it and send a reap request.
-            return true;
+            return;
         }
 
-        if (!NotifyClientOfExitedChild(pState.get(), siginfo))
+        ReapChild(pState.get(), siginfo);
+    }
+}
+
+// ReaperMode::PidFd: Reap children without pidfds. Unlike ReapExitedChildren, must not touch children tracked by pidfds.
+void ReapUntrackedChildren()
+{
+    std::vector<int> pids;
+    {
+        const std::lock_guard<std::mutex> guard(g_UntrackedChildPidsMutex);
+        if (g_UntrackedChildPids.empty())
         {
-            return false;
+            return;
+        }
+        pids = g_UntrackedChildPids;
+    }
+
+    for (const int pid : pids)
+    {
+        siginfo_t siginfo{};
+        if (waitid(P_PID, pid, &siginfo, WEXITED | WNOHANG | WNOWAIT) < 0)
+        {
+            FatalErrorAbort(errno, "waitid");
+        }
+
+        if (siginfo.si_pid == 0)
+        {
+            // Still running.
+            continue;
+        }
+
+        // NOTE: An untracked child is registered before it is added to g_UntrackedChildPids.
+        auto pState = g_ChildProcessStateMap.GetByPid(pid);
+        assert(pState);
+        ReapChild(pState.get(), siginfo);
+
+        const std::lock_guard<std::mutex> guard(g_UntrackedChildPidsMutex);
+        g_UntrackedChildPids.erase(std::find(g_UntrackedChildPids.begin(), g_UntrackedChildPids.end(), pid));
+    }
+}
+
+// ReaperMode::PidFd: Reap children whose pidfds have become readable (exited).
+bool HandleReaperInput()
+{
+    // Collect all exited children so that their notifications are sent together.
+    int count;
+    do
+    {
+        epoll_event events[ReaperMaxEvents];
+        count = epoll_wait(g_ReaperEpollFd, events, ReaperMaxEvents, 0);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                break;
+            }
+
+            FatalErrorAbort(errno, "epoll_wait");
+        }
+
+        ReapChildrenOfPidFdEvents(events, count);
+    } while (count == ReaperMaxEvents);
+
+    return FlushExitNotifications();
+}
+
+void ReapChildrenOfPidFdEvents(const epoll_event* events, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        auto* const pState = static_cast<ChildProcessState*>(events[i].data.ptr);
+        if (pState == nullptr)
+        {
+            ReapZygote();
+            continue;
+        }
+
+        // Peek the exit status. The child will be reaped after we delete the element.
+        siginfo_t siginfo{};
+        if (waitid(IdTypePidFd, static_cast<id_t>(pState->GetPidFd()), &siginfo, WEXITED | WNOHANG | WNOWAIT) < 0)
+        {
+            FatalErrorAbort(errno, "waitid");
+        }
+
+        if (siginfo.si_pid == 0)
+        {
+            continue;
+        }
+
+        // NOTE: Closing the pidfd is not enough to remove it from the epoll set;
+        //       a child being forked (and not yet performed exec) may have a copy of it.
+        if (epoll_ctl(g_ReaperEpollFd, EPOLL_CTL_DEL, pState->GetPidFd(), nullptr) == -1)
+        {
+            FatalErrorAbort(errno, "epoll_ctl");
         }
 
-        g_ChildProcessStateMap.Delete(pState.get());
+        ReapChild(pState, siginfo);
+    }
+}
+
+// ReaperMode::PidFd: g_ZygotePidFd has become readable.
+void ReapZygote()
+{
+    siginfo_t siginfo{};
+    if (waitid(IdTypePidFd, static_cast<id_t>(g_ZygotePidFd.Get()), &siginfo, WEXITED | WNOHANG) < 0)
+    {
+        FatalErrorAbort(errno, "waitid");
+    }
+
+    if (epoll_ctl(g_ReaperEpollFd, EPOLL_CTL_DEL, g_ZygotePidFd.Get(), nullptr) == -1)
+    {
+        FatalErrorAbort(errno, "epoll_ctl");
+    }
+
+    g_ZygotePidFd.Reset();
+    MarkZygoteExited();
+}
 
-        // We have updated our data and are ready for recycling of the PID. Reap the child.
-        pState->Reap();
+void ReapChild(ChildProcessState* pState, const siginfo_t& siginfo)
+{
+    // Keep the element alive until we reap the child.
+    // NOTE: Delete the element before notifying the client so that the client can reuse the token once notified.
+    const auto pDeletedState = g_ChildProcessStateMap.Delete(pState);
+
+    // We have updated our data and are ready for recycling of the PID. Reap the child.
+    // NOTE: The notification will be sent after this anyway (FlushExitNotifications).
+    if (g_ServiceOptions.ExitNotifications == ExitNotificationFormat::Extended)
+    {
+        struct rusage usage{};
+        pDeletedState->Reap(&usage);
+        QueueExitNotification(pDeletedState.get(), siginfo, &usage);
+    }
+    else
+    {
+        pDeletedState->Reap();
+        QueueExitNotification(pDeletedState.get(), siginfo, nullptr);
     }
 }
 
-bool HandleMainChannelInput()
+bool HandleMainChannelInput(ssize_t bytesReceived)
 {
-    std::byte dummy;
-    const ssize_t bytesReceived = g_MainChannel->Recv(&dummy, 1, BlockingFlag::Blocking);
+    bytesReceived = g_MainChannel->CompleteRecv(&g_MainChannelMessage, bytesReceived);
     if (!HandleRecvResult(BlockingFlag::Blocking, "recvmsg", bytesReceived, errno))
     {
         // Connection closed.
@@ -293,29 +665,86 @@ bool HandleMainChannelInput()
         return false;
     }
 
-    StartSubchannelHandler(std::move(*maybeSubchannelFd));
+    const std::uint8_t flags = g_SubchannelFlags;
+    if ((flags & ~SubchannelFlagsPipelined) != 0)
+    {
+        TRACE_ERROR("Unknown subchannel flags: %x\n", static_cast<unsigned int>(flags));
+        const std::int32_t err = EINVAL;
+        static_cast<void>(WriteExactBytes(maybeSubchannelFd->Get(), &err, sizeof(err)));
+        return true;
+    }
+
+    if (g_SubchannelWorkerPool != nullptr)
+    {
+        g_SubchannelWorkerPool->Add(std::move(*maybeSubchannelFd), flags);
+    }
+    else
+    {
+        StartSubchannelHandler(std::move(*maybeSubchannelFd), flags);
+    }
     return true;
 }
 
-bool HandleMainChannelOutput()
+// A send of exit notifications queued by FlushExitNotifications has failed.
+bool HandleMainChannelOutputError()
+{
+    TRACE_INFO("Main channel disconnected: sendmsg %d\n", errno);
+    return false;
+}
+
+// pUsage: ExitNotificationFormat::Extended only.
+void QueueExitNotification(ChildProcessState* pState, const siginfo_t& siginfo, const struct rusage* pUsage)
 {
-    if (!g_MainChannel->Flush(BlockingFlag::NonBlocking))
+    const auto append = [](const auto& notification) {
+        const auto* const p = reinterpret_cast<const std::byte*>(&notification);
+        g_PendingExitNotifications.insert(g_PendingExitNotifications.end(), p, p + sizeof(notification));
+    };
+
+    const std::uint64_t token = pState->GetToken();
+    const std::int32_t pid = pState->GetPid();
+    const std::int32_t status = siginfo.si_code == CLD_EXITED ? siginfo.si_status : -siginfo.si_status;
+
+    if (pUsage == nullptr)
     {
-        TRACE_INFO("Main channel disconnected: fflush %d\n", errno);
-        return false;
+        ChildExitNotification cen{};
+        cen.Token = token;
+        cen.ProcessID = pid;
+        cen.Status = status;
+        append(cen);
+        return;
     }
 
-    return true;
+    const auto toMicroseconds = [](const timeval& tv) {
+        return static_cast<std::uint64_t>(tv.tv_sec) * 1000000 + static_cast<std::uint64_t>(tv.tv_usec);
+    };
+
+    ExtendedChildExitNotification ecen{};
+    ecen.Token = token;
+    ecen.ProcessID = pid;
+    ecen.Status = status;
+    ecen.UserTimeMicroseconds = toMicroseconds(pUsage->ru_utime);
+    ecen.SystemTimeMicroseconds = toMicroseconds(pUsage->ru_stime);
+    ecen.MaxRssKilobytes = static_cast<std::uint64_t>(pUsage->ru_maxrss);
+    ecen.InputBlocks = static_cast<std::uint64_t>(pUsage->ru_inblock);
+    ecen.OutputBlocks = static_cast<std::uint64_t>(pUsage->ru_oublock);
+    ecen.WallTimeMicroseconds = (GetMonotonicTimeNanoseconds() - pState->GetRegistrationTime()) / 1000;
+    append(ecen);
 }
 
-bool NotifyClientOfExitedChild(ChildProcessState* pState, siginfo_t siginfo)
+// Sends the notifications queued during a reap pass with one send.
+bool FlushExitNotifications()
 {
-    ChildExitNotification cen{};
-    cen.Token = pState->GetToken();
-    cen.ProcessID = pState->GetPid();
-    cen.Status = siginfo.si_code == CLD_EXITED ? siginfo.si_status : -siginfo.si_status;
+    if (g_PendingExitNotifications.empty())
+    {
+        return true;
+    }
 
-    if (!g_MainChannel->SendBuffered(&cen, sizeof(cen), BlockingFlag::NonBlocking))
+    const bool successful = g_Reactor->Send(
+        g_MainChannelOutputFd.Get(),
+        g_PendingExitNotifications.data(),
+        g_PendingExitNotifications.size());
+    g_PendingExitNotifications.clear();
+    if (!successful)
     {
         TRACE_INFO("Main channel disconnected: send %d\n", errno);
         return false;
@@ -4,6 +4,7 @@
 
 #include "UniqueResource.hpp"
 #include <cstdint>
+#include <memory>
 #include <pthread.h>
 
 struct ChildExitNotification
@@ -16,8 +17,33 @@ struct ChildExitNotification
 };
 static_assert(sizeof(ChildExitNotification) == 16);
 
+// ExitNotificationFormat::Extended: Sent instead of ChildExitNotification.
+struct ExtendedChildExitNotification
+{
+    // Same as ChildExitNotification.
+    uint64_t Token;
+    int32_t ProcessID;
+    int32_t Status;
+    // From the rusage reported on reaping. Includes the descendants the child has waited for.
+    uint64_t UserTimeMicroseconds;
+    uint64_t SystemTimeMicroseconds;
+    uint64_t MaxRssKilobytes;
+    uint64_t InputBlocks;
+    uint64_t OutputBlocks;
+    // From the registration of the child (just after the spawn) to reaping, measured by the service.
+    uint64_t WallTimeMicroseconds;
+};
+static_assert(sizeof(ExtendedChildExitNotification) == 64);
+
+class ChildProcessState;
+
 [[nodiscard]] int ServiceMain(int mainChannelFd);
+// Request the service to start watching a newly registered child.
+[[nodiscard]] bool NotifyServiceOfChildRegistration(ChildProcessState* pState);
+// Request the service to reap children (in case it has delayed reaping an unregistered child).
 [[nodiscard]] bool NotifyServiceOfChildRegistration();
+// RequestFlagsDeadline: Request the service to terminate a newly registered child on the deadline.
+void ScheduleChildDeadline(const std::shared_ptr<ChildProcessState>& pState, std::uint32_t deadlineMilliseconds, std::uint32_t gracePeriodMilliseconds);
 
 // Interface for the signal handler.
 void NotifyServiceOfSignal(int signum);
@@ -0,0 +1,311 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "ServiceOptions.hpp"
+#include "Base.hpp"
+#include "Reactor.hpp"
+#include "Request.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <optional>
+
+namespace
+{
+    // If arg is "--name=value", returns value.
+    [[nodiscard]] const char* MatchOption(const char* arg, const char* name) noexcept
+    {
+        const auto nameLength = std::strlen(name);
+        if (std::strncmp(arg, "--", 2) != 0
+            || std::strncmp(arg + 2, name, nameLength) != 0
+            || arg[2 + nameLength] != '=')
+        {
+            return nullptr;
+        }
+
+        return arg + 2 + nameLength + 1;
+    }
+
+    [[nodiscard]] std::optional<SpawnMethod> ParseSpawnMethod(const char* value) noexcept
+    {
+        if (std::strcmp(value, "fork") == 0)
+        {
+            return SpawnMethod::Fork;
+        }
+        else if (std::strcmp(value, "vfork") == 0)
+        {
+            return SpawnMethod::CloneVfork;
+        }
+        else if (std::strcmp(value, "posix_spawn") == 0)
+        {
+            return SpawnMethod::PosixSpawn;
+        }
+        else if (std::strcmp(value, "zygote") == 0)
+        {
+            return SpawnMethod::Zygote;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<ReaperMode> ParseReaperMode(const char* value) noexcept
+    {
+        if (std::strcmp(value, "sigchld") == 0)
+        {
+            return ReaperMode::SigChld;
+        }
+        else if (std::strcmp(value, "pidfd") == 0)
+        {
+            return ReaperMode::PidFd;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<SignalIntakeMode> ParseSignalIntakeMode(const char* value) noexcept
+    {
+        if (std::strcmp(value, "handler") == 0)
+        {
+            return SignalIntakeMode::Handler;
+        }
+        else if (std::strcmp(value, "signalfd") == 0)
+        {
+            return SignalIntakeMode::SignalFd;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<ReactorBackend> ParseReactorBackend(const char* value) noexcept
+    {
+        if (std::strcmp(value, "epoll") == 0)
+        {
+            return ReactorBackend::Epoll;
+        }
+        else if (std::strcmp(value, "io_uring") == 0)
+        {
+            return ReactorBackend::IoUring;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<SubchannelMode> ParseSubchannelMode(const char* value) noexcept
+    {
+        if (std::strcmp(value, "thread") == 0)
+        {
+            return SubchannelMode::Thread;
+        }
+        else if (std::strcmp(value, "pool") == 0)
+        {
+            return SubchannelMode::WorkerPool;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<SpawnExecutorMode> ParseSpawnExecutorMode(const char* value) noexcept
+    {
+        if (std::strcmp(value, "inline") == 0)
+        {
+            return SpawnExecutorMode::Inline;
+        }
+        else if (std::strcmp(value, "work-stealing") == 0)
+        {
+            return SpawnExecutorMode::WorkStealing;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<ExitNotificationFormat> ParseExitNotificationFormat(const char* value) noexcept
+    {
+        if (std::strcmp(value, "basic") == 0)
+        {
+            return ExitNotificationFormat::Basic;
+        }
+        else if (std::strcmp(value, "extended") == 0)
+        {
+            return ExitNotificationFormat::Extended;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+
+    [[nodiscard]] std::optional<int> ParsePositiveInt(const char* value) noexcept
+    {
+        char* end;
+        errno = 0;
+        const long n = std::strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || n <= 0 || n > std::numeric_limits<int>::max())
+        {
+            return std::nullopt;
+        }
+
+        return static_cast<int>(n);
+    }
+
+    // "INDEX/COUNT"
+    [[nodiscard]] bool ParseShard(const char* value, std::uint32_t* pIndex, std::uint32_t* pCount) noexcept
+    {
+        char* end;
+        errno = 0;
+        const unsigned long index = std::strtoul(value, &end, 10);
+        if (errno != 0 || end == value || *end != '/')
+        {
+            return false;
+        }
+
+        const char* const countStr = end + 1;
+        const unsigned long count = std::strtoul(countStr, &end, 10);
+        if (errno != 0 || end == countStr || *end != '\0' || count == 0 || count > MaxShardCount || index >= count)
+        {
+            return false;
+        }
+
+        *pIndex = static_cast<std::uint32_t>(index);
+        *pCount = static_cast<std::uint32_t>(count);
+        return true;
+    }
+} // namespace
+
+bool ParseServiceOptions(ServiceOptions* pOptions, int argc, const char* const* argv) noexcept
+{
+    for (int i = 0; i < argc; i++)
+    {
+        const char* const arg = argv[i];
+        if (const char* value = MatchOption(arg, "spawn-method"))
+        {
+            const auto maybeSpawnMethod = ParseSpawnMethod(value);
+            if (!maybeSpawnMethod)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown spawn method: %s\n", value);
+                return false;
+            }
+
+            pOptions->DefaultSpawnMethod = *maybeSpawnMethod;
+        }
+        else if (const char* value = MatchOption(arg, "reaper"))
+        {
+            const auto maybeReaperMode = ParseReaperMode(value);
+            if (!maybeReaperMode)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown reaper: %s\n", value);
+                return false;
+            }
+
+            pOptions->Reaper = *maybeReaperMode;
+        }
+        else if (const char* value = MatchOption(arg, "signal-intake"))
+        {
+            const auto maybeSignalIntakeMode = ParseSignalIntakeMode(value);
+            if (!maybeSignalIntakeMode)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown signal intake: %s\n", value);
+                return false;
+            }
+
+            pOptions->SignalIntake = *maybeSignalIntakeMode;
+        }
+        else if (const char* value = MatchOption(arg, "event-loop"))
+        {
+            const auto maybeReactorBackend = ParseReactorBackend(value);
+            if (!maybeReactorBackend)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown event loop: %s\n", value);
+                return false;
+            }
+
+            pOptions->EventLoop = *maybeReactorBackend;
+        }
+        else if (const char* value = MatchOption(arg, "subchannel-mode"))
+        {
+            const auto maybeSubchannelMode = ParseSubchannelMode(value);
+            if (!maybeSubchannelMode)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown subchannel mode: %s\n", value);
+                return false;
+            }
+
+            pOptions->Subchannels = *maybeSubchannelMode;
+        }
+        else if (const char* value = MatchOption(arg, "subchannel-workers"))
+        {
+            const auto maybeCount = ParsePositiveInt(value);
+            if (!maybeCount)
+            {
+                std::fprintf(stderr, "[ChildProcess] invalid subchannel worker count: %s\n", value);
+                return false;
+            }
+
+            pOptions->SubchannelWorkerCount = *maybeCount;
+        }
+        else if (const char* value = MatchOption(arg, "spawn-executor"))
+        {
+            const auto maybeSpawnExecutorMode = ParseSpawnExecutorMode(value);
+            if (!maybeSpawnExecutorMode)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown spawn executor: %s\n", value);
+                return false;
+            }
+
+            pOptions->SpawnExecutor = *maybeSpawnExecutorMode;
+        }
+        else if (const char* value = MatchOption(arg, "spawn-workers"))
+        {
+            const auto maybeCount = ParsePositiveInt(value);
+            if (!maybeCount)
+            {
+                std::fprintf(stderr, "[ChildProcess] invalid spawn worker count: %s\n", value);
+                return false;
+            }
+
+            pOptions->SpawnWorkerCount = *maybeCount;
+        }
+        else if (const char* value = MatchOption(arg, "shard"))
+        {
+            if (!ParseShard(value, &pOptions->ShardIndex, &pOptions->ShardCount))
+            {
+                std::fprintf(stderr, "[ChildProcess] invalid shard: %s\n", value);
+                return false;
+            }
+        }
+        else if (const char* value = MatchOption(arg, "exit-notification"))
+        {
+            const auto maybeFormat = ParseExitNotificationFormat(value);
+            if (!maybeFormat)
+            {
+                std::fprintf(stderr, "[ChildProcess] unknown exit notification format: %s\n", value);
+                return false;
+            }
+
+            pOptions->ExitNotifications = *maybeFormat;
+        }
+        else if (const char* value = MatchOption(arg, "job-group-root"))
+        {
+            pOptions->JobGroupRoot = value;
+        }
+        else
+        {
+            std::fprintf(stderr, "[ChildProcess] unknown option: %s\n", arg);
+            return false;
+        }
+    }
+
+    return true;
+}
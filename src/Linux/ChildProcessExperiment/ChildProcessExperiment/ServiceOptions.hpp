@@ -0,0 +1,77 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "Reactor.hpp"
+#include "Request.hpp"
+#include <cstdint>
+
+enum class ReaperMode
+{
+    // SIGCHLD (and registration of children) triggers a scan of all waitable children.
+    SigChld,
+    // Each child's pidfd is registered to an epoll set; only exited children wake the service.
+    // Falls back to SigChld if the kernel does not support pidfds.
+    PidFd,
+};
+
+enum class SignalIntakeMode
+{
+    // Signal handlers write to pipes.
+    Handler,
+    // The signals are blocked and read in batches through a signalfd.
+    SignalFd,
+};
+
+enum class SubchannelMode
+{
+    // A dedicated thread per subchannel.
+    Thread,
+    // SubchannelWorkerPool.
+    WorkerPool,
+};
+
+enum class SpawnExecutorMode
+{
+    // Spawn on the thread that received the request.
+    Inline,
+    // SpawnExecutor. Effective only with SubchannelMode::WorkerPool.
+    WorkStealing,
+};
+
+enum class ExitNotificationFormat
+{
+    // ChildExitNotification.
+    Basic,
+    // ExtendedChildExitNotification.
+    Extended,
+};
+
+// Options of the service specified at startup.
+struct ServiceOptions final
+{
+    // Used when a request does not specify a spawn method.
+    // SpawnMethod::Zygote: The zygote is started only if this is SpawnMethod::Zygote.
+    SpawnMethod DefaultSpawnMethod = SpawnMethod::Fork;
+    ReaperMode Reaper = ReaperMode::SigChld;
+    SignalIntakeMode SignalIntake = SignalIntakeMode::Handler;
+    // Used by the main channel and by the workers of SubchannelMode::WorkerPool.
+    // Falls back to ReactorBackend::Epoll if the kernel does not support the io_uring operations we need.
+    ReactorBackend EventLoop = ReactorBackend::Epoll;
+    SubchannelMode Subchannels = SubchannelMode::Thread;
+    // SubchannelMode::WorkerPool: 0 means the number of online processors.
+    int SubchannelWorkerCount = 0;
+    SpawnExecutorMode SpawnExecutor = SpawnExecutorMode::Inline;
+    // SpawnExecutorMode::WorkStealing: 0 means the number of online processors.
+    int SpawnWorkerCount = 0;
+    // This helper is shard ShardIndex of ShardCount helpers of the same client (see GetShardOfToken).
+    std::uint32_t ShardIndex = 0;
+    std::uint32_t ShardCount = 1;
+    ExitNotificationFormat ExitNotifications = ExitNotificationFormat::Basic;
+    // A cgroup v2 directory where job groups are created. nullptr means job groups are unavailable (see SetupJobGroups).
+    const char* JobGroupRoot = nullptr;
+};
+
+// Parses options of the form "--name=value".
+// On error, prints the reason and returns false.
+[[nodiscard]] bool ParseServiceOptions(ServiceOptions* pOptions, int argc, const char* const* argv) noexcept;
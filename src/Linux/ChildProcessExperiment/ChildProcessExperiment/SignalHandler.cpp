@@ -4,34 +4,127 @@
 #include "Base.hpp"
 #include "MiscHelpers.hpp"
 #include "Service.hpp"
+#include "ServiceOptions.hpp"
 #include "UniqueResource.hpp"
 #include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <signal.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 bool IsSignalIgnored(int signum);
 void SetSignalAction(int signum, int extraFlags);
 void SignalHandler(int signum, siginfo_t* siginfo, void* context);
 
-void SetupSignalHandlers()
+namespace
 {
-    // Preserve the ignored state as far as possible so that our children will inherit the state.
-    if (!IsSignalIgnored(SIGINT))
+    // Signals for which SignalHandler is installed.
+    sigset_t g_HandledSignals;
+
+    // SignalIntakeMode::SignalFd: Signals read through g_SignalFd.
+    sigset_t g_SignalFdSignals;
+    int g_SignalFd = -1;
+
+    // The signal mask before BlockSignalFdSignals.
+    bool g_IsSignalMaskModified = false;
+    sigset_t g_OriginalSignalMask;
+} // namespace
+
+int SetupSignalHandlers(SignalIntakeMode mode, bool handleSigchld)
+{
+    sigemptyset(&g_HandledSignals);
+
+    if (mode == SignalIntakeMode::SignalFd)
     {
-        SetSignalAction(SIGINT, 0);
+        BlockSignalFdSignals();
+
+        // Preserve the ignored state as far as possible so that our children will inherit the state.
+        // NOTE: A blocked signal is queued even if it is ignored.
+        sigemptyset(&g_SignalFdSignals);
+        if (!IsSignalIgnored(SIGINT))
+        {
+            sigaddset(&g_SignalFdSignals, SIGINT);
+        }
+        if (!IsSignalIgnored(SIGQUIT))
+        {
+            sigaddset(&g_SignalFdSignals, SIGQUIT);
+        }
+        if (handleSigchld)
+        {
+            sigaddset(&g_SignalFdSignals, SIGCHLD);
+        }
+
+        g_SignalFd = signalfd(-1, &g_SignalFdSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (g_SignalFd == -1)
+        {
+            FatalErrorAbort(errno, "signalfd");
+        }
     }
-    if (!IsSignalIgnored(SIGQUIT))
+    else
     {
-        SetSignalAction(SIGQUIT, 0);
+        // Preserve the ignored state as far as possible so that our children will inherit the state.
+        if (!IsSignalIgnored(SIGINT))
+        {
+            SetSignalAction(SIGINT, 0);
+        }
+        if (!IsSignalIgnored(SIGQUIT))
+        {
+            SetSignalAction(SIGQUIT, 0);
+        }
+        if (handleSigchld)
+        {
+            SetupSigchldHandler();
+        }
     }
+
     if (!IsSignalIgnored(SIGPIPE))
     {
         SetSignalAction(SIGPIPE, 0);
     }
 
-    SetSignalAction(SIGCHLD, SA_NOCLDSTOP);
+    return g_SignalFd;
+}
+
+void SetupSigchldHandler()
+{
+    if (g_SignalFd != -1)
+    {
+        // SIGCHLD has been blocked since BlockSignalFdSignals.
+        sigaddset(&g_SignalFdSignals, SIGCHLD);
+        if (signalfd(g_SignalFd, &g_SignalFdSignals, 0) == -1)
+        {
+            FatalErrorAbort(errno, "signalfd");
+        }
+    }
+    else
+    {
+        SetSignalAction(SIGCHLD, SA_NOCLDSTOP);
+    }
+}
+
+void BlockSignalFdSignals() noexcept
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGCHLD);
+
+    if (g_IsSignalMaskModified)
+    {
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+    else
+    {
+        pthread_sigmask(SIG_BLOCK, &signals, &g_OriginalSignalMask);
+        g_IsSignalMaskModified = true;
+    }
+}
+
+const sigset_t* GetOriginalSignalMask() noexcept
+{
+    return g_IsSignalMaskModified ? &g_OriginalSignalMask : nullptr;
 }
 
 bool IsSignalIgnored(int signum)
@@ -51,6 +144,23 @@ void SetSignalAction(int signum, int extraFlags)
 
     [[maybe_unused]] int isError = sigaction(signum, &act, nullptr);
     assert(isError == 0);
+
+    sigaddset(&g_HandledSignals, signum);
+}
+
+void ResetSignalHandlersToDefault() noexcept
+{
+    struct sigaction act = {};
+    act.sa_handler = SIG_DFL;
+    sigemptyset(&act.sa_mask);
+
+    for (int signum = 1; signum < NSIG; signum++)
+    {
+        if (sigismember(&g_HandledSignals, signum) == 1)
+        {
+            static_cast<void>(sigaction(signum, &act, nullptr));
+        }
+    }
 }
 
 void SignalHandler(int signum, siginfo_t* siginfo, void* context)
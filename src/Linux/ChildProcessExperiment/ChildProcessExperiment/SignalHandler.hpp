@@ -3,6 +3,27 @@
 #pragma once
 
 #include "UniqueResource.hpp"
+#include <signal.h>
 #include <sys/types.h>
 
-void SetupSignalHandlers();
+enum class SignalIntakeMode;
+
+// Sets up signal handlers, or with SignalIntakeMode::SignalFd, a signalfd for SIGINT, SIGQUIT and SIGCHLD.
+// Returns the signalfd (nonblocking), or -1 with SignalIntakeMode::Handler.
+// If handleSigchld is false, SIGCHLD will not be reported until SetupSigchldHandler is called.
+//
+// NOTE: With SignalIntakeMode::SignalFd, the signals must be blocked in all threads. Either call this before creating
+//       any other thread or call BlockSignalFdSignals in the initial thread beforehand.
+[[nodiscard]] int SetupSignalHandlers(SignalIntakeMode mode, bool handleSigchld);
+void SetupSigchldHandler();
+
+// Blocks signals to be read through the signalfd in the calling thread. Threads created afterwards inherit the mask.
+void BlockSignalFdSignals() noexcept;
+
+// Returns the signal mask before BlockSignalFdSignals, which our children should inherit.
+// Returns nullptr if we have not modified the signal mask.
+[[nodiscard]] const sigset_t* GetOriginalSignalMask() noexcept;
+
+// Restores the default actions of the signals we handle.
+// Async-signal-safe. Intended for a child that shares the memory with us (CLONE_VM) and has not performed exec yet.
+void ResetSignalHandlersToDefault() noexcept;
@@ -0,0 +1,44 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "SlabAllocator.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+FixedBlockPool::FixedBlockPool(std::size_t blockSize, std::size_t blocksPerChunk) noexcept
+    : blockSize_((std::max(blockSize, sizeof(FreeBlock)) + BlockAlignment - 1) / BlockAlignment * BlockAlignment),
+      blocksPerChunk_(blocksPerChunk)
+{
+}
+
+void* FixedBlockPool::Allocate()
+{
+    const std::lock_guard<std::mutex> guard(mutex_);
+
+    if (freeList_ == nullptr)
+    {
+        auto chunk = std::make_unique<std::byte[]>(blockSize_ * blocksPerChunk_);
+        for (std::size_t i = 0; i < blocksPerChunk_; i++)
+        {
+            auto* const pBlock = reinterpret_cast<FreeBlock*>(&chunk[i * blockSize_]);
+            pBlock->Next = freeList_;
+            freeList_ = pBlock;
+        }
+
+        chunks_.push_back(std::move(chunk));
+    }
+
+    FreeBlock* const pBlock = freeList_;
+    freeList_ = pBlock->Next;
+    return pBlock;
+}
+
+void FixedBlockPool::Free(void* p) noexcept
+{
+    const std::lock_guard<std::mutex> guard(mutex_);
+
+    auto* const pBlock = static_cast<FreeBlock*>(p);
+    pBlock->Next = freeList_;
+    freeList_ = pBlock;
+}
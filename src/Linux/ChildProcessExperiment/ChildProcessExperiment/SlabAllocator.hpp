@@ -0,0 +1,90 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Hands out fixed-size blocks carved from large chunks. Freed blocks are kept for reuse and never returned to the system.
+// Thread-safe.
+class FixedBlockPool final
+{
+public:
+    FixedBlockPool(std::size_t blockSize, std::size_t blocksPerChunk) noexcept;
+
+    FixedBlockPool(const FixedBlockPool&) = delete;
+    FixedBlockPool& operator=(const FixedBlockPool&) = delete;
+
+    // Throws std::bad_alloc.
+    [[nodiscard]] void* Allocate();
+    void Free(void* p) noexcept;
+
+private:
+    struct FreeBlock final
+    {
+        FreeBlock* Next;
+    };
+
+    // Blocks are aligned as operator new[] does.
+    static const constexpr std::size_t BlockAlignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    const std::size_t blockSize_;
+    const std::size_t blocksPerChunk_;
+    std::mutex mutex_;
+    FreeBlock* freeList_ = nullptr;
+    std::vector<std::unique_ptr<std::byte[]>> chunks_;
+};
+
+// Allocator for std::allocate_shared that serves single objects from a FixedBlockPool per type.
+template<typename T>
+class SlabAllocator final
+{
+public:
+    using value_type = T;
+
+    SlabAllocator() noexcept = default;
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+    [[nodiscard]] T* allocate(std::size_t n)
+    {
+        if (n != 1)
+        {
+            return std::allocator<T>().allocate(n);
+        }
+
+        return static_cast<T*>(GetPool().Allocate());
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        if (n != 1)
+        {
+            std::allocator<T>().deallocate(p, n);
+            return;
+        }
+
+        GetPool().Free(p);
+    }
+
+    template<typename U>
+    bool operator==(const SlabAllocator<U>&) const noexcept { return true; }
+    template<typename U>
+    bool operator!=(const SlabAllocator<U>&) const noexcept { return false; }
+
+private:
+    static const constexpr std::size_t BlocksPerChunk = 256;
+
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    static FixedBlockPool& GetPool() noexcept
+    {
+        // NOTE: Never deleted so that objects freed by other threads during exit do not touch a destroyed pool.
+        static FixedBlockPool* const pPool = new FixedBlockPool(sizeof(T), BlocksPerChunk);
+        return *pPool;
+    }
+};
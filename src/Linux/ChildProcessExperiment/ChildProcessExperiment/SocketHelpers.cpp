@@ -85,7 +85,7 @@ ssize_t SendWithFd(int fd, const void* buf, std::size_t len, const int* fds, std
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
     msg.msg_control = cmsgFds.Buffer;
-    msg.msg_controllen = CmsgFds::BufferSize;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
     msg.msg_flags = 0;
 
     struct cmsghdr* pcmsghdr = CMSG_FIRSTHDR(&msg);
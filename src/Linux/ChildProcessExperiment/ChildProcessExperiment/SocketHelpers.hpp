@@ -9,7 +9,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-constexpr const int SocketMaxFdsPerCall = 3;
+// SCM_MAX_FD
+constexpr const int SocketMaxFdsPerCall = 253;
 
 struct CmsgFds
 {
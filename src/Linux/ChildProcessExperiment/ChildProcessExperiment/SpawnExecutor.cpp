@@ -0,0 +1,120 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "SpawnExecutor.hpp"
+#include "Base.hpp"
+#include "MiscHelpers.hpp"
+#include "ProcessSpawner.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <sched.h>
+#include <unistd.h>
+#include <utility>
+
+namespace
+{
+    struct WorkerArgs final
+    {
+        SpawnExecutor* Executor;
+        std::size_t Index;
+    };
+} // namespace
+
+SpawnExecutor::SpawnExecutor(int workerCount)
+{
+    if (workerCount <= 0)
+    {
+        workerCount = std::max(1, static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)));
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        auto* const pArgs = new WorkerArgs{this, static_cast<std::size_t>(i)};
+        auto maybeThread = CreateThreadWithMyDefault(SpawnExecutor::ThreadFunc, pArgs, CreateThreadFlagsDetached);
+        if (!maybeThread)
+        {
+            FatalErrorAbort(errno, "pthread_create");
+        }
+    }
+}
+
+// NOTE: Workers run until the process exits.
+SpawnExecutor::~SpawnExecutor() = default;
+
+void SpawnExecutor::Submit(SpawnProcessRequest&& r, Completion completion)
+{
+    const int cpu = sched_getcpu();
+    auto& queue = *queues_[cpu >= 0 ? static_cast<std::size_t>(cpu) % queues_.size() : 0];
+
+    {
+        const std::lock_guard<std::mutex> guard(queue.Mutex);
+        queue.Tasks.push_back(std::make_unique<Task>(Task{std::move(r), std::move(completion)}));
+    }
+
+    {
+        // Increment under the lock so that a worker about to sleep cannot miss it.
+        const std::lock_guard<std::mutex> guard(idleMutex_);
+        pendingTaskCount_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    idleCondition_.notify_one();
+}
+
+void* SpawnExecutor::ThreadFunc(void* arg)
+{
+    const std::unique_ptr<WorkerArgs> pArgs{static_cast<WorkerArgs*>(arg)};
+    pArgs->Executor->WorkerLoop(pArgs->Index);
+    return nullptr;
+}
+
+void SpawnExecutor::WorkerLoop(std::size_t index)
+{
+    while (true)
+    {
+        auto pTask = TryTakeTask(index);
+        if (!pTask)
+        {
+            std::unique_lock<std::mutex> lock(idleMutex_);
+            idleCondition_.wait(lock, [this] { return pendingTaskCount_.load(std::memory_order_relaxed) > 0; });
+            continue;
+        }
+
+        pendingTaskCount_.fetch_sub(1, std::memory_order_relaxed);
+
+        const auto result = SpawnProcess(pTask->Request);
+        pTask->OnCompleted(result);
+    }
+}
+
+std::unique_ptr<SpawnExecutor::Task> SpawnExecutor::TryTakeTask(std::size_t index)
+{
+    {
+        auto& queue = *queues_[index];
+        const std::lock_guard<std::mutex> guard(queue.Mutex);
+        if (!queue.Tasks.empty())
+        {
+            auto pTask = std::move(queue.Tasks.back());
+            queue.Tasks.pop_back();
+            return pTask;
+        }
+    }
+
+    // Steal.
+    for (std::size_t i = 1; i < queues_.size(); i++)
+    {
+        auto& queue = *queues_[(index + i) % queues_.size()];
+        const std::lock_guard<std::mutex> guard(queue.Mutex);
+        if (!queue.Tasks.empty())
+        {
+            auto pTask = std::move(queue.Tasks.front());
+            queue.Tasks.pop_front();
+            return pTask;
+        }
+    }
+
+    return nullptr;
+}
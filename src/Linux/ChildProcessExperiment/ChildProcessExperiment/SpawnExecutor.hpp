@@ -0,0 +1,59 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "ProcessSpawner.hpp"
+#include "Request.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs spawns on a fixed set of workers. Each worker owns a deque; a worker takes the newest task from its own deque
+// and, when it runs out of tasks, steals the oldest task from another worker.
+class SpawnExecutor final
+{
+public:
+    // Called on a worker thread after the spawn.
+    using Completion = std::function<void(const SpawnProcessResult& result)>;
+
+    // workerCount: 0 means the number of online processors.
+    explicit SpawnExecutor(int workerCount);
+    // NOTE: Workers run until the process exits; the executor must not be destroyed.
+    ~SpawnExecutor();
+
+    SpawnExecutor(const SpawnExecutor&) = delete;
+    SpawnExecutor& operator=(const SpawnExecutor&) = delete;
+
+    // Queues the spawn to the deque of the current CPU. Thread-safe.
+    void Submit(SpawnProcessRequest&& r, Completion completion);
+
+private:
+    struct Task final
+    {
+        SpawnProcessRequest Request;
+        Completion OnCompleted;
+    };
+
+    struct WorkerQueue final
+    {
+        std::mutex Mutex;
+        std::deque<std::unique_ptr<Task>> Tasks;
+    };
+
+    static void* ThreadFunc(void* arg);
+    void WorkerLoop(std::size_t index);
+    [[nodiscard]] std::unique_ptr<Task> TryTakeTask(std::size_t index);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+
+    // Idle workers sleep until a task is submitted.
+    std::mutex idleMutex_;
+    std::condition_variable idleCondition_;
+    // NOTE: Can be transiently negative because a task is counted after it is queued.
+    std::atomic<long> pendingTaskCount_{0};
+};
@@ -0,0 +1,60 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "SpawnTemplate.hpp"
+#include "Request.hpp"
+#include <memory>
+#include <vector>
+
+std::shared_ptr<const SpawnTemplate> CreateSpawnTemplate(SpawnProcessRequest&& r)
+{
+    auto pTemplate = std::make_shared<SpawnTemplate>();
+    pTemplate->Flags = r.Flags & ~RequestFlagsEnvironmentBlock;
+    pTemplate->WorkingDirectory = r.WorkingDirectory;
+    pTemplate->ExecutablePath = r.ExecutablePath;
+    pTemplate->DeadlineMilliseconds = r.DeadlineMilliseconds;
+    pTemplate->GracePeriodMilliseconds = r.GracePeriodMilliseconds;
+    pTemplate->GroupTag = r.GroupTag;
+    pTemplate->JobGroupId = r.JobGroupId;
+    pTemplate->Job = std::move(r.Job);
+    pTemplate->ArgvPrefix.assign(r.Argv.begin(), r.Argv.end() - 1);
+
+    // Hold the final environment as a block so that spawns can pass it to execve without copying.
+    if (r.Environment && r.Envp.size() == 1)
+    {
+        pTemplate->Environment = r.Environment;
+    }
+    else
+    {
+        pTemplate->Environment = std::make_shared<EnvironmentBlock>(EnvironmentBlock{nullptr, std::move(r.Envp)});
+    }
+
+    pTemplate->BaseEnvironment = std::move(r.Environment);
+    pTemplate->Data = std::move(r.Data);
+    return pTemplate;
+}
+
+void ExpandSpawnTemplate(SpawnProcessRequest* r, SpawnFromTemplateRequest&& request, std::shared_ptr<const SpawnTemplate> pTemplate)
+{
+    r->Data = std::move(request.Data);
+    r->Token = request.Token;
+    r->Flags = pTemplate->Flags;
+    r->WorkingDirectory = pTemplate->WorkingDirectory;
+    r->ExecutablePath = pTemplate->ExecutablePath;
+    r->DeadlineMilliseconds = pTemplate->DeadlineMilliseconds;
+    r->GracePeriodMilliseconds = pTemplate->GracePeriodMilliseconds;
+    r->GroupTag = pTemplate->GroupTag;
+    r->JobGroupId = pTemplate->JobGroupId;
+    r->Job = pTemplate->Job;
+
+    // Allocated the same way as the request.
+    r->Argv = StringArray(request.Argv.get_allocator());
+    r->Argv.reserve(pTemplate->ArgvPrefix.size() + request.Argv.size() + 1);
+    r->Argv.assign(pTemplate->ArgvPrefix.begin(), pTemplate->ArgvPrefix.end());
+    r->Argv.insert(r->Argv.end(), request.Argv.begin(), request.Argv.end());
+    r->Argv.push_back(nullptr);
+
+    // An empty overlay: use the environment of the template as is (GetEnvp).
+    r->Envp = StringArray(1, nullptr, request.Argv.get_allocator());
+    r->Environment = pTemplate->Environment;
+    r->Template = std::move(pTemplate);
+}
@@ -0,0 +1,41 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "ObjectRegistry.hpp"
+#include "Request.hpp"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A spawn request registered by RequestCommand::RegisterSpawnTemplate.
+struct SpawnTemplate final
+{
+    std::shared_ptr<const std::byte[]> Data;
+    // SpawnProcessRequestFlags applied to every spawn from this template.
+    std::uint32_t Flags;
+    const char* WorkingDirectory;
+    const char* ExecutablePath;
+    // RequestFlagsDeadline
+    std::uint32_t DeadlineMilliseconds;
+    std::uint32_t GracePeriodMilliseconds;
+    // RequestFlagsGroupTag
+    std::uint32_t GroupTag;
+    // RequestFlagsJobGroup: Resolved at registration.
+    std::uint32_t JobGroupId;
+    std::shared_ptr<const JobGroup> Job;
+    // Not terminated by nullptr.
+    std::vector<const char*> ArgvPrefix;
+    // The strings may be owned by Data or BaseEnvironment rather than by the block itself.
+    std::shared_ptr<const EnvironmentBlock> Environment;
+    // The registered environment block the template was created from, if any.
+    std::shared_ptr<const EnvironmentBlock> BaseEnvironment;
+};
+
+using SpawnTemplateRegistry = ObjectRegistry<SpawnTemplate>;
+
+// r: The environment must have been resolved (ResolveEnvironment).
+[[nodiscard]] std::shared_ptr<const SpawnTemplate> CreateSpawnTemplate(SpawnProcessRequest&& r);
+
+// NOTE: Does not set fds.
+void ExpandSpawnTemplate(SpawnProcessRequest* r, SpawnFromTemplateRequest&& request, std::shared_ptr<const SpawnTemplate> pTemplate);
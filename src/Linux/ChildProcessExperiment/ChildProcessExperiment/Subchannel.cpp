@@ -5,11 +5,17 @@
 #include "Base.hpp"
 #include "BinaryReader.hpp"
 #include "ChildProcessState.hpp"
+#include "EnvironmentRegistry.hpp"
 #include "ErrorCodeExceptions.hpp"
 #include "Globals.hpp"
+#include "JobGroup.hpp"
 #include "MiscHelpers.hpp"
+#include "ProcessSpawner.hpp"
 #include "Request.hpp"
 #include "Service.hpp"
+#include "ServiceOptions.hpp"
+#include "SocketHelpers.hpp"
+#include "SpawnTemplate.hpp"
 #include "UniqueResource.hpp"
 #include <algorithm>
 #include <cassert>
@@ -17,130 +23,259 @@
 #include <cstdio>
 #include <cstring>
 #include <memory>
-#include <poll.h>
 #include <unistd.h>
 #include <vector>
 
-struct RawRequest final
+namespace
 {
-    RequestCommand Command;
-    uint32_t BodyLength;
-    std::unique_ptr<std::byte[]> Body;
-};
-
-class Subchannel final
-{
-public:
-    explicit Subchannel(UniqueFd sockFd) noexcept : sock_(std::move(sockFd)) {}
-
-    static void StartHandler(UniqueFd sockFd);
-
-private:
-    static void* ThreadFunc(void* arg);
-    void MainLoop();
-
-    void HandleProcessCreationCommand(std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength);
-    void ToProcessCreationRequest(SpawnProcessRequest* r, std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength);
-    void HandleProcessCreationRequest(const SpawnProcessRequest& r);
-
-    void HandleSendSignalCommand(std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength);
-    std::optional<int> ToNativeSignal(AbstractSignal abstractSignal) noexcept;
-
-    void RecvRawRequest(RawRequest* r);
-    void SendSuccess(std::int32_t data);
-    void SendError(int err);
-    void SendResponse(int err, std::int32_t data);
-
-    AncillaryDataSocket sock_;
-};
+    // With helper shards, a client-chosen token must be spawned on the shard GetShardOfToken routes it to.
+    // Otherwise signal requests for the token, which are routed the same way, would not find the child.
+    void ThrowIfTokenOfOtherShard(const SpawnProcessRequest& r)
+    {
+        if (!(r.Flags & RequestFlagsServiceAssignedToken)
+            && GetShardOfToken(r.Token, g_ServiceOptions.ShardCount) != g_ServiceOptions.ShardIndex)
+        {
+            TRACE_ERROR("Token of another shard: %llx\n", static_cast<unsigned long long>(r.Token));
+            throw BadRequestError(ErrorCode::InvalidRequest);
+        }
+    }
+} // namespace
 
-void StartSubchannelHandler(UniqueFd sockFd)
+void StartSubchannelHandler(UniqueFd sockFd, std::uint32_t flags)
 {
-    Subchannel::StartHandler(std::move(sockFd));
+    Subchannel::StartHandler(std::move(sockFd), flags);
 }
 
-void Subchannel::StartHandler(UniqueFd sockFd)
+void Subchannel::StartHandler(UniqueFd sockFd, std::uint32_t flags)
 {
-    auto maybeThread = CreateThreadWithMyDefault(Subchannel::ThreadFunc, reinterpret_cast<void*>(sockFd.Get()), CreateThreadFlagsDetached);
+    auto pSubchannel = std::make_unique<Subchannel>(std::move(sockFd), BlockingFlag::Blocking, flags);
+    auto maybeThread = CreateThreadWithMyDefault(Subchannel::ThreadFunc, pSubchannel.get(), CreateThreadFlagsDetached);
     if (!maybeThread)
     {
         const std::int32_t err = errno;
         perror("pthread_create");
-        static_cast<void>(WriteExactBytes(sockFd.Get(), &err, sizeof(err)));
+        static_cast<void>(WriteExactBytes(pSubchannel->GetFd(), &err, sizeof(err)));
         return;
     }
 
-    // At this point, the thread owns the ownership of the fd.
-    static_cast<void>(sockFd.Release());
+    // At this point, the thread owns the subchannel.
+    static_cast<void>(pSubchannel.release());
 }
 
 void* Subchannel::ThreadFunc(void* arg)
 {
-    const int sockFd = static_cast<int>(reinterpret_cast<uintptr_t>(arg));
-    Subchannel subchannel{UniqueFd(sockFd)};
+    const std::unique_ptr<Subchannel> pSubchannel{static_cast<Subchannel*>(arg)};
     try
     {
-        subchannel.MainLoop();
+        pSubchannel->MainLoop();
     }
     catch ([[maybe_unused]] const CommunicationError& exn)
     {
         // NOTE: Orderly shutdown (errno=0) also reaches here.
-        TRACE_INFO("Subchannel %d disconnected: %d\n", sockFd, exn.GetError());
+        TRACE_INFO("Subchannel %d disconnected: %d\n", pSubchannel->GetFd(), exn.GetError());
     }
     return nullptr;
 }
 
-void Subchannel::MainLoop()
+void Subchannel::SendCreationResult()
 {
-    std::int32_t err = 0;
+    const std::int32_t err = 0;
 
-    // Report successful creation.
-    if (!WriteExactBytes(sock_.GetFd(), &err, sizeof(err)))
+    if (blocking_ == BlockingFlag::Blocking)
     {
-        return;
+        if (!WriteExactBytes(sock_.GetFd(), &err, sizeof(err)))
+        {
+            throw CommunicationError(errno);
+        }
     }
+    else
+    {
+        if (!responseSender_(&err, sizeof(err)))
+        {
+            throw CommunicationError(errno);
+        }
+    }
+}
+
+void Subchannel::MainLoop()
+{
+    // Report successful creation.
+    SendCreationResult();
 
     while (true)
     {
+        RawRequest rawRequest;
         try
         {
-            RawRequest rawRequest;
-            RecvRawRequest(&rawRequest);
+            const bool received = TryRecvRawRequest(&rawRequest);
+            assert(received);
+            static_cast<void>(received);
+        }
+        catch (const BadRequestError& exn)
+        {
+            HandleBadRequest(exn);
+            continue;
+        }
+
+        HandleRawRequest(&rawRequest);
+    }
+}
+
+void Subchannel::HandleInput()
+{
+    assert(blocking_ == BlockingFlag::NonBlocking);
 
-            switch (rawRequest.Command)
+    // NOTE: The owner stops receiving while responses are pending (MaxPendingResponseBytes) so that a client that
+    //       does not receive responses cannot make us buffer an unbounded amount of data. The requests handled here
+    //       are bounded by the receive buffer.
+    while (!IsReceivingSuspended())
+    {
+        RawRequest rawRequest;
+        try
+        {
+            if (!TryRecvRawRequest(&rawRequest))
             {
-            case RequestCommand::SpawnProcess:
-                HandleProcessCreationCommand(std::move(rawRequest.Body), rawRequest.BodyLength);
-                break;
-
-            case RequestCommand::SendSignal:
-                HandleSendSignalCommand(std::move(rawRequest.Body), rawRequest.BodyLength);
-                break;
-
-            default:
-                TRACE_ERROR("Unknown command: %u\n", static_cast<std::uint32_t>(rawRequest.Command));
-                static_cast<void>(SendError(ErrorCode::InvalidRequest));
-                break;
+                return;
             }
         }
         catch (const BadRequestError& exn)
         {
-            static_cast<void>(SendError(exn.GetError()));
+            HandleBadRequest(exn);
+            continue;
         }
+
+        HandleRawRequest(&rawRequest);
     }
 }
 
-void Subchannel::HandleProcessCreationCommand(std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength)
+void Subchannel::HandleReceived(ssize_t bytesReceived)
 {
+    assert(blocking_ == BlockingFlag::NonBlocking);
+    assert(isWaitingForInput_ && receivedBytes_ == 0);
+
+    const std::size_t fdCountBefore = sock_.ReceivedFdCount();
+    bytesReceived = sock_.CompleteRecv(&recvMessage_, bytesReceived);
+    if (!HandleRecvResult(BlockingFlag::Blocking, "recvmsg", bytesReceived, errno))
+    {
+        // Throws even for a normal shutdown (errno = 0).
+        throw CommunicationError(bytesReceived == 0 ? 0 : errno);
+    }
+
+    isWaitingForInput_ = false;
+    receivedBytes_ = static_cast<std::size_t>(bytesReceived);
+    receivedFdCount_ = sock_.ReceivedFdCount() - fdCountBefore;
+    HandleInput();
+}
+
+void Subchannel::HandleRawRequest(RawRequest* rawRequest)
+{
+    arena_.Reset();
+
+    try
+    {
+        switch (rawRequest->Command)
+        {
+        case RequestCommand::SpawnProcess:
+            HandleProcessCreationCommand(rawRequest);
+            break;
+
+        case RequestCommand::SendSignal:
+            HandleSendSignalCommand(rawRequest);
+            break;
+
+        case RequestCommand::SpawnProcessBatch:
+            HandleSpawnProcessBatchCommand(rawRequest);
+            break;
+
+        case RequestCommand::RegisterEnvironment:
+            HandleRegisterEnvironmentCommand(rawRequest);
+            break;
+
+        case RequestCommand::UnregisterEnvironment:
+            HandleUnregisterEnvironmentCommand(rawRequest);
+            break;
+
+        case RequestCommand::RegisterSpawnTemplate:
+            HandleRegisterSpawnTemplateCommand(rawRequest);
+            break;
+
+        case RequestCommand::UnregisterSpawnTemplate:
+            HandleUnregisterSpawnTemplateCommand(rawRequest);
+            break;
+
+        case RequestCommand::SpawnFromTemplate:
+            HandleSpawnFromTemplateCommand(rawRequest);
+            break;
+
+        case RequestCommand::SendSignalBulk:
+            HandleSendSignalBulkCommand(rawRequest);
+            break;
+
+        case RequestCommand::CreateJobGroup:
+            HandleCreateJobGroupCommand();
+            break;
+
+        case RequestCommand::DeleteJobGroup:
+        case RequestCommand::FreezeJobGroup:
+        case RequestCommand::KillJobGroup:
+        case RequestCommand::GetJobGroupStats:
+            HandleJobGroupCommand(rawRequest);
+            break;
+
+        default:
+            TRACE_ERROR("Unknown command: %u\n", static_cast<std::uint32_t>(rawRequest->Command));
+            static_cast<void>(SendError(ErrorCode::InvalidRequest));
+            break;
+        }
+    }
+    catch (const BadRequestError& exn)
+    {
+        HandleBadRequest(exn);
+    }
+}
+
+void Subchannel::HandleBadRequest(const BadRequestError& exn)
+{
+    // Discard fds sent with the rejected request so that they will not be taken by the next request.
+    const std::size_t laterRequestFdCount = GetLaterRequestFdCount();
+    while (sock_.ReceivedFdCount() > laterRequestFdCount)
+    {
+        static_cast<void>(sock_.PopReceivedFd());
+    }
+
+    SendError(exn.GetError());
+}
+
+void Subchannel::HandleProcessCreationCommand(RawRequest* rawRequest)
+{
+    auto body = TakeBodyIfDispatching(rawRequest);
+
     SpawnProcessRequest r;
-    ToProcessCreationRequest(&r, std::move(body), bodyLength);
-    HandleProcessCreationRequest(r);
+    DeserializeSpawnProcessRequest(&r, body ? body.get() : rawRequest->Body, rawRequest->BodyLength, GetRequestArena());
+    r.Data = std::move(body);
+    ThrowIfTokenOfOtherShard(r);
+    ResolveEnvironment(&r, environments_);
+    ResolveJobGroup(&r);
+    PopRequestFds(&r);
+    ThrowIfExtraFds();
+    StartProcessCreation(std::move(r));
 }
 
-void Subchannel::ToProcessCreationRequest(SpawnProcessRequest* r, std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength)
+void Subchannel::StartProcessCreation(SpawnProcessRequest&& r)
 {
-    DeserializeSpawnProcessRequest(r, std::move(body), bodyLength);
+    if (spawnDispatcher_)
+    {
+        requestsInFlight_++;
+        DispatchSpawn(std::move(r), nullptr, 0);
+    }
+    else
+    {
+        HandleProcessCreationRequest(r);
+    }
+}
 
+void Subchannel::PopRequestFds(SpawnProcessRequest* r)
+{
     auto popOrThrow = [this] {
         auto maybeFd = sock_.PopReceivedFd();
         if (!maybeFd)
@@ -163,131 +298,281 @@ void Subchannel::ToProcessCreationRequest(SpawnProcessRequest* r, std::unique_pt
     {
         r->StderrFd = popOrThrow();
     }
-    if (sock_.ReceivedFdCount() != 0)
+}
+
+void Subchannel::ThrowIfExtraFds()
+{
+    // fds of the following requests may have been received along with this request.
+    const std::size_t extraFdCount = sock_.ReceivedFdCount() - GetLaterRequestFdCount();
+    if (extraFdCount != 0)
     {
-        TRACE_ERROR("Too many fds in a request. Flags=%x, %zu fds remaining.\n", r->Flags, sock_.ReceivedFdCount());
+        TRACE_ERROR("Too many fds in a request. %zu fds remaining.\n", extraFdCount);
         throw BadRequestError(ErrorCode::InvalidRequest);
     }
 }
 
 void Subchannel::HandleProcessCreationRequest(const SpawnProcessRequest& r)
 {
-    auto maybeOutPipe = CreatePipe();
-    if (!maybeOutPipe)
+    const auto result = SpawnProcess(r);
+    SendProcessCreationResponse(currentRequestId_, result);
+}
+
+void Subchannel::HandleSpawnProcessBatchCommand(RawRequest* rawRequest)
+{
+    const auto body = TakeBodyIfDispatching(rawRequest);
+
+    std::vector<SpawnProcessRequest> entries;
+    DeserializeSpawnProcessBatchRequest(&entries, body ? body.get() : rawRequest->Body, rawRequest->BodyLength, GetRequestArena());
+    for (auto& r : entries)
+    {
+        r.Data = body;
+        ThrowIfTokenOfOtherShard(r);
+        ResolveEnvironment(&r, environments_);
+        ResolveJobGroup(&r);
+        PopRequestFds(&r);
+    }
+    ThrowIfExtraFds();
+
+    if (spawnDispatcher_ && !entries.empty())
     {
-        SendResponse(errno, 0);
+        // Let the executor run the entries in parallel.
+        const std::size_t count = entries.size();
+        auto pBatch = std::make_shared<PendingBatch>(PendingBatch{currentRequestId_, std::vector<SpawnProcessResult>(count), count});
+        requestsInFlight_++;
+        for (std::size_t i = 0; i < count; i++)
+        {
+            DispatchSpawn(std::move(entries[i]), pBatch, i);
+        }
+    }
+    else
+    {
+        std::vector<SpawnProcessResult> results;
+        results.reserve(entries.size());
+        for (const auto& r : entries)
+        {
+            results.push_back(SpawnProcess(r));
+        }
+
+        SendSpawnProcessBatchResponse(currentRequestId_, results);
+    }
+}
+
+void Subchannel::DispatchSpawn(SpawnProcessRequest&& r, std::shared_ptr<PendingBatch> pBatch, std::size_t index)
+{
+    const std::uint64_t dispatchId = nextDispatchId_++;
+    dispatchedSpawns_.emplace(dispatchId, DispatchedSpawn{currentRequestId_, std::move(pBatch), index});
+    spawnDispatcher_(dispatchId, std::move(r));
+}
+
+void Subchannel::CompleteProcessCreationRequest(std::uint64_t dispatchId, const SpawnProcessResult& result)
+{
+    const auto it = dispatchedSpawns_.find(dispatchId);
+    assert(it != dispatchedSpawns_.end());
+    const DispatchedSpawn dispatched = std::move(it->second);
+    dispatchedSpawns_.erase(it);
+
+    if (!dispatched.Batch)
+    {
+        assert(requestsInFlight_ > 0);
+        requestsInFlight_--;
+        SendProcessCreationResponse(dispatched.RequestId, result);
         return;
     }
-    auto maybeInPipe = CreatePipe();
-    if (!maybeInPipe)
+
+    PendingBatch* const pBatch = dispatched.Batch.get();
+    pBatch->Results[dispatched.Index] = result;
+    if (--pBatch->RemainingCount == 0)
+    {
+        assert(requestsInFlight_ > 0);
+        requestsInFlight_--;
+        SendSpawnProcessBatchResponse(pBatch->RequestId, pBatch->Results);
+    }
+}
+
+void Subchannel::HandleRegisterEnvironmentCommand(RawRequest* rawRequest)
+{
+    RegisterEnvironmentRequest r;
+    DeserializeRegisterEnvironmentRequest(&r, TakeBody(rawRequest), rawRequest->BodyLength);
+
+    auto& registry = (r.Flags & RegisterFlagsServiceScope) ? g_ServiceEnvironmentRegistry : environments_;
+    const auto maybeId = registry.Register(std::move(r.Block));
+    if (!maybeId)
     {
-        SendResponse(errno, 0);
+        SendError(ENOSPC);
         return;
     }
 
-    // NOTE: These fds may be inherited by multiple forked processes.
-    // parent -> child : To signal "the parent is ready; perform exec"
-    auto outPipe = std::move(*maybeOutPipe);
-    // child -> parent : To signal exec error (or no write on success)
-    auto inPipe = std::move(*maybeInPipe);
+    SendSuccess(static_cast<std::int32_t>(*maybeId));
+}
+
+void Subchannel::HandleUnregisterEnvironmentCommand(RawRequest* rawRequest)
+{
+    UnregisterRequest r;
+    DeserializeUnregisterRequest(&r, rawRequest->Body, rawRequest->BodyLength);
 
-    int childPid = fork();
-    if (childPid == -1)
+    auto& registry = (r.Id & ServiceScopeIdBit) ? g_ServiceEnvironmentRegistry : environments_;
+    if (!registry.Unregister(r.Id))
     {
-        SendResponse(errno, 0);
+        SendError(ENOENT);
+        return;
     }
-    else if (childPid == 0)
+
+    SendSuccess(0);
+}
+
+void Subchannel::HandleRegisterSpawnTemplateCommand(RawRequest* rawRequest)
+{
+    RegisterSpawnTemplateRequest r;
+    DeserializeRegisterSpawnTemplateRequest(&r, TakeBody(rawRequest), rawRequest->BodyLength);
+    ResolveEnvironment(&r.Spawn, environments_);
+    ResolveJobGroup(&r.Spawn);
+
+    auto& registry = (r.Flags & RegisterFlagsServiceScope) ? g_ServiceSpawnTemplateRegistry : templates_;
+    const auto maybeId = registry.Register(CreateSpawnTemplate(std::move(r.Spawn)));
+    if (!maybeId)
     {
-        // child
-        outPipe.WriteEnd.Reset();
-        inPipe.ReadEnd.Reset();
+        SendError(ENOSPC);
+        return;
+    }
 
-        auto dup2OrFail = [](const UniqueFd& writeEnd, const UniqueFd& src, int dst) {
-            if (src.IsValid())
-            {
-                if (dup2(src.Get(), dst) == -1)
-                {
-                    int err = errno;
-                    static_cast<void>(WriteExactBytes(writeEnd.Get(), &err, sizeof(err)));
-                    _exit(1);
-                }
-            }
-        };
+    SendSuccess(static_cast<std::int32_t>(*maybeId));
+}
 
-        auto reportError = [](int fd, int err) {
-            static_cast<void>(WriteExactBytes(fd, &err, sizeof(err)));
-        };
+void Subchannel::HandleUnregisterSpawnTemplateCommand(RawRequest* rawRequest)
+{
+    UnregisterRequest r;
+    DeserializeUnregisterRequest(&r, rawRequest->Body, rawRequest->BodyLength);
 
-        dup2OrFail(inPipe.WriteEnd, r.StdinFd, STDIN_FILENO);
-        dup2OrFail(inPipe.WriteEnd, r.StdoutFd, STDOUT_FILENO);
-        dup2OrFail(inPipe.WriteEnd, r.StderrFd, STDERR_FILENO);
+    auto& registry = (r.Id & ServiceScopeIdBit) ? g_ServiceSpawnTemplateRegistry : templates_;
+    if (!registry.Unregister(r.Id))
+    {
+        SendError(ENOENT);
+        return;
+    }
 
-        if (r.WorkingDirectory != nullptr)
-        {
-            if (chdir_restarting(r.WorkingDirectory) == -1)
-            {
-                reportError(inPipe.WriteEnd.Get(), errno);
-                _exit(1);
-            }
-        }
+    SendSuccess(0);
+}
 
-        // Wait for the parent to be ready
-        char c;
-        if (!ReadExactBytes(outPipe.ReadEnd.Get(), &c, 1))
-        {
-            // The parent has been killed; no point in continuing.
-            _exit(1);
-        }
+void Subchannel::HandleSpawnFromTemplateCommand(RawRequest* rawRequest)
+{
+    auto body = TakeBodyIfDispatching(rawRequest);
 
-        // Always create a new process group.
-        setpgid(0, 0);
-        // NOTE: POSIX specifies execve shall not modify argv and envp.
-        execve(r.ExecutablePath, const_cast<char* const*>(&r.Argv[0]), const_cast<char* const*>(&r.Envp[0]));
+    SpawnFromTemplateRequest request;
+    DeserializeSpawnFromTemplateRequest(&request, body ? body.get() : rawRequest->Body, rawRequest->BodyLength, GetRequestArena());
+    request.Data = std::move(body);
 
-        reportError(inPipe.WriteEnd.Get(), errno);
-        _exit(1);
+    auto pTemplate = (request.TemplateId & ServiceScopeIdBit)
+        ? g_ServiceSpawnTemplateRegistry.Get(request.TemplateId)
+        : templates_.Get(request.TemplateId);
+    if (!pTemplate)
+    {
+        TRACE_ERROR("Unknown template ID: %x\n", static_cast<unsigned int>(request.TemplateId));
+        throw BadRequestError(ErrorCode::InvalidRequest);
     }
-    else
+
+    if (!(pTemplate->Flags & RequestFlagsServiceAssignedToken) && IsServiceAssignedToken(request.Token))
+    {
+        TRACE_ERROR("Token reserved for the service: %llx\n", static_cast<unsigned long long>(request.Token));
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+
+    SpawnProcessRequest r;
+    ExpandSpawnTemplate(&r, std::move(request), std::move(pTemplate));
+    ThrowIfTokenOfOtherShard(r);
+    PopRequestFds(&r);
+    ThrowIfExtraFds();
+    StartProcessCreation(std::move(r));
+}
+
+void Subchannel::HandleCreateJobGroupCommand()
+{
+    auto pGroup = JobGroup::Create();
+    if (!pGroup)
+    {
+        SendError(errno);
+        return;
+    }
+
+    const auto maybeId = g_JobGroupRegistry.Register(pGroup);
+    if (!maybeId)
     {
-        // parent
-        outPipe.ReadEnd.Reset();
-        inPipe.WriteEnd.Reset();
+        static_cast<void>(pGroup->Remove());
+        SendError(ENOSPC);
+        return;
+    }
 
-        // Register the child before the child performs exec.
-        g_ChildProcessStateMap.Allocate(childPid, r.Token);
+    SendSuccess(static_cast<std::int32_t>(*maybeId));
+}
 
-        // Send a reap request in case the child has already been killed and we have delayed reaping.
-        if (!NotifyServiceOfChildRegistration())
+void Subchannel::HandleJobGroupCommand(RawRequest* rawRequest)
+{
+    JobGroupRequest r;
+    DeserializeJobGroupRequest(&r, rawRequest->Command, rawRequest->Body, rawRequest->BodyLength);
+
+    const auto pGroup = g_JobGroupRegistry.Get(r.Id);
+    if (!pGroup)
+    {
+        SendError(ENOENT);
+        return;
+    }
+
+    switch (rawRequest->Command)
+    {
+    case RequestCommand::DeleteJobGroup:
+        // Keep the group registered if it still has processes.
+        if (!pGroup->Remove())
         {
-            FatalErrorAbort(errno, "write");
+            SendError(errno);
+            return;
         }
 
-        // Make the child to perform exec.
-        if (!WriteExactBytes(outPipe.WriteEnd.Get(), "", 1))
+        static_cast<void>(g_JobGroupRegistry.Unregister(r.Id));
+        break;
+
+    case RequestCommand::FreezeJobGroup:
+        if (!pGroup->Freeze(r.Frozen))
         {
-            // The child has already been killed.
-            SendResponse(errno, 0);
+            SendError(errno);
             return;
         }
+        break;
 
-        int err = 0;
-        const bool execSuccessful = !ReadExactBytes(inPipe.ReadEnd.Get(), &err, sizeof(err));
-        if (execSuccessful)
+    case RequestCommand::KillJobGroup:
+        if (!pGroup->Kill())
         {
-            SendResponse(0, childPid);
+            SendError(errno);
+            return;
         }
-        else
+        break;
+
+    case RequestCommand::GetJobGroupStats:
+    {
+        // Error code, reserved and JobGroupStats.
+        std::byte buf[8 + sizeof(JobGroupStats)]{};
+        JobGroupStats stats;
+        if (!pGroup->GetStats(&stats))
         {
-            // Failed to execute the program: failed to dup2 or execve.
-            SendResponse(err, 0);
+            SendError(errno);
+            return;
         }
+
+        std::memcpy(&buf[8], &stats, sizeof(stats));
+        SendResponseBytes(currentRequestId_, buf, sizeof(buf));
+        return;
     }
+
+    default:
+        assert(false);
+        break;
+    }
+
+    SendSuccess(0);
 }
 
-void Subchannel::HandleSendSignalCommand(std::unique_ptr<std::byte[]> body, std::uint32_t bodyLength)
+void Subchannel::HandleSendSignalCommand(RawRequest* rawRequest)
 {
     SendSignalRequest r;
-    DeserializeSendSignalRequest(&r, std::move(body), bodyLength);
+    DeserializeSendSignalRequest(&r, rawRequest->Body, rawRequest->BodyLength);
 
     auto nativeSignal = ToNativeSignal(r.Signal);
     if (!nativeSignal)
@@ -301,26 +586,81 @@ void Subchannel::HandleSendSignalCommand(std::unique_ptr<std::byte[]> body, std:
         // The process has already been reaped.
         SendSuccess(0);
     }
-    else if (pState->SendSignal(nativeSignal.value()))
+    else if (const int err = SignalChild(pState.get(), r.Signal, nativeSignal.value()); err == 0 || err == ESRCH)
     {
-        if (r.Signal == AbstractSignal::Termination)
-        {
-            // Also send SIGCONT to ensure termination.
-            static_cast<void>(pState->SendSignal(SIGCONT));
-        }
-
-        // Sent a signal.
+        // Sent a signal, or the process has already been reaped.
         SendSuccess(0);
     }
-    else if (errno == ESRCH)
+    else
     {
-        // The process has already been reaped.
-        SendSuccess(0);
+        SendError(err);
     }
-    else
+}
+
+void Subchannel::HandleSendSignalBulkCommand(RawRequest* rawRequest)
+{
+    SendSignalBulkRequest r;
+    DeserializeSendSignalBulkRequest(&r, rawRequest->Body, rawRequest->BodyLength);
+
+    auto nativeSignal = ToNativeSignal(r.Signal);
+    if (!nativeSignal)
     {
-        SendError(errno);
+        throw BadRequestError(ErrorCode::InvalidRequest);
+    }
+
+    // Look up all targets first so that the map is locked once per shard, not once per target.
+    std::vector<std::shared_ptr<ChildProcessState>> states;
+    switch (r.Target)
+    {
+    case SendSignalBulkTarget::Tokens:
+        g_ChildProcessStateMap.GetByTokens(r.Tokens, &states);
+        break;
+
+    case SendSignalBulkTarget::AllChildren:
+        g_ChildProcessStateMap.GetAll(&states);
+        break;
+
+    case SendSignalBulkTarget::GroupTag:
+        g_ChildProcessStateMap.GetByGroupTag(r.GroupTag, &states);
+        break;
     }
+
+    // Error code, count and (error code, pid, token) of each target.
+    std::vector<std::byte> buf(8 + states.size() * 16);
+    const std::int32_t err = 0;
+    const std::uint32_t count = static_cast<std::uint32_t>(states.size());
+    std::memcpy(&buf[0], &err, 4);
+    std::memcpy(&buf[4], &count, 4);
+
+    for (std::size_t i = 0; i < states.size(); i++)
+    {
+        ChildProcessState* const pState = states[i].get();
+        // Tokens not found have been reaped (or never existed).
+        const std::int32_t entryErr = pState != nullptr ? SignalChild(pState, r.Signal, nativeSignal.value()) : ESRCH;
+        const std::int32_t pid = pState != nullptr ? pState->GetPid() : 0;
+        const std::uint64_t token = pState != nullptr ? pState->GetToken() : r.Tokens[i];
+        std::memcpy(&buf[8 + i * 16], &entryErr, 4);
+        std::memcpy(&buf[8 + i * 16 + 4], &pid, 4);
+        std::memcpy(&buf[8 + i * 16 + 8], &token, 8);
+    }
+
+    SendResponseBytes(currentRequestId_, buf.data(), buf.size());
+}
+
+int Subchannel::SignalChild(ChildProcessState* pState, AbstractSignal signal, int nativeSignal) noexcept
+{
+    if (!pState->SendSignal(nativeSignal))
+    {
+        return errno;
+    }
+
+    if (signal == AbstractSignal::Termination)
+    {
+        // Also send SIGCONT to ensure termination.
+        static_cast<void>(pState->SendSignal(SIGCONT));
+    }
+
+    return 0;
 }
 
 std::optional<int> Subchannel::ToNativeSignal(AbstractSignal abstractSignal) noexcept
@@ -341,50 +681,201 @@ std::optional<int> Subchannel::ToNativeSignal(AbstractSignal abstractSignal) noe
     }
 }
 
-void Subchannel::RecvRawRequest(RawRequest* r)
+std::unique_ptr<std::byte[]> Subchannel::TakeBody(RawRequest* rawRequest)
 {
-    std::uint32_t commandAndLength[2];
-    if (!sock_.RecvExactBytes(&commandAndLength, sizeof(commandAndLength)))
+    if (rawRequest->OwnedBody)
     {
-        // Throws even for a normal shutdown (errno = 0).
-        throw CommunicationError(errno);
+        return std::move(rawRequest->OwnedBody);
     }
 
-    const RequestCommand command = static_cast<RequestCommand>(commandAndLength[0]);
-    const std::uint32_t bodyLength = commandAndLength[1];
+    auto body = std::make_unique<std::byte[]>(rawRequest->BodyLength);
+    std::memcpy(body.get(), rawRequest->Body, rawRequest->BodyLength);
+    return body;
+}
+
+std::shared_ptr<const std::byte[]> Subchannel::TakeBodyIfDispatching(RawRequest* rawRequest)
+{
+    return spawnDispatcher_ ? TakeBody(rawRequest) : nullptr;
+}
 
-    if (bodyLength > MaxReqeuestLength)
+bool Subchannel::TryRecvRawRequest(RawRequest* r)
+{
+    const std::size_t headerLength = GetHeaderLength();
+    if (!recvBuffer_)
     {
-        TRACE_ERROR("Request too big: %u\n", static_cast<unsigned int>(bodyLength));
+        recvBuffer_ = std::make_unique<std::byte[]>(SubchannelRecvBufferInitialSize);
+        recvBufferSize_ = SubchannelRecvBufferInitialSize;
+    }
+
+    while (true)
+    {
+        if (largeBody_)
+        {
+            const std::uint32_t bodyLength = header_[1];
+            const std::size_t bytesReceived = RecvSome(&largeBody_[largeBodyBytesReceived_], bodyLength - largeBodyBytesReceived_);
+            if (bytesReceived == 0)
+            {
+                return false;
+            }
+
+            largeBodyBytesReceived_ += bytesReceived;
+            if (largeBodyBytesReceived_ == bodyLength)
+            {
+                currentRequestEnd_ = totalBytesReceived_;
+                r->Command = static_cast<RequestCommand>(header_[0]);
+                r->BodyLength = bodyLength;
+                r->OwnedBody = std::move(largeBody_);
+                r->Body = r->OwnedBody.get();
+                return true;
+            }
+
+            continue;
+        }
 
-        // Discard the request body.
-        const size_t BufSize = 64 * 1024;
-        auto buf = std::make_unique<std::byte[]>(BufSize);
-        size_t totalReceivedBytes = 0;
-        while (totalReceivedBytes < bodyLength)
+        const std::size_t bufferedBytes = recvEnd_ - recvBegin_;
+        if (bodyBytesToDiscard_ != 0)
         {
-            std::size_t bytesToReceive = std::min(BufSize, bodyLength - totalReceivedBytes);
-            ssize_t receivedBytes = sock_.Recv(buf.get(), bytesToReceive, BlockingFlag::Blocking);
-            if (receivedBytes <= 0)
+            const std::size_t bytesToDiscard = std::min(bufferedBytes, bodyBytesToDiscard_);
+            recvBegin_ += bytesToDiscard;
+            bodyBytesToDiscard_ -= bytesToDiscard;
+            if (bodyBytesToDiscard_ == 0)
             {
-                throw new CommunicationError(errno);
+                currentRequestEnd_ = totalBytesReceived_ - (recvEnd_ - recvBegin_);
+                throw BadRequestError(E2BIG);
+            }
+        }
+        else if (bufferedBytes >= headerLength)
+        {
+            header_[2] = 0;
+            std::memcpy(header_, &recvBuffer_[recvBegin_], headerLength);
+            currentRequestId_ = header_[2];
+
+            const std::uint32_t bodyLength = header_[1];
+            const std::size_t requestLength = headerLength + bodyLength;
+            if (bodyLength > MaxReqeuestLength)
+            {
+                TRACE_ERROR("Request too big: %u\n", static_cast<unsigned int>(bodyLength));
+                recvBegin_ += headerLength;
+                bodyBytesToDiscard_ = bodyLength;
+                continue;
+            }
+            else if (bufferedBytes >= requestLength)
+            {
+                // Parse in place.
+                r->Command = static_cast<RequestCommand>(header_[0]);
+                r->BodyLength = bodyLength;
+                r->Body = &recvBuffer_[recvBegin_ + headerLength];
+                recvBegin_ += requestLength;
+                currentRequestEnd_ = totalBytesReceived_ - (recvEnd_ - recvBegin_);
+                return true;
+            }
+            else if (requestLength > recvBufferSize_)
+            {
+                if (requestLength <= SubchannelRecvBufferMaxSize)
+                {
+                    GrowRecvBuffer(requestLength);
+                }
+                else
+                {
+                    // Receive the rest of the body directly to its own buffer.
+                    const std::size_t bodyBytesBuffered = bufferedBytes - headerLength;
+                    largeBody_ = std::make_unique<std::byte[]>(bodyLength);
+                    std::memcpy(largeBody_.get(), &recvBuffer_[recvBegin_ + headerLength], bodyBytesBuffered);
+                    largeBodyBytesReceived_ = bodyBytesBuffered;
+                    recvBegin_ = recvEnd_ = 0;
+                    continue;
+                }
             }
-            totalReceivedBytes += receivedBytes;
         }
 
-        throw BadRequestError(E2BIG);
+        // Receive more. Move the incomplete request to the front first.
+        if (recvBegin_ != 0)
+        {
+            std::memmove(&recvBuffer_[0], &recvBuffer_[recvBegin_], recvEnd_ - recvBegin_);
+            recvEnd_ -= recvBegin_;
+            recvBegin_ = 0;
+        }
+
+        const std::size_t bytesReceived = RecvSome(&recvBuffer_[recvEnd_], recvBufferSize_ - recvEnd_);
+        if (bytesReceived == 0)
+        {
+            return false;
+        }
+
+        recvEnd_ += bytesReceived;
     }
+}
+
+void Subchannel::GrowRecvBuffer(std::size_t minSize)
+{
+    const std::size_t newSize = std::min(std::max(recvBufferSize_ * 2, minSize), SubchannelRecvBufferMaxSize);
+    auto newBuffer = std::make_unique<std::byte[]>(newSize);
+    std::memcpy(newBuffer.get(), &recvBuffer_[recvBegin_], recvEnd_ - recvBegin_);
+    recvEnd_ -= recvBegin_;
+    recvBegin_ = 0;
+    recvBuffer_ = std::move(newBuffer);
+    recvBufferSize_ = newSize;
+}
 
-    auto body = std::make_unique<std::byte[]>(bodyLength);
-    if (!sock_.RecvExactBytes(&body[0], bodyLength))
+// NonBlocking: Returns the data HandleReceived has received to buf. If none, returns 0 and waits for input to buf.
+std::size_t Subchannel::RecvSome(void* buf, std::size_t len)
+{
+    std::size_t bytesReceived;
+    std::size_t fdCount;
+    if (blocking_ == BlockingFlag::Blocking)
     {
-        // Throws even for a normal shutdown (errno = 0).
-        throw CommunicationError(errno);
+        const std::size_t fdCountBefore = sock_.ReceivedFdCount();
+        const ssize_t result = sock_.Recv(buf, len, blocking_);
+        if (!HandleRecvResult(blocking_, "recvmsg", result, errno))
+        {
+            // Throws even for a normal shutdown (errno = 0).
+            throw CommunicationError(result == 0 ? 0 : errno);
+        }
+
+        bytesReceived = static_cast<std::size_t>(result);
+        fdCount = sock_.ReceivedFdCount() - fdCountBefore;
+    }
+    else if (receivedBytes_ == 0)
+    {
+        recvIov_.iov_base = buf;
+        recvIov_.iov_len = len;
+        isWaitingForInput_ = true;
+        return 0;
+    }
+    else
+    {
+        // TryRecvRawRequest asks for the same place until it gets data.
+        assert(buf == recvIov_.iov_base);
+        bytesReceived = receivedBytes_;
+        fdCount = receivedFdCount_;
+        receivedBytes_ = 0;
+        receivedFdCount_ = 0;
+    }
+
+    totalBytesReceived_ += bytesReceived;
+    if (fdCount > 0)
+    {
+        fdArrivals_.push_back(FdArrival{totalBytesReceived_, fdCount});
     }
 
-    r->BodyLength = bodyLength;
-    r->Body = std::move(body);
-    r->Command = command;
+    return bytesReceived;
+}
+
+std::size_t Subchannel::GetLaterRequestFdCount() noexcept
+{
+    // Arrivals up to the current request are no longer needed; the fds of the previous requests have been taken.
+    while (!fdArrivals_.empty() && fdArrivals_.front().EndOffset <= currentRequestEnd_)
+    {
+        fdArrivals_.pop_front();
+    }
+
+    std::size_t count = 0;
+    for (const auto& arrival : fdArrivals_)
+    {
+        count += arrival.Count;
+    }
+
+    return std::min(count, sock_.ReceivedFdCount());
 }
 
 void Subchannel::SendSuccess(std::int32_t data)
@@ -404,7 +895,69 @@ void Subchannel::SendResponse(int err, std::int32_t data)
     std::byte buf[8];
     std::memcpy(&buf[0], &err, 4);
     std::memcpy(&buf[4], &data, 4);
-    if (!sock_.SendExactBytes(buf, 8))
+    SendResponseBytes(currentRequestId_, buf, sizeof(buf));
+}
+
+void Subchannel::SendProcessCreationResponse(std::uint32_t requestId, const SpawnProcessResult& result)
+{
+    std::byte buf[16];
+    std::memcpy(&buf[0], &result.Error, 4);
+    std::memcpy(&buf[4], &result.ProcessID, 4);
+    std::memcpy(&buf[8], &result.Token, 8);
+    SendResponseBytes(requestId, buf, result.HasServiceAssignedToken ? 16 : 8);
+}
+
+void Subchannel::SendSpawnProcessBatchResponse(std::uint32_t requestId, const std::vector<SpawnProcessResult>& results)
+{
+    // Error code, count and the response of each entry.
+    std::vector<std::byte> buf(8 + results.size() * 16);
+    const std::int32_t err = 0;
+    const std::uint32_t count = static_cast<std::uint32_t>(results.size());
+    std::memcpy(&buf[0], &err, 4);
+    std::memcpy(&buf[4], &count, 4);
+
+    std::size_t pos = 8;
+    for (const auto& result : results)
+    {
+        std::memcpy(&buf[pos], &result.Error, 4);
+        std::memcpy(&buf[pos + 4], &result.ProcessID, 4);
+        pos += 8;
+        if (result.HasServiceAssignedToken)
+        {
+            std::memcpy(&buf[pos], &result.Token, 8);
+            pos += 8;
+        }
+    }
+
+    SendResponseBytes(requestId, buf.data(), pos);
+}
+
+void Subchannel::SendResponseBytes(std::uint32_t requestId, const void* buf, std::size_t len)
+{
+    // SubchannelFlagsPipelined: Prefix the response with the request ID and the response length.
+    std::byte taggedBuf[8 + 16];
+    std::vector<std::byte> largeTaggedBuf;
+    if (isPipelined_)
+    {
+        std::byte* pTagged = taggedBuf;
+        if (len > sizeof(taggedBuf) - 8)
+        {
+            largeTaggedBuf.resize(8 + len);
+            pTagged = largeTaggedBuf.data();
+        }
+
+        const std::uint32_t responseLength = static_cast<std::uint32_t>(len);
+        std::memcpy(&pTagged[0], &requestId, 4);
+        std::memcpy(&pTagged[4], &responseLength, 4);
+        std::memcpy(&pTagged[8], buf, len);
+        buf = pTagged;
+        len += 8;
+    }
+
+    const bool successful = blocking_ == BlockingFlag::Blocking
+        ? sock_.SendExactBytes(buf, len)
+        : responseSender_(buf, len);
+    if (!successful)
     {
         throw CommunicationError(errno);
     }
@@ -2,9 +2,234 @@
 
 #pragma once
 
+#include "AncillaryDataSocket.hpp"
+#include "Arena.hpp"
+#include "Base.hpp"
+#include "EnvironmentRegistry.hpp"
+#include "ErrorCodeExceptions.hpp"
+#include "ProcessSpawner.hpp"
+#include "Request.hpp"
+#include "SocketHelpers.hpp"
+#include "SpawnTemplate.hpp"
 #include "UniqueResource.hpp"
+#include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+class ChildProcessState;
 
 const std::uint32_t MaxReqeuestLength = 2 * 1024 * 1024;
+// Requests are received into a per-subchannel buffer that grows up to this size.
+// Larger requests get a dedicated allocation for their bodies.
+const std::size_t SubchannelRecvBufferInitialSize = 4 * 1024;
+const std::size_t SubchannelRecvBufferMaxSize = 64 * 1024;
+// Holds the pointer arrays of the request being handled.
+const std::size_t SubchannelArenaInitialSize = 4 * 1024;
+// SubchannelFlagsPipelined: Receiving requests is suspended while this many requests are in flight.
+const std::size_t MaxPipelinedRequestsInFlight = 64;
+// NonBlocking: Receiving requests is paused while more than this many bytes of responses wait to be sent.
+const std::size_t MaxPendingResponseBytes = 64 * 1024;
+
+struct RawRequest final
+{
+    RequestCommand Command;
+    uint32_t BodyLength;
+    // Points into the receive buffer of the subchannel (valid until the next receive) or to OwnedBody.
+    const std::byte* Body;
+    // Set if the request did not fit in the receive buffer.
+    std::unique_ptr<std::byte[]> OwnedBody;
+};
+
+// Serves requests on a subchannel.
+//
+// BlockingFlag::Blocking: Served by a dedicated thread (StartHandler).
+// BlockingFlag::NonBlocking: Driven by SubchannelWorkerPool, whose reactor performs the transfers:
+//                            receives with GetRecvMessage (HandleReceived) and sends through the ResponseSender.
+class Subchannel final
+{
+public:
+    // Takes over a spawn request. The owner must call CompleteProcessCreationRequest with dispatchId later.
+    using SpawnDispatcher = std::function<void(std::uint64_t dispatchId, SpawnProcessRequest&& r)>;
+    // Queues a response. Returns false and sets errno on error.
+    using ResponseSender = std::function<bool(const void* buf, std::size_t len)>;
+
+    // flags: SubchannelCreationFlags
+    Subchannel(UniqueFd sockFd, BlockingFlag blocking, std::uint32_t flags) noexcept
+        : sock_(std::move(sockFd)), blocking_(blocking), isPipelined_((flags & SubchannelFlagsPipelined) != 0)
+    {
+        recvMessage_.msg_iov = &recvIov_;
+        recvMessage_.msg_iovlen = 1;
+        recvMessage_.msg_control = recvCmsgFds_.Buffer;
+        recvMessage_.msg_controllen = CmsgFds::BufferSize;
+    }
+
+    static void StartHandler(UniqueFd sockFd, std::uint32_t flags);
+
+    [[nodiscard]] int GetFd() const noexcept { return sock_.GetFd(); }
+
+    // NonBlocking: Must be set before SendCreationResult.
+    void SetResponseSender(ResponseSender sender) { responseSender_ = std::move(sender); }
+    // NonBlocking: The owner receives with this message (Reactor::AddMessageReader) and passes the result to
+    // HandleReceived. It points to the receive buffer after HandleInput has returned with IsWaitingForInput.
+    [[nodiscard]] msghdr* GetRecvMessage() noexcept { return &recvMessage_; }
+    // NonBlocking: HandleInput needs more data and the owner should receive.
+    [[nodiscard]] bool IsWaitingForInput() const noexcept { return isWaitingForInput_ && !IsReceivingSuspended(); }
+
+    // Throws CommunicationError if disconnected.
+    void SendCreationResult();
+    // NonBlocking: Handles all requests in the receive buffer, then waits for input unless suspended.
+    // Throws CommunicationError if disconnected.
+    void HandleInput();
+    // NonBlocking: Takes the result of a receive with GetRecvMessage and calls HandleInput.
+    // Throws CommunicationError if disconnected (including an orderly shutdown).
+    void HandleReceived(ssize_t bytesReceived);
+
+    // NonBlocking: Dispatches spawns instead of performing them on the calling thread.
+    // Unless pipelined, receiving requests is suspended until the dispatched spawn completes so that responses are
+    // kept in order.
+    void SetSpawnDispatcher(SpawnDispatcher dispatcher) { spawnDispatcher_ = std::move(dispatcher); }
+    [[nodiscard]] bool IsReceivingSuspended() const noexcept
+    {
+        return requestsInFlight_ >= (isPipelined_ ? MaxPipelinedRequestsInFlight : 1);
+    }
+    // Sends the response of the dispatched spawn. Throws CommunicationError if disconnected.
+    void CompleteProcessCreationRequest(std::uint64_t dispatchId, const SpawnProcessResult& result);
+
+private:
+    // Results of a batch being collected from dispatched spawns.
+    struct PendingBatch final
+    {
+        std::uint32_t RequestId;
+        std::vector<SpawnProcessResult> Results;
+        std::size_t RemainingCount;
+    };
+
+    struct DispatchedSpawn final
+    {
+        std::uint32_t RequestId;
+        // nullptr if not part of a batch.
+        std::shared_ptr<PendingBatch> Batch;
+        std::size_t Index;
+    };
+
+    // fds received by a recvmsg call that returned the stream bytes up to EndOffset.
+    // NOTE: The kernel does not return bytes past a message with fds in the same call; these fds belong to
+    //       the request that contains the byte at EndOffset - 1.
+    struct FdArrival final
+    {
+        std::uint64_t EndOffset;
+        std::size_t Count;
+    };
+
+    static void* ThreadFunc(void* arg);
+    void MainLoop();
+    void HandleRawRequest(RawRequest* rawRequest);
+    void HandleBadRequest(const BadRequestError& exn);
+
+    void HandleProcessCreationCommand(RawRequest* rawRequest);
+    void StartProcessCreation(SpawnProcessRequest&& r);
+    void HandleProcessCreationRequest(const SpawnProcessRequest& r);
+    void PopRequestFds(SpawnProcessRequest* r);
+    void ThrowIfExtraFds();
+
+    void HandleSpawnProcessBatchCommand(RawRequest* rawRequest);
+    void DispatchSpawn(SpawnProcessRequest&& r, std::shared_ptr<PendingBatch> pBatch, std::size_t index);
+
+    void HandleRegisterEnvironmentCommand(RawRequest* rawRequest);
+    void HandleUnregisterEnvironmentCommand(RawRequest* rawRequest);
+
+    void HandleRegisterSpawnTemplateCommand(RawRequest* rawRequest);
+    void HandleUnregisterSpawnTemplateCommand(RawRequest* rawRequest);
+    void HandleSpawnFromTemplateCommand(RawRequest* rawRequest);
+
+    void HandleCreateJobGroupCommand();
+    // DeleteJobGroup, FreezeJobGroup, KillJobGroup, GetJobGroupStats
+    void HandleJobGroupCommand(RawRequest* rawRequest);
+
+    void HandleSendSignalCommand(RawRequest* rawRequest);
+    void HandleSendSignalBulkCommand(RawRequest* rawRequest);
+    // Returns 0 or an errno value. AbstractSignal::Termination is followed by SIGCONT.
+    [[nodiscard]] static int SignalChild(ChildProcessState* pState, AbstractSignal signal, int nativeSignal) noexcept;
+    std::optional<int> ToNativeSignal(AbstractSignal abstractSignal) noexcept;
+
+    // Returns the body of rawRequest as an owned buffer, copying it out of the receive buffer if needed.
+    [[nodiscard]] static std::unique_ptr<std::byte[]> TakeBody(RawRequest* rawRequest);
+    // Spawns that outlive the request (dispatched spawns) need their own copy of the body. Returns nullptr otherwise.
+    [[nodiscard]] std::shared_ptr<const std::byte[]> TakeBodyIfDispatching(RawRequest* rawRequest);
+    // Likewise, dispatched spawns allocate from the heap. Returns nullptr then.
+    [[nodiscard]] Arena* GetRequestArena() noexcept { return spawnDispatcher_ ? nullptr : &arena_; }
+
+    // Blocking: Returns true. NonBlocking: Returns false if a whole request has not been received yet.
+    [[nodiscard]] bool TryRecvRawRequest(RawRequest* r);
+    void GrowRecvBuffer(std::size_t minSize);
+    [[nodiscard]] std::size_t RecvSome(void* buf, std::size_t len);
+    // The number of received fds that belong to requests after the current one.
+    [[nodiscard]] std::size_t GetLaterRequestFdCount() noexcept;
+    void SendSuccess(std::int32_t data);
+    void SendError(int err);
+    void SendResponse(int err, std::int32_t data);
+    void SendProcessCreationResponse(std::uint32_t requestId, const SpawnProcessResult& result);
+    void SendSpawnProcessBatchResponse(std::uint32_t requestId, const std::vector<SpawnProcessResult>& results);
+    void SendResponseBytes(std::uint32_t requestId, const void* buf, std::size_t len);
+    [[nodiscard]] std::size_t GetHeaderLength() const noexcept { return isPipelined_ ? 12 : 8; }
+
+    AncillaryDataSocket sock_;
+    const BlockingFlag blocking_;
+    const bool isPipelined_;
+
+    // The ID of the request being handled (SubchannelFlagsPipelined).
+    std::uint32_t currentRequestId_ = 0;
+
+    // Received bytes not consumed yet: recvBuffer_[recvBegin_, recvEnd_).
+    // A single recvmsg call receives the header and the body of a request (and of following requests if available).
+    std::unique_ptr<std::byte[]> recvBuffer_;
+    std::size_t recvBufferSize_ = 0;
+    std::size_t recvBegin_ = 0;
+    std::size_t recvEnd_ = 0;
+    // The total number of bytes received and the stream offset of the end of the current request.
+    std::uint64_t totalBytesReceived_ = 0;
+    std::uint64_t currentRequestEnd_ = 0;
+    std::deque<FdArrival> fdArrivals_;
+
+    // NonBlocking: The owner receives to recvIov_, which RecvSome points to where it needs the data.
+    msghdr recvMessage_{};
+    iovec recvIov_{};
+    CmsgFds recvCmsgFds_;
+    bool isWaitingForInput_ = false;
+    // NonBlocking: The result of the last receive (HandleReceived) not yet taken by RecvSome.
+    std::size_t receivedBytes_ = 0;
+    std::size_t receivedFdCount_ = 0;
+    ResponseSender responseSender_;
+
+    // The header of the request being received.
+    // Command, body length and request ID (SubchannelFlagsPipelined).
+    std::uint32_t header_[3]{};
+    // A body that does not fit in recvBuffer_ is received directly here.
+    std::unique_ptr<std::byte[]> largeBody_;
+    std::size_t largeBodyBytesReceived_ = 0;
+    // The remaining bytes of a body exceeding MaxReqeuestLength.
+    std::size_t bodyBytesToDiscard_ = 0;
+
+    // Reset for each request.
+    Arena arena_{SubchannelArenaInitialSize};
+
+    // Objects registered without RegisterFlagsServiceScope.
+    EnvironmentRegistry environments_{0, MaxEnvironmentBlockCount};
+    SpawnTemplateRegistry templates_{0, MaxSpawnTemplateCount};
+
+    SpawnDispatcher spawnDispatcher_;
+    // A batch counts as one request.
+    std::size_t requestsInFlight_ = 0;
+    std::unordered_map<std::uint64_t, DispatchedSpawn> dispatchedSpawns_;
+    std::uint64_t nextDispatchId_ = 0;
+};
 
-void StartSubchannelHandler(UniqueFd sockFd);
+// flags: SubchannelCreationFlags
+void StartSubchannelHandler(UniqueFd sockFd, std::uint32_t flags);
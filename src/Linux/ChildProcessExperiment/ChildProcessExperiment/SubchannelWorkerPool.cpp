@@ -0,0 +1,317 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "SubchannelWorkerPool.hpp"
+#include "Base.hpp"
+#include "ErrorCodeExceptions.hpp"
+#include "MiscHelpers.hpp"
+#include "ProcessSpawner.hpp"
+#include "Reactor.hpp"
+#include "SpawnExecutor.hpp"
+#include "Subchannel.hpp"
+#include "UniqueResource.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class SubchannelWorkerPool::Worker final
+{
+public:
+    Worker(SpawnExecutor* pExecutor, ReactorBackend backend);
+
+    void Start();
+    // Called from the service thread.
+    void Add(UniqueFd sockFd, std::uint32_t flags);
+
+private:
+    struct SubchannelEntry final
+    {
+        // Shared with the reader handler, which the reactor may destroy after the entry (see CloseSubchannel).
+        std::shared_ptr<Subchannel> Instance;
+        // A duplicate of the subchannel fd registered as the writer; the subchannel fd itself is the reader.
+        UniqueFd OutputFd;
+        // Identifies the subchannel even after its fd is reused.
+        std::uint64_t Id;
+    };
+
+    struct NewSubchannel final
+    {
+        UniqueFd SockFd;
+        std::uint32_t Flags;
+    };
+
+    struct SpawnCompletion final
+    {
+        std::uint64_t SubchannelId;
+        std::uint64_t DispatchId;
+        SpawnProcessResult Result;
+    };
+
+    static void* ThreadFunc(void* arg);
+    void Wakeup();
+    [[nodiscard]] bool HandleWakeup();
+    void HandleNewSubchannels();
+    void HandleSpawnCompletions();
+    void DispatchSpawn(std::uint64_t subchannelId, std::uint64_t dispatchId, SpawnProcessRequest&& r);
+    void HandleSubchannelInput(SubchannelEntry* pEntry, ssize_t bytesReceived);
+    void HandleSubchannelOutput(SubchannelEntry* pEntry, ssize_t result);
+    void UpdateReceiving(SubchannelEntry* pEntry);
+    void CloseSubchannel(SubchannelEntry* pEntry);
+
+    SpawnExecutor* const pExecutor_;
+    Reactor reactor_;
+    // Signaled when newSubchannels_ or spawnCompletions_ gets a new element.
+    UniqueFd wakeupFd_;
+    std::mutex mutex_;
+    std::vector<NewSubchannel> newSubchannels_;
+    std::vector<SpawnCompletion> spawnCompletions_;
+    // Accessed only by the worker thread.
+    std::unordered_map<std::uint64_t, std::unique_ptr<SubchannelEntry>> subchannels_;
+    std::uint64_t nextSubchannelId_ = 0;
+};
+
+SubchannelWorkerPool::SubchannelWorkerPool(int workerCount, SpawnExecutor* pExecutor, ReactorBackend backend)
+{
+    if (workerCount <= 0)
+    {
+        workerCount = std::max(1, static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)));
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers_.push_back(std::make_unique<Worker>(pExecutor, backend));
+        workers_.back()->Start();
+    }
+}
+
+// NOTE: Workers run until the process exits.
+SubchannelWorkerPool::~SubchannelWorkerPool() = default;
+
+void SubchannelWorkerPool::Add(UniqueFd sockFd, std::uint32_t flags)
+{
+    workers_[nextWorkerIndex_]->Add(std::move(sockFd), flags);
+    nextWorkerIndex_ = (nextWorkerIndex_ + 1) % workers_.size();
+}
+
+SubchannelWorkerPool::Worker::Worker(SpawnExecutor* pExecutor, ReactorBackend backend)
+    : pExecutor_(pExecutor), reactor_(backend), wakeupFd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (!wakeupFd_.IsValid())
+    {
+        FatalErrorAbort(errno, "eventfd");
+    }
+
+    reactor_.Add(wakeupFd_.Get(), EPOLLIN, [this](std::uint32_t) { return HandleWakeup(); });
+}
+
+void SubchannelWorkerPool::Worker::Start()
+{
+    auto maybeThread = CreateThreadWithMyDefault(Worker::ThreadFunc, this, CreateThreadFlagsDetached);
+    if (!maybeThread)
+    {
+        FatalErrorAbort(errno, "pthread_create");
+    }
+}
+
+void* SubchannelWorkerPool::Worker::ThreadFunc(void* arg)
+{
+    static_cast<Worker*>(arg)->reactor_.Run();
+    return nullptr;
+}
+
+void SubchannelWorkerPool::Worker::Add(UniqueFd sockFd, std::uint32_t flags)
+{
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        newSubchannels_.push_back(NewSubchannel{std::move(sockFd), flags});
+    }
+
+    Wakeup();
+}
+
+void SubchannelWorkerPool::Worker::Wakeup()
+{
+    const std::uint64_t one = 1;
+    if (write_restarting(wakeupFd_.Get(), &one, sizeof(one)) == -1)
+    {
+        FatalErrorAbort(errno, "write");
+    }
+}
+
+bool SubchannelWorkerPool::Worker::HandleWakeup()
+{
+    std::uint64_t count;
+    if (read_restarting(wakeupFd_.Get(), &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        FatalErrorAbort(errno, "read");
+    }
+
+    HandleNewSubchannels();
+    HandleSpawnCompletions();
+    return true;
+}
+
+void SubchannelWorkerPool::Worker::HandleNewSubchannels()
+{
+    std::vector<NewSubchannel> newSubchannels;
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        newSubchannels.swap(newSubchannels_);
+    }
+
+    for (auto& newSubchannel : newSubchannels)
+    {
+        UniqueFd outputFd{fcntl(newSubchannel.SockFd.Get(), F_DUPFD_CLOEXEC, 0)};
+        if (!outputFd.IsValid())
+        {
+            // Dropping the subchannel tells the client.
+            TRACE_ERROR("fcntl failed: %d\n", errno);
+            continue;
+        }
+
+        auto pSubchannel = std::make_shared<Subchannel>(std::move(newSubchannel.SockFd), BlockingFlag::NonBlocking, newSubchannel.Flags);
+        const int fd = pSubchannel->GetFd();
+        const int outputFdValue = outputFd.Get();
+        const std::uint64_t id = nextSubchannelId_++;
+        auto pEntry = std::make_unique<SubchannelEntry>(SubchannelEntry{pSubchannel, std::move(outputFd), id});
+        SubchannelEntry* const p = pEntry.get();
+        subchannels_.emplace(id, std::move(pEntry));
+
+        reactor_.AddWriter(outputFdValue, [this, p](ssize_t result) {
+            HandleSubchannelOutput(p, result);
+            return true;
+        });
+        pSubchannel->SetResponseSender([this, outputFdValue](const void* buf, std::size_t len) {
+            return reactor_.Send(outputFdValue, buf, len);
+        });
+        if (pExecutor_ != nullptr)
+        {
+            pSubchannel->SetSpawnDispatcher([this, id](std::uint64_t dispatchId, SpawnProcessRequest&& r) {
+                DispatchSpawn(id, dispatchId, std::move(r));
+            });
+        }
+
+        try
+        {
+            // Report successful creation, then point the receive message to the receive buffer.
+            pSubchannel->SendCreationResult();
+            pSubchannel->HandleInput();
+        }
+        catch ([[maybe_unused]] const CommunicationError& exn)
+        {
+            TRACE_INFO("Subchannel %d disconnected: %d\n", fd, exn.GetError());
+            reactor_.Remove(outputFdValue);
+            subchannels_.erase(id);
+            continue;
+        }
+
+        // The handler owns a reference: with ReactorBackend::IoUring, a receive into the buffer of the subchannel
+        // may still be in flight after Remove.
+        reactor_.AddMessageReader(fd, pSubchannel->GetRecvMessage(), [this, p, pSubchannel](ssize_t bytesReceived) {
+            HandleSubchannelInput(p, bytesReceived);
+            return true;
+        });
+        UpdateReceiving(p);
+    }
+}
+
+void SubchannelWorkerPool::Worker::HandleSpawnCompletions()
+{
+    std::vector<SpawnCompletion> spawnCompletions;
+    {
+        const std::lock_guard<std::mutex> guard(mutex_);
+        spawnCompletions.swap(spawnCompletions_);
+    }
+
+    for (const auto& completion : spawnCompletions)
+    {
+        const auto it = subchannels_.find(completion.SubchannelId);
+        if (it == subchannels_.end())
+        {
+            // The subchannel has been closed. The child will still be reported through the main channel.
+            continue;
+        }
+
+        SubchannelEntry* const pEntry = it->second.get();
+        try
+        {
+            pEntry->Instance->CompleteProcessCreationRequest(completion.DispatchId, completion.Result);
+            // Continue with requests received while the spawn was in flight.
+            pEntry->Instance->HandleInput();
+        }
+        catch ([[maybe_unused]] const CommunicationError& exn)
+        {
+            TRACE_INFO("Subchannel %d disconnected: %d\n", pEntry->Instance->GetFd(), exn.GetError());
+            CloseSubchannel(pEntry);
+            continue;
+        }
+
+        UpdateReceiving(pEntry);
+    }
+}
+
+void SubchannelWorkerPool::Worker::DispatchSpawn(std::uint64_t subchannelId, std::uint64_t dispatchId, SpawnProcessRequest&& r)
+{
+    pExecutor_->Submit(std::move(r), [this, subchannelId, dispatchId](const SpawnProcessResult& result) {
+        {
+            const std::lock_guard<std::mutex> guard(mutex_);
+            spawnCompletions_.push_back(SpawnCompletion{subchannelId, dispatchId, result});
+        }
+
+        Wakeup();
+    });
+}
+
+void SubchannelWorkerPool::Worker::HandleSubchannelInput(SubchannelEntry* pEntry, ssize_t bytesReceived)
+{
+    try
+    {
+        pEntry->Instance->HandleReceived(bytesReceived);
+    }
+    catch ([[maybe_unused]] const CommunicationError& exn)
+    {
+        // NOTE: Orderly shutdown (errno=0) also reaches here.
+        TRACE_INFO("Subchannel %d disconnected: %d\n", pEntry->Instance->GetFd(), exn.GetError());
+        CloseSubchannel(pEntry);
+        return;
+    }
+
+    UpdateReceiving(pEntry);
+}
+
+// result: -1 if a send has failed, 0 if the pending responses have been sent.
+void SubchannelWorkerPool::Worker::HandleSubchannelOutput(SubchannelEntry* pEntry, ssize_t result)
+{
+    if (result == -1)
+    {
+        TRACE_INFO("Subchannel %d disconnected: %d\n", pEntry->Instance->GetFd(), errno);
+        CloseSubchannel(pEntry);
+        return;
+    }
+
+    UpdateReceiving(pEntry);
+}
+
+void SubchannelWorkerPool::Worker::UpdateReceiving(SubchannelEntry* pEntry)
+{
+    // Receive requests only while the responses to the previous ones do not pile up (see Subchannel::HandleInput).
+    const bool shouldReceive = pEntry->Instance->IsWaitingForInput()
+        && reactor_.GetPendingSendBytes(pEntry->OutputFd.Get()) <= MaxPendingResponseBytes;
+    reactor_.SetReaderPaused(pEntry->Instance->GetFd(), !shouldReceive);
+}
+
+void SubchannelWorkerPool::Worker::CloseSubchannel(SubchannelEntry* pEntry)
+{
+    reactor_.Remove(pEntry->Instance->GetFd());
+    reactor_.Remove(pEntry->OutputFd.Get());
+    subchannels_.erase(pEntry->Id);
+}
@@ -0,0 +1,37 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "Reactor.hpp"
+#include "UniqueResource.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class SpawnExecutor;
+
+// Serves subchannels on a fixed number of worker threads, each running its own reactor. The reactor performs
+// the receives and sends of the subchannels (with ReactorBackend::IoUring, as io_uring requests).
+// Subchannels are assigned to workers in a round-robin manner. Requests run on the worker, except that spawns are
+// submitted to pExecutor (if not nullptr) and their responses are routed back to the worker.
+class SubchannelWorkerPool final
+{
+public:
+    // workerCount: 0 means the number of online processors.
+    SubchannelWorkerPool(int workerCount, SpawnExecutor* pExecutor, ReactorBackend backend);
+    ~SubchannelWorkerPool();
+
+    SubchannelWorkerPool(const SubchannelWorkerPool&) = delete;
+    SubchannelWorkerPool& operator=(const SubchannelWorkerPool&) = delete;
+
+    // Can be called only from one thread (the service thread).
+    // flags: SubchannelCreationFlags
+    void Add(UniqueFd sockFd, std::uint32_t flags);
+
+private:
+    class Worker;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::size_t nextWorkerIndex_ = 0;
+};
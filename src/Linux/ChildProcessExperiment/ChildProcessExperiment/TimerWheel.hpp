@@ -0,0 +1,221 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// A hierarchical timer wheel. Times are in ticks (the caller decides the unit) and never go backwards.
+// Level L has 64 slots of 64^L ticks each. A timer is kept at the lowest level whose current rotation contains
+// its expiry and is moved down (cascaded) when the wheel reaches its slot, so that insertion is O(1) and
+// each timer is moved at most once per level.
+// Not thread-safe.
+template<typename T>
+class TimerWheel final
+{
+public:
+    explicit TimerWheel(std::uint64_t now) noexcept : now_(now) {}
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    [[nodiscard]] std::uint64_t GetNow() const noexcept { return now_; }
+    [[nodiscard]] bool IsEmpty() const noexcept { return count_ == 0; }
+
+    // A timer that has already expired will be returned by the next Advance.
+    void Add(std::uint64_t expiry, T value)
+    {
+        Insert(Entry{expiry, std::move(value)});
+        count_++;
+    }
+
+    // Moves the wheel to now and appends the values of expired timers to expired.
+    void Advance(std::uint64_t now, std::vector<T>* expired)
+    {
+        TakeExpired(expired);
+
+        while (now_ < now)
+        {
+            // The next occupied slot in the current rotation of level 0.
+            const std::uint64_t nextSlots = levels_[0].Occupied & ~LowBitsMask(GetSlotIndex(now_, 0) + 1);
+            if (nextSlots != 0)
+            {
+                const std::uint64_t tick = (now_ & ~SlotMask) | static_cast<std::uint64_t>(__builtin_ctzll(nextSlots));
+                if (tick > now)
+                {
+                    break;
+                }
+
+                now_ = tick;
+                ExpireSlot(GetSlotIndex(now_, 0), expired);
+                continue;
+            }
+
+            // Nothing more in this rotation. Skip empty slots and move to the next slot to cascade.
+            // NOTE: Every slot passed over is empty, so skipping keeps the timers at the correct levels.
+            const auto maybeNext = GetNextEventTime();
+            if (!maybeNext || *maybeNext > now)
+            {
+                break;
+            }
+
+            assert((*maybeNext & SlotMask) == 0);
+            now_ = *maybeNext;
+            Cascade();
+            TakeExpired(expired);
+            ExpireSlot(0, expired);
+        }
+
+        now_ = std::max(now_, now);
+    }
+
+    // Returns the earliest tick at which Advance may have work to do. Not later than any expiry.
+    [[nodiscard]] std::optional<std::uint64_t> GetNextEventTime() const noexcept
+    {
+        if (count_ == 0)
+        {
+            return std::nullopt;
+        }
+
+        if (!expired_.empty())
+        {
+            return now_;
+        }
+
+        for (int level = 0; level < LevelCount; level++)
+        {
+            const std::uint64_t nextSlots = levels_[level].Occupied & ~LowBitsMask(GetSlotIndex(now_, level) + 1);
+            if (nextSlots != 0)
+            {
+                const int shift = level * SlotBits;
+                const std::uint64_t rotationStart = (now_ >> (shift + SlotBits)) << (shift + SlotBits);
+                return rotationStart | (static_cast<std::uint64_t>(__builtin_ctzll(nextSlots)) << shift);
+            }
+        }
+
+        // Only far timers. Level LevelCount - 1 wraps around at this tick.
+        return ((now_ >> TotalBits) + 1) << TotalBits;
+    }
+
+private:
+    static const constexpr int SlotBits = 6;
+    static const constexpr int SlotCount = 1 << SlotBits;
+    static const constexpr std::uint64_t SlotMask = SlotCount - 1;
+    // 64^6 ticks; about 795 days with 1ms ticks.
+    static const constexpr int LevelCount = 6;
+    static const constexpr int TotalBits = SlotBits * LevelCount;
+
+    struct Entry final
+    {
+        std::uint64_t Expiry;
+        T Value;
+    };
+
+    struct Level final
+    {
+        // Bit i is set if Slots[i] is not empty.
+        std::uint64_t Occupied = 0;
+        std::vector<Entry> Slots[SlotCount];
+    };
+
+    [[nodiscard]] static std::uint64_t LowBitsMask(int bits) noexcept
+    {
+        return bits >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << bits) - 1;
+    }
+
+    [[nodiscard]] static int GetSlotIndex(std::uint64_t tick, int level) noexcept
+    {
+        return static_cast<int>((tick >> (level * SlotBits)) & SlotMask);
+    }
+
+    void Insert(Entry&& entry)
+    {
+        if (entry.Expiry <= now_)
+        {
+            expired_.push_back(std::move(entry.Value));
+            return;
+        }
+
+        for (int level = 0; level < LevelCount; level++)
+        {
+            // Within the current rotation of this level?
+            const int rotationShift = (level + 1) * SlotBits;
+            if ((entry.Expiry >> rotationShift) == (now_ >> rotationShift))
+            {
+                const int slot = GetSlotIndex(entry.Expiry, level);
+                levels_[level].Slots[slot].push_back(std::move(entry));
+                levels_[level].Occupied |= std::uint64_t{1} << slot;
+                return;
+            }
+        }
+
+        far_.push_back(std::move(entry));
+    }
+
+    // Called when now_ has just entered a new rotation of level 0. Moves down the timers of the slots just reached.
+    void Cascade()
+    {
+        for (int level = 1; level < LevelCount; level++)
+        {
+            const int slot = GetSlotIndex(now_, level);
+            auto entries = std::move(levels_[level].Slots[slot]);
+            levels_[level].Slots[slot].clear();
+            levels_[level].Occupied &= ~(std::uint64_t{1} << slot);
+            for (auto& entry : entries)
+            {
+                Insert(std::move(entry));
+            }
+
+            if (slot != 0)
+            {
+                // Higher levels did not enter a new rotation.
+                return;
+            }
+        }
+
+        auto entries = std::move(far_);
+        far_.clear();
+        for (auto& entry : entries)
+        {
+            Insert(std::move(entry));
+        }
+    }
+
+    void ExpireSlot(int slot, std::vector<T>* expired)
+    {
+        auto& entries = levels_[0].Slots[slot];
+        for (auto& entry : entries)
+        {
+            assert(entry.Expiry == now_);
+            expired->push_back(std::move(entry.Value));
+        }
+
+        count_ -= entries.size();
+        entries.clear();
+        levels_[0].Occupied &= ~(std::uint64_t{1} << slot);
+    }
+
+    void TakeExpired(std::vector<T>* expired)
+    {
+        for (auto& value : expired_)
+        {
+            expired->push_back(std::move(value));
+        }
+
+        count_ -= expired_.size();
+        expired_.clear();
+    }
+
+    std::uint64_t now_;
+    std::size_t count_ = 0;
+    Level levels_[LevelCount];
+    // Timers beyond the current rotation of the highest level.
+    std::vector<Entry> far_;
+    // Timers that expired on insertion.
+    std::vector<T> expired_;
+};
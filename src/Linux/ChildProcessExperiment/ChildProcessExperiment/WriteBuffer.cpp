@@ -1,19 +1,20 @@
 // Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
 
 #include "WriteBuffer.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <memory>
-#include <optional>
-#include <queue>
-#include <tuple>
+#include <sys/uio.h>
 #include <vector>
 
 namespace
 {
     const constexpr std::size_t BlockLength = 32 * 1024;
+    // Drained blocks kept for reuse. Blocks beyond this are freed.
+    const constexpr std::size_t MaxFreeBlockCount = 4;
 } // namespace
 
 void WriteBuffer::Enqueue(const void* buf, std::size_t len)
@@ -35,17 +36,23 @@ void WriteBuffer::Enqueue(const void* buf, std::size_t len)
     }
 
     assert(byteBuf == pEnd);
+    pendingBytes_ += len;
 }
 
 void WriteBuffer::Dequeue(std::size_t len) noexcept
 {
+    assert(len <= pendingBytes_);
+    pendingBytes_ -= len;
+
     while (len != 0)
     {
+        assert(!blocks_.empty());
         auto& front = blocks_.front();
         const auto remainingBytes = front.DataBytes - front.CurrentOffset;
         if (remainingBytes <= len)
         {
-            blocks_.erase(blocks_.begin());
+            RecycleBlock(std::move(front));
+            blocks_.pop_front();
             len -= remainingBytes;
         }
         else
@@ -54,28 +61,48 @@ void WriteBuffer::Dequeue(std::size_t len) noexcept
             len = 0;
         }
     }
-
-    assert(false);
 }
 
-std::tuple<std::byte*, std::size_t> WriteBuffer::GetPendingData() noexcept
+std::size_t WriteBuffer::GetPendingData(iovec* iov, std::size_t maxCount) const noexcept
 {
-    if (blocks_.empty())
+    const std::size_t count = std::min(maxCount, blocks_.size());
+    for (std::size_t i = 0; i < count; i++)
     {
-        std::abort();
+        const auto& b = blocks_[i];
+        iov[i].iov_base = b.Data.get() + b.CurrentOffset;
+        iov[i].iov_len = b.DataBytes - b.CurrentOffset;
     }
 
-    const auto& first = blocks_.front();
-    return std::make_tuple(first.Data.get() + first.CurrentOffset, first.DataBytes - first.CurrentOffset);
+    return count;
 }
 
 WriteBuffer::Block WriteBuffer::CreateBlock()
 {
     Block b;
-    b.Data = std::make_unique<std::byte[]>(BlockLength);
+    if (!freeBlocks_.empty())
+    {
+        b.Data = std::move(freeBlocks_.back());
+        freeBlocks_.pop_back();
+    }
+    else
+    {
+        // Reserve here so that RecycleBlock will not need to allocate.
+        freeBlocks_.reserve(MaxFreeBlockCount);
+        b.Data = std::make_unique<std::byte[]>(BlockLength);
+    }
+
     b.DataBytes = 0;
     b.CurrentOffset = 0;
-    return std::move(b);
+    return b;
+}
+
+void WriteBuffer::RecycleBlock(Block&& b) noexcept
+{
+    if (freeBlocks_.size() < MaxFreeBlockCount)
+    {
+        // NOTE: Will not throw; CreateBlock has reserved the capacity.
+        freeBlocks_.push_back(std::move(b.Data));
+    }
 }
 
 std::size_t WriteBuffer::StoreToBlock(Block* pBlock, const std::byte* buf, std::size_t len) noexcept
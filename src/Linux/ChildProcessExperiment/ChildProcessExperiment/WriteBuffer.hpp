@@ -3,18 +3,22 @@
 #pragma once
 
 #include <cstddef>
+#include <deque>
 #include <memory>
-#include <optional>
-#include <tuple>
+#include <sys/uio.h>
 #include <vector>
 
+// A FIFO of bytes waiting to be sent, stored in fixed-size blocks.
+// Drained blocks are kept for reuse so that a steady backlog does not allocate.
 class WriteBuffer final
 {
 public:
     void Enqueue(const void* buf, std::size_t len);
     void Dequeue(std::size_t len) noexcept;
-    bool HasPendingData() noexcept { return !blocks_.empty(); }
-    std::tuple<std::byte*, std::size_t> GetPendingData() noexcept;
+    [[nodiscard]] bool HasPendingData() const noexcept { return !blocks_.empty(); }
+    [[nodiscard]] std::size_t GetPendingBytes() const noexcept { return pendingBytes_; }
+    // Fills iov with the pending data of up to maxCount blocks from the front. Returns the number of iovecs filled.
+    [[nodiscard]] std::size_t GetPendingData(iovec* iov, std::size_t maxCount) const noexcept;
 
 private:
     struct Block
@@ -25,7 +29,10 @@ private:
     };
 
     Block CreateBlock();
+    void RecycleBlock(Block&& b) noexcept;
     std::size_t StoreToBlock(Block* pBlock, const std::byte* pSrc, std::size_t len) noexcept;
 
-    std::vector<Block> blocks_;
+    std::deque<Block> blocks_;
+    std::vector<std::unique_ptr<std::byte[]>> freeBlocks_;
+    std::size_t pendingBytes_ = 0;
 };
@@ -0,0 +1,270 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "Zygote.hpp"
+#include "AncillaryDataSocket.hpp"
+#include "Base.hpp"
+#include "BinaryWriter.hpp"
+#include "ErrorCodeExceptions.hpp"
+#include "MiscHelpers.hpp"
+#include "ProcessSpawner.hpp"
+#include "Request.hpp"
+#include "SocketHelpers.hpp"
+#include "UniqueResource.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // The flags the zygote needs. Everything else has been resolved by the service.
+    const std::uint32_t ZygoteRequestFlagsMask = RequestFlagsRedirectStdin | RequestFlagsRedirectStdout | RequestFlagsRedirectStderr;
+
+    // Response from the zygote.
+    struct ZygoteResponse final
+    {
+        // 0 on success; otherwise errno.
+        int Error;
+        int ProcessID;
+    };
+
+    int g_ZygotePid = -1;
+    std::atomic<bool> g_IsZygoteAvailable{false};
+
+    // Requests are serialized; the zygote handles one at a time anyway.
+    std::mutex g_ZygoteMutex;
+    std::unique_ptr<AncillaryDataSocket> g_ZygoteSocket;
+
+    [[noreturn]] void ZygoteMain(UniqueFd sockFd) noexcept;
+    [[nodiscard]] bool HandleZygoteRequest(AncillaryDataSocket* pSocket) noexcept;
+    [[nodiscard]] int CloneIntoParent() noexcept;
+
+    [[noreturn]] void ZygoteMain(UniqueFd sockFd) noexcept
+    {
+        // Exit with the helper. If the helper has already exited, we will see EOF.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        AncillaryDataSocket sock{std::move(sockFd)};
+        while (HandleZygoteRequest(&sock))
+        {
+        }
+
+        _exit(0);
+    }
+
+    // Request: length (32), a spawn request body (see Protocol.md) with fds, and two more fds: readyPipeReadEnd and errorPipeWriteEnd.
+    // Returns false when the helper has closed the connection.
+    bool HandleZygoteRequest(AncillaryDataSocket* pSocket) noexcept
+    {
+        std::uint32_t length;
+        if (!pSocket->RecvExactBytes(&length, sizeof(length)))
+        {
+            return false;
+        }
+
+        auto data = std::make_unique<std::byte[]>(length);
+        if (!pSocket->RecvExactBytes(data.get(), length))
+        {
+            return false;
+        }
+
+        ZygoteResponse response{0, 0};
+        SpawnProcessRequest r;
+        try
+        {
+            DeserializeSpawnProcessRequest(&r, data.get(), length, nullptr);
+        }
+        catch (const BadRequestError& exn)
+        {
+            response.Error = exn.GetError();
+        }
+
+        auto popFd = [&](UniqueFd* pFd) {
+            auto maybeFd = pSocket->PopReceivedFd();
+            if (!maybeFd)
+            {
+                response.Error = EINVAL;
+                return;
+            }
+
+            *pFd = std::move(*maybeFd);
+        };
+
+        const std::pair<std::uint32_t, UniqueFd*> redirections[]{
+            {RequestFlagsRedirectStdin, &r.StdinFd},
+            {RequestFlagsRedirectStdout, &r.StdoutFd},
+            {RequestFlagsRedirectStderr, &r.StderrFd},
+        };
+
+        for (const auto& [flag, pFd] : redirections)
+        {
+            if (r.Flags & flag)
+            {
+                popFd(pFd);
+            }
+        }
+
+        UniqueFd readyPipeReadEnd;
+        UniqueFd errorPipeWriteEnd;
+        popFd(&readyPipeReadEnd);
+        popFd(&errorPipeWriteEnd);
+        pSocket->ClearReceivedFds();
+
+        if (response.Error == 0)
+        {
+            const int childPid = CloneIntoParent();
+            if (childPid == -1)
+            {
+                response.Error = errno;
+            }
+            else if (childPid == 0)
+            {
+                // child
+                ExecuteForkedChild(r, readyPipeReadEnd.Get(), errorPipeWriteEnd.Get());
+            }
+            else
+            {
+                response.ProcessID = childPid;
+            }
+        }
+
+        return pSocket->SendExactBytes(&response, sizeof(response));
+    }
+
+    // fork, but the child becomes a sibling of ours (a child of the helper).
+    // NOTE: Raw clone with no new stack behaves like fork. We are single-threaded, so skipping atfork handlers is fine.
+    int CloneIntoParent() noexcept
+    {
+        return static_cast<int>(syscall(SYS_clone, CLONE_PARENT | SIGCHLD, nullptr, nullptr, nullptr, nullptr));
+    }
+
+    [[nodiscard]] std::vector<std::byte> SerializeZygoteRequest(const SpawnProcessRequest& r)
+    {
+        BinaryWriter bw;
+        bw.Write<std::uint32_t>(0);
+        bw.Write<std::uint64_t>(0);
+        bw.Write<std::uint32_t>(r.Flags & ZygoteRequestFlagsMask);
+        bw.WriteString(r.WorkingDirectory);
+        bw.WriteString(r.ExecutablePath);
+
+        auto writeStringArray = [&](const char* const* strings) {
+            std::uint32_t count = 0;
+            while (strings[count] != nullptr)
+            {
+                count++;
+            }
+
+            bw.Write(count);
+            for (std::uint32_t i = 0; i < count; i++)
+            {
+                bw.WriteString(strings[i]);
+            }
+        };
+
+        writeStringArray(&r.Argv[0]);
+        writeStringArray(GetEnvp(r));
+
+        auto buf = bw.Detach();
+        const auto length = static_cast<std::uint32_t>(buf.size() - sizeof(std::uint32_t));
+        std::memcpy(&buf[0], &length, sizeof(length));
+        return buf;
+    }
+} // namespace
+
+bool StartZygote() noexcept
+{
+    auto maybeSocketPair = CreateUnixStreamSocketPair();
+    if (!maybeSocketPair)
+    {
+        return false;
+    }
+
+    const int pid = fork();
+    if (pid == -1)
+    {
+        return false;
+    }
+    else if (pid == 0)
+    {
+        (*maybeSocketPair)[0].Reset();
+        ZygoteMain(std::move((*maybeSocketPair)[1]));
+    }
+
+    g_ZygotePid = pid;
+    g_ZygoteSocket = std::make_unique<AncillaryDataSocket>(std::move((*maybeSocketPair)[0]));
+    g_IsZygoteAvailable.store(true, std::memory_order_release);
+    return true;
+}
+
+bool IsZygoteAvailable() noexcept
+{
+    return g_IsZygoteAvailable.load(std::memory_order_acquire);
+}
+
+bool IsZygotePid(int pid) noexcept
+{
+    return pid == g_ZygotePid;
+}
+
+int GetZygotePid() noexcept
+{
+    return g_ZygotePid;
+}
+
+void MarkZygoteExited() noexcept
+{
+    TRACE_ERROR("The zygote exited.\n");
+    g_IsZygoteAvailable.store(false, std::memory_order_release);
+}
+
+int SpawnChildInZygote(const SpawnProcessRequest& r, int readyPipeReadEnd, int errorPipeWriteEnd)
+{
+    const auto buf = SerializeZygoteRequest(r);
+
+    int fds[5];
+    std::size_t fdCount = 0;
+    for (const UniqueFd* pFd : {&r.StdinFd, &r.StdoutFd, &r.StderrFd})
+    {
+        if (pFd->IsValid())
+        {
+            fds[fdCount++] = pFd->Get();
+        }
+    }
+    fds[fdCount++] = readyPipeReadEnd;
+    fds[fdCount++] = errorPipeWriteEnd;
+
+    const std::lock_guard<std::mutex> guard(g_ZygoteMutex);
+    if (!IsZygoteAvailable())
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    ZygoteResponse response;
+    if (!g_ZygoteSocket->SendExactBytesWithFd(buf.data(), buf.size(), fds, fdCount)
+        || !g_ZygoteSocket->RecvExactBytes(&response, sizeof(response)))
+    {
+        TRACE_ERROR("The zygote has exited.\n");
+        g_IsZygoteAvailable.store(false, std::memory_order_release);
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (response.Error != 0)
+    {
+        errno = response.Error;
+        return -1;
+    }
+
+    return response.ProcessID;
+}
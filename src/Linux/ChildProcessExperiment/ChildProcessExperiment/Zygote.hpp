@@ -0,0 +1,27 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "Request.hpp"
+
+// SpawnMethod::Zygote: A single-threaded spawner process forked from the helper before it grows.
+// Forking from its small image is cheaper than forking from the helper.
+// Its children are created with CLONE_PARENT so that they are children of the helper and are reaped as usual.
+
+// Forks the zygote. Must be called while the process is still single-threaded and before signal handlers are set up.
+// On error, sets errno and returns false.
+[[nodiscard]] bool StartZygote() noexcept;
+
+// false if the zygote has not been started or has exited.
+[[nodiscard]] bool IsZygoteAvailable() noexcept;
+
+// true if pid is the zygote itself, which is not registered to g_ChildProcessStateMap.
+[[nodiscard]] bool IsZygotePid(int pid) noexcept;
+// The PID of the zygote, or -1 if it has not been started.
+[[nodiscard]] int GetZygotePid() noexcept;
+// Called by the reaper after it has reaped the zygote. Spawns fall back to fork from now on.
+void MarkZygoteExited() noexcept;
+
+// Lets the zygote create a child that performs ExecuteForkedChild(r, readyPipeReadEnd, errorPipeWriteEnd).
+// Returns the PID of the child. On error, sets errno and returns -1 (IsZygoteAvailable() turns false if the zygote has exited).
+[[nodiscard]] int SpawnChildInZygote(const SpawnProcessRequest& r, int readyPipeReadEnd, int errorPipeWriteEnd);
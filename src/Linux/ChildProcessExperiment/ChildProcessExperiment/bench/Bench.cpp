@@ -0,0 +1,227 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "Bench.hpp"
+#include "BinaryWriter.hpp"
+#include "Globals.hpp"
+#include "MiscHelpers.hpp"
+#include "Service.hpp"
+#include "ServiceOptions.hpp"
+#include "SignalHandler.hpp"
+#include "Zygote.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+namespace
+{
+    [[nodiscard]] const char* MatchOption(const char* arg, const char* name) noexcept
+    {
+        const auto nameLength = std::strlen(name);
+        if (std::strncmp(arg, "--", 2) != 0
+            || std::strncmp(arg + 2, name, nameLength) != 0
+            || arg[2 + nameLength] != '=')
+        {
+            return nullptr;
+        }
+
+        return arg + 2 + nameLength + 1;
+    }
+
+    void WriteStringArray(BinaryWriter& bw, const StringArray& data)
+    {
+        // Excludes the terminating nullptr.
+        bw.Write(static_cast<std::uint32_t>(data.size() - 1));
+        for (std::size_t i = 0; i < data.size() - 1; i++)
+        {
+            bw.WriteString(data[i]);
+        }
+    }
+
+    void* ServiceThreadFunc(void* arg)
+    {
+        // Returns 1 when the main channel is closed, which is how every benchmark ends.
+        static_cast<void>(ServiceMain(static_cast<int>(reinterpret_cast<std::intptr_t>(arg))));
+        return nullptr;
+    }
+} // namespace
+
+std::uint64_t BenchArgs::TakeNumber(const char* name, std::uint64_t defaultValue)
+{
+    const char* const value = TakeString(name, nullptr);
+    return value != nullptr ? std::strtoull(value, nullptr, 0) : defaultValue;
+}
+
+const char* BenchArgs::TakeString(const char* name, const char* defaultValue)
+{
+    const auto it = std::find_if(args_.begin(), args_.end(), [name](const char* arg) { return MatchOption(arg, name) != nullptr; });
+    if (it == args_.end())
+    {
+        return defaultValue;
+    }
+
+    const char* const value = MatchOption(*it, name);
+    args_.erase(it);
+    return value;
+}
+
+BenchService::~BenchService()
+{
+    // The service exits when the main channel is closed.
+    if (shutdown(mainChannel_.GetFd(), SHUT_RDWR) == -1)
+    {
+        FatalErrorAbort(errno, "shutdown");
+    }
+
+    const int err = pthread_join(serviceThread_, nullptr);
+    if (err != 0)
+    {
+        FatalErrorAbort(err, "pthread_join");
+    }
+}
+
+std::unique_ptr<BenchService> BenchService::Start(const BenchArgs& args)
+{
+    if (!ParseServiceOptions(&g_ServiceOptions, args.GetCount(), args.Get()))
+    {
+        return nullptr;
+    }
+
+    if (g_ServiceOptions.DefaultSpawnMethod == SpawnMethod::Zygote && !StartZygote())
+    {
+        PutFatalError(errno, "StartZygote");
+        return nullptr;
+    }
+
+    if (g_ServiceOptions.SignalIntake == SignalIntakeMode::SignalFd)
+    {
+        BlockSignalFdSignals();
+    }
+
+    auto maybeSocketPair = CreateUnixStreamSocketPair();
+    if (!maybeSocketPair)
+    {
+        PutFatalError(errno, "socketpair");
+        return nullptr;
+    }
+
+    // The service owns its end of the main channel.
+    const int serviceFd = (*maybeSocketPair)[1].Release();
+    auto maybeServiceThread = CreateThreadWithMyDefault(ServiceThreadFunc, reinterpret_cast<void*>(static_cast<std::intptr_t>(serviceFd)), 0);
+    if (!maybeServiceThread)
+    {
+        FatalErrorAbort(errno, "pthread_create");
+    }
+
+    return std::unique_ptr<BenchService>{new BenchService(std::move((*maybeSocketPair)[0]), *maybeServiceThread)};
+}
+
+std::unique_ptr<AncillaryDataSocket> BenchService::CreateSubchannel(std::uint8_t flags)
+{
+    auto maybeSocketPair = CreateUnixStreamSocketPair();
+    if (!maybeSocketPair)
+    {
+        PutFatalError(errno, "socketpair");
+        return nullptr;
+    }
+
+    const int fds[1]{(*maybeSocketPair)[1].Get()};
+    if (!mainChannel_.SendExactBytesWithFd(&flags, 1, fds, 1))
+    {
+        PutFatalError(errno, "CreateSubchannel");
+        return nullptr;
+    }
+
+    (*maybeSocketPair)[1].Reset();
+    auto pSubchannel = std::make_unique<AncillaryDataSocket>(std::move((*maybeSocketPair)[0]));
+
+    std::int32_t err;
+    if (!pSubchannel->RecvExactBytes(&err, sizeof(err)) || err != 0)
+    {
+        std::fprintf(stderr, "bench: CreateSubchannel failed\n");
+        return nullptr;
+    }
+
+    return pSubchannel;
+}
+
+long BenchService::RecvExitNotifications(std::size_t count)
+{
+    const std::size_t notificationSize = g_ServiceOptions.ExitNotifications == ExitNotificationFormat::Extended
+        ? sizeof(ExtendedChildExitNotification)
+        : sizeof(ChildExitNotification);
+    std::vector<std::byte> buf(count * notificationSize);
+    std::size_t bytesReceived = 0;
+    long recvCount = 0;
+    while (bytesReceived < buf.size())
+    {
+        const ssize_t n = mainChannel_.Recv(&buf[bytesReceived], buf.size() - bytesReceived, BlockingFlag::Blocking);
+        if (n <= 0)
+        {
+            PutFatalError(errno, "bench: recv");
+            return -1;
+        }
+
+        bytesReceived += static_cast<std::size_t>(n);
+        recvCount++;
+    }
+
+    return recvCount;
+}
+
+std::vector<std::byte> SerializeSpawnProcessRequest(const SpawnProcessRequest& r)
+{
+    BinaryWriter bw;
+    bw.Write(r.Token);
+    bw.Write(r.Flags);
+    bw.WriteString(r.WorkingDirectory);
+    bw.WriteString(r.ExecutablePath);
+    WriteStringArray(bw, r.Argv);
+    if (r.Envp.empty())
+    {
+        std::uint32_t count = 0;
+        while (environ[count] != nullptr)
+        {
+            count++;
+        }
+
+        bw.Write(count);
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            bw.WriteString(environ[i]);
+        }
+    }
+    else
+    {
+        WriteStringArray(bw, r.Envp);
+    }
+    if (r.Flags & RequestFlagsEnvironmentBlock)
+    {
+        bw.Write(r.EnvironmentId);
+    }
+    if (r.Flags & RequestFlagsDeadline)
+    {
+        bw.Write(r.DeadlineMilliseconds);
+        bw.Write(r.GracePeriodMilliseconds);
+    }
+    if (r.Flags & RequestFlagsGroupTag)
+    {
+        bw.Write(r.GroupTag);
+    }
+    if (r.Flags & RequestFlagsJobGroup)
+    {
+        bw.Write(r.JobGroupId);
+    }
+    return bw.Detach();
+}
+
+bool SendRequest(AncillaryDataSocket* pSubchannel, RequestCommand command, const std::vector<std::byte>& body, const int* fds, std::size_t fdCount)
+{
+    const std::uint32_t header[2]{static_cast<std::uint32_t>(command), static_cast<std::uint32_t>(body.size())};
+    const bool headerSent = fdCount != 0
+        ? pSubchannel->SendExactBytesWithFd(header, sizeof(header), fds, fdCount)
+        : pSubchannel->SendExactBytes(header, sizeof(header));
+    return headerSent && (body.empty() || pSubchannel->SendExactBytes(body.data(), body.size()));
+}
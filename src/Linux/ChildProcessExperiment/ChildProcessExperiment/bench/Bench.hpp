@@ -0,0 +1,91 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#pragma once
+
+#include "AncillaryDataSocket.hpp"
+#include "Request.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <pthread.h>
+#include <vector>
+
+// Arguments of a benchmark: its own options ("--name=value") mixed with service options.
+// A benchmark takes its own options first and passes the rest to BenchService::Start.
+class BenchArgs final
+{
+public:
+    BenchArgs(int argc, const char* const* argv) : args_(argv, argv + argc) {}
+
+    // Removes "--name=value" and returns value. Returns defaultValue if not specified.
+    [[nodiscard]] std::uint64_t TakeNumber(const char* name, std::uint64_t defaultValue);
+    [[nodiscard]] const char* TakeString(const char* name, const char* defaultValue);
+
+    [[nodiscard]] int GetCount() const noexcept { return static_cast<int>(args_.size()); }
+    [[nodiscard]] const char* const* Get() const noexcept { return args_.data(); }
+
+private:
+    std::vector<const char*> args_;
+};
+
+class Stopwatch final
+{
+public:
+    Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+    [[nodiscard]] double GetMilliseconds() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Runs the service on a thread of this process as main.cpp does, and acts as its client.
+// NOTE: The service options are global. Start only one service per process.
+class BenchService final
+{
+public:
+    // Closes the main channel and waits for the service to exit.
+    ~BenchService();
+
+    // Parses the service options in args and starts the service.
+    // On error, prints the reason and returns nullptr.
+    [[nodiscard]] static std::unique_ptr<BenchService> Start(const BenchArgs& args);
+
+    [[nodiscard]] AncillaryDataSocket* GetMainChannel() noexcept { return &mainChannel_; }
+    // flags: SubchannelCreationFlags. Returns nullptr on error.
+    [[nodiscard]] std::unique_ptr<AncillaryDataSocket> CreateSubchannel(std::uint8_t flags = 0);
+    // Receives count exit notifications of the format the service was started with.
+    // Returns the number of recv calls, or -1 on error.
+    [[nodiscard]] long RecvExitNotifications(std::size_t count);
+
+private:
+    BenchService(UniqueFd mainChannel, pthread_t serviceThread) noexcept
+        : mainChannel_(std::move(mainChannel)), serviceThread_(serviceThread) {}
+
+    AncillaryDataSocket mainChannel_;
+    pthread_t serviceThread_;
+};
+
+// Serializes the body of a SpawnProcess request (or an entry of a SpawnProcessBatch request).
+// Argv and Envp must be terminated by nullptr. Sends environ if Envp is empty.
+[[nodiscard]] std::vector<std::byte> SerializeSpawnProcessRequest(const SpawnProcessRequest& r);
+// Sends the header (command, body length) and the body. fds are attached to the header.
+[[nodiscard]] bool SendRequest(AncillaryDataSocket* pSubchannel, RequestCommand command, const std::vector<std::byte>& body,
+    const int* fds = nullptr, std::size_t fdCount = 0);
+
+// The benchmarks (see BenchMain.cpp).
+[[nodiscard]] int RunDeserializeBench(BenchArgs args);
+[[nodiscard]] int RunDrainBench(BenchArgs args);
+[[nodiscard]] int RunExitBurstBench(BenchArgs args);
+[[nodiscard]] int RunIngestBench(BenchArgs args);
+[[nodiscard]] int RunJobGroupBench(BenchArgs args);
+[[nodiscard]] int RunRusageBench(BenchArgs args);
+[[nodiscard]] int RunSignalBench(BenchArgs args);
+[[nodiscard]] int RunSpawnBench(BenchArgs args);
+[[nodiscard]] int RunStateMapBench(BenchArgs args);
+[[nodiscard]] int RunTimerWheelBench(BenchArgs args);
+[[nodiscard]] int RunZygoteExitBench(BenchArgs args);
@@ -0,0 +1,59 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+#include "Bench.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    struct Benchmark final
+    {
+        const char* Name;
+        int (*Run)(BenchArgs args);
+    };
+
+    const Benchmark Benchmarks[] = {
+        {"deserialize", RunDeserializeBench},
+        {"drain", RunDrainBench},
+        {"exit-burst", RunExitBurstBench},
+        {"ingest", RunIngestBench},
+        {"job-group", RunJobGroupBench},
+        {"rusage", RunRusageBench},
+        {"signal", RunSignalBench},
+        {"spawn", RunSpawnBench},
+        {"state-map", RunStateMapBench},
+        {"timer-wheel", RunTimerWheelBench},
+        {"zygote-exit", RunZygoteExitBench},
+    };
+
+    void PrintUsage()
+    {
+        std::fprintf(stderr, "Usage: ChildProcessBench BENCHMARK [--benchmark-option=value...] [service options]\n");
+        std::fprintf(stderr, "Benchmarks:");
+        for (const auto& b : Benchmarks)
+        {
+            std::fprintf(stderr, " %s", b.Name);
+        }
+        std::fprintf(stderr, "\n");
+    }
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    for (const auto& b : Benchmarks)
+    {
+        if (std::strcmp(argv[1], b.Name) == 0)
+        {
+            return b.Run(BenchArgs{argc - 2, argv + 2});
+        }
+    }
+
+    PrintUsage();
+    return 1;
+}
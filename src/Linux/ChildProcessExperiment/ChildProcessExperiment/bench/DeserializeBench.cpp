@@ -0,0 +1,83 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// deserialize: Heap allocations and time per SpawnProcess request body (with this process's environment) deserialized
+// onto the heap and onto a subchannel arena. Counts calls to the global operator new, which this file replaces
+// for the whole benchmark executable.
+
+#include "Bench.hpp"
+#include "Request.hpp"
+#include "Subchannel.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<std::uint64_t> g_OperatorNewCount{0};
+} // namespace
+
+void* operator new(std::size_t size)
+{
+    g_OperatorNewCount.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+    void Measure(const char* name, const std::vector<std::byte>& body, Arena* pArena, std::uint64_t count)
+    {
+        const auto countBefore = g_OperatorNewCount.load(std::memory_order_relaxed);
+        const Stopwatch stopwatch;
+        for (std::uint64_t i = 0; i < count; i++)
+        {
+            if (pArena != nullptr)
+            {
+                pArena->Reset();
+            }
+
+            SpawnProcessRequest r{};
+            DeserializeSpawnProcessRequest(&r, body.data(), body.size(), pArena);
+        }
+
+        const double elapsed = stopwatch.GetMilliseconds();
+        const auto allocations = g_OperatorNewCount.load(std::memory_order_relaxed) - countBefore;
+        std::printf("deserialize: %s: %.2f allocations/request, %.0f ns/request\n",
+            name,
+            static_cast<double>(allocations) / static_cast<double>(count),
+            elapsed * 1e6 / static_cast<double>(count));
+    }
+} // namespace
+
+int RunDeserializeBench(BenchArgs args)
+{
+    const auto count = std::max<std::uint64_t>(1, args.TakeNumber("count", 1000000));
+
+    SpawnProcessRequest r{};
+    r.Flags = 0;
+    r.ExecutablePath = "/bin/true";
+    r.Argv.push_back("true");
+    r.Argv.push_back(nullptr);
+    const auto body = SerializeSpawnProcessRequest(r);
+
+    Measure("heap", body, nullptr, count);
+
+    // The first request allocates the chunk of the arena.
+    Arena arena{SubchannelArenaInitialSize};
+    Measure("arena", body, &arena, count);
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// drain: Draining a send backlog. Queues --records records of 16 bytes on a socket whose peer does not read yet,
+// then reads the peer side and calls Flush until the backlog has been sent. Reports the send calls Flush made.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "SocketHelpers.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    const std::size_t RecordSize = 16;
+} // namespace
+
+int RunDrainBench(BenchArgs args)
+{
+    const auto recordCount = args.TakeNumber("records", 2000000);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+        FatalErrorAbort(errno, "socketpair");
+    }
+
+    AncillaryDataSocket sock{UniqueFd{sv[0]}};
+    UniqueFd peer{sv[1]};
+
+    const std::byte record[RecordSize]{};
+    for (std::uint64_t i = 0; i < recordCount; i++)
+    {
+        if (!sock.SendBuffered(record, sizeof(record), BlockingFlag::NonBlocking))
+        {
+            PutFatalError(errno, "bench: SendBuffered");
+            return 1;
+        }
+    }
+
+    const std::uint64_t totalBytes = recordCount * RecordSize;
+    const std::size_t readBufferSize = 1024 * 1024;
+    const auto readBuffer = std::make_unique<std::byte[]>(readBufferSize);
+    std::uint64_t receivedBytes = 0;
+    std::uint64_t flushCount = 0;
+    const std::uint64_t sendCountBefore = sock.GetFlushSendCount();
+    const Stopwatch stopwatch;
+    while (receivedBytes < totalBytes)
+    {
+        const ssize_t bytesRead = read(peer.Get(), readBuffer.get(), readBufferSize);
+        if (bytesRead <= 0)
+        {
+            PutFatalError(errno, "bench: read");
+            return 1;
+        }
+
+        receivedBytes += bytesRead;
+        if (sock.HasPendingData())
+        {
+            if (!sock.Flush(BlockingFlag::NonBlocking))
+            {
+                PutFatalError(errno, "bench: Flush");
+                return 1;
+            }
+            flushCount++;
+        }
+    }
+
+    const double elapsed = stopwatch.GetMilliseconds();
+    std::printf("drain: %llu bytes in %.1f ms, %llu flushes, %llu send calls\n",
+        static_cast<unsigned long long>(totalBytes),
+        elapsed,
+        static_cast<unsigned long long>(flushCount),
+        static_cast<unsigned long long>(sock.GetFlushSendCount() - sendCountBefore));
+    return 0;
+}
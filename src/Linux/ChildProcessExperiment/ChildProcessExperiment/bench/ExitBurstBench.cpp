@@ -0,0 +1,83 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// exit-burst: Delivery of many exit notifications at once. Spawns --children cat processes reading one pipe,
+// closes its write end so that they all exit together, and counts the recv calls the client needs to receive
+// every notification. Compare --reaper, --signal-intake and --exit-notification.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "UniqueResource.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+int RunExitBurstBench(BenchArgs args)
+{
+    const auto childCount = args.TakeNumber("children", 2000);
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    const auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel)
+    {
+        return 1;
+    }
+
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0)
+    {
+        FatalErrorAbort(errno, "pipe2");
+    }
+
+    UniqueFd stdinReadEnd{pipeFds[0]};
+    UniqueFd stdinWriteEnd{pipeFds[1]};
+    UniqueFd devNull{open("/dev/null", O_WRONLY | O_CLOEXEC)};
+    if (!devNull.IsValid())
+    {
+        FatalErrorAbort(errno, "open");
+    }
+
+    SpawnProcessRequest r{};
+    r.Flags = RequestFlagsRedirectStdin | RequestFlagsRedirectStdout;
+    r.ExecutablePath = "/bin/cat";
+    r.Argv.push_back("cat");
+    r.Argv.push_back(nullptr);
+
+    const int fds[] = {stdinReadEnd.Get(), devNull.Get()};
+    for (std::uint64_t i = 0; i < childCount; i++)
+    {
+        r.Token = i;
+        std::int32_t response[2];
+        if (!SendRequest(pSubchannel.get(), RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r), fds, 2)
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            PutFatalError(errno, "bench: spawn");
+            return 1;
+        }
+
+        if (response[0] != 0)
+        {
+            std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+            return 1;
+        }
+    }
+
+    const Stopwatch stopwatch;
+    stdinWriteEnd.Reset();
+    const long recvCount = pService->RecvExitNotifications(childCount);
+    const double elapsed = stopwatch.GetMilliseconds();
+    if (recvCount == -1)
+    {
+        return 1;
+    }
+
+    std::printf("exit-burst: %llu exits received with %ld recv calls in %.1f ms\n",
+        static_cast<unsigned long long>(childCount),
+        recvCount,
+        elapsed);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// ingest: Request ingest rate of a subchannel. A thread sends --count Signal requests for an unknown token
+// back to back, in chunks of 64 requests, while the main thread receives the responses.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "BinaryWriter.hpp"
+#include "MiscHelpers.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <vector>
+
+namespace
+{
+    const std::size_t RequestsPerChunk = 64;
+
+    struct SenderArgs final
+    {
+        AncillaryDataSocket* Subchannel;
+        std::vector<std::byte> Chunk;
+        std::uint64_t ChunkCount;
+    };
+
+    void* SenderThreadFunc(void* arg)
+    {
+        const auto pArgs = static_cast<SenderArgs*>(arg);
+        for (std::uint64_t i = 0; i < pArgs->ChunkCount; i++)
+        {
+            if (!pArgs->Subchannel->SendExactBytes(pArgs->Chunk.data(), pArgs->Chunk.size()))
+            {
+                FatalErrorAbort(errno, "bench: send");
+            }
+        }
+        return nullptr;
+    }
+} // namespace
+
+int RunIngestBench(BenchArgs args)
+{
+    const auto chunkCount = args.TakeNumber("count", 200000) / RequestsPerChunk;
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel)
+    {
+        return 1;
+    }
+
+    BinaryWriter bw;
+    bw.Write(std::uint64_t{999999});
+    bw.Write(static_cast<std::uint32_t>(AbstractSignal::Termination));
+    const auto body = bw.Detach();
+    const std::uint32_t header[2]{static_cast<std::uint32_t>(RequestCommand::SendSignal), static_cast<std::uint32_t>(body.size())};
+
+    SenderArgs sender{pSubchannel.get(), {}, chunkCount};
+    for (std::size_t i = 0; i < RequestsPerChunk; i++)
+    {
+        const auto pHeader = reinterpret_cast<const std::byte*>(header);
+        sender.Chunk.insert(sender.Chunk.end(), pHeader, pHeader + sizeof(header));
+        sender.Chunk.insert(sender.Chunk.end(), body.begin(), body.end());
+    }
+
+    const Stopwatch stopwatch;
+    auto maybeThread = CreateThreadWithMyDefault(SenderThreadFunc, &sender, 0);
+    if (!maybeThread)
+    {
+        FatalErrorAbort(errno, "pthread_create");
+    }
+
+    const auto count = chunkCount * RequestsPerChunk;
+    for (std::uint64_t i = 0; i < count; i++)
+    {
+        std::int32_t response[2];
+        if (!pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            FatalErrorAbort(errno, "bench: recv");
+        }
+    }
+
+    pthread_join(*maybeThread, nullptr);
+    const double elapsed = stopwatch.GetMilliseconds();
+    std::printf("ingest: %llu requests in %.1f ms (%.0f requests/s)\n",
+        static_cast<unsigned long long>(count),
+        elapsed,
+        count / elapsed * 1000);
+    return 0;
+}
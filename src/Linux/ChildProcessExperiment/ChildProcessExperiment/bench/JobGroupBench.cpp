@@ -0,0 +1,181 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// job-group: Get Job Group Stats on a group of --children processes, compared with reading /proc/PID/stat of each.
+// The group is left to the service, which must kill and remove it when it exits. Requires --job-group-root.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "BinaryWriter.hpp"
+#include "Globals.hpp"
+#include "JobGroup.hpp"
+#include "ServiceOptions.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <optional>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    // Returns the error code, or std::nullopt on a communication error. pStats: GetJobGroupStats only.
+    [[nodiscard]] std::optional<std::int32_t> SendJobGroupRequest(AncillaryDataSocket* pSubchannel, RequestCommand command,
+        const std::vector<std::uint32_t>& args, std::int32_t* pData, JobGroupStats* pStats = nullptr)
+    {
+        BinaryWriter bw;
+        for (const auto arg : args)
+        {
+            bw.Write(arg);
+        }
+
+        std::int32_t response[2];
+        if (!SendRequest(pSubchannel, command, bw.Detach())
+            || !pSubchannel->RecvExactBytes(response, sizeof(response))
+            || (response[0] == 0 && pStats != nullptr && !pSubchannel->RecvExactBytes(pStats, sizeof(*pStats))))
+        {
+            PutFatalError(errno, "bench: job group request");
+            return std::nullopt;
+        }
+
+        *pData = response[1];
+        return response[0];
+    }
+
+    // Counts the leaves this process has left in the job group root.
+    [[nodiscard]] int CountRemainingJobGroups(const char* root)
+    {
+        DIR* const dir = opendir(root);
+        if (dir == nullptr)
+        {
+            return -1;
+        }
+
+        const std::string prefix = "childprocess-" + std::to_string(getpid()) + "-";
+        int count = 0;
+        while (const dirent* entry = readdir(dir))
+        {
+            count += std::strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0 ? 1 : 0;
+        }
+
+        closedir(dir);
+        return count;
+    }
+} // namespace
+
+int RunJobGroupBench(BenchArgs args)
+{
+    const auto childCount = args.TakeNumber("children", 200);
+    const auto requestCount = std::max<std::uint64_t>(1, args.TakeNumber("requests", 1000));
+    auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    const char* const root = g_ServiceOptions.JobGroupRoot;
+    if (root == nullptr)
+    {
+        std::fprintf(stderr, "bench: job-group requires --job-group-root\n");
+        return 1;
+    }
+
+    const auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel)
+    {
+        return 1;
+    }
+
+    std::int32_t groupId = 0;
+    const auto maybeCreateError = SendJobGroupRequest(pSubchannel.get(), RequestCommand::CreateJobGroup, {}, &groupId);
+    if (!maybeCreateError)
+    {
+        return 1;
+    }
+    else if (*maybeCreateError != 0)
+    {
+        std::fprintf(stderr, "bench: CreateJobGroup failed: %d\n", *maybeCreateError);
+        return 1;
+    }
+
+    SpawnProcessRequest r{};
+    r.Flags = RequestFlagsJobGroup;
+    r.ExecutablePath = "/bin/sleep";
+    r.Argv.push_back("sleep");
+    r.Argv.push_back("100");
+    r.Argv.push_back(nullptr);
+    r.JobGroupId = static_cast<std::uint32_t>(groupId);
+
+    std::vector<int> pids;
+    for (std::uint64_t i = 0; i < childCount; i++)
+    {
+        r.Token = i;
+        std::int32_t response[2];
+        if (!SendRequest(pSubchannel.get(), RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r))
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            PutFatalError(errno, "bench: spawn");
+            return 1;
+        }
+
+        if (response[0] != 0)
+        {
+            std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+            return 1;
+        }
+        pids.push_back(response[1]);
+    }
+
+    JobGroupStats stats{};
+    const Stopwatch statsStopwatch;
+    for (std::uint64_t i = 0; i < requestCount; i++)
+    {
+        std::int32_t reserved;
+        const auto maybeStatsError = SendJobGroupRequest(
+            pSubchannel.get(), RequestCommand::GetJobGroupStats, {static_cast<std::uint32_t>(groupId)}, &reserved, &stats);
+        if (!maybeStatsError || *maybeStatsError != 0)
+        {
+            return 1;
+        }
+    }
+    const double statsElapsed = statsStopwatch.GetMilliseconds();
+
+    const Stopwatch procStopwatch;
+    for (std::uint64_t i = 0; i < requestCount; i++)
+    {
+        for (const int pid : pids)
+        {
+            char path[64];
+            char buf[1024];
+            std::snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+            const UniqueFd fd{open(path, O_RDONLY | O_CLOEXEC)};
+            if (!fd.IsValid() || read(fd.Get(), buf, sizeof(buf)) <= 0)
+            {
+                PutFatalError(errno, "bench: /proc/PID/stat");
+                return 1;
+            }
+        }
+    }
+    const double procElapsed = procStopwatch.GetMilliseconds();
+
+    std::printf("job-group: %llu children: GetJobGroupStats %.1f us/request, /proc/PID/stat of each %.1f us/pass"
+                " (usage %llu us, flags %x)\n",
+        static_cast<unsigned long long>(childCount),
+        statsElapsed * 1000 / static_cast<double>(requestCount),
+        procElapsed * 1000 / static_cast<double>(requestCount),
+        static_cast<unsigned long long>(stats.UsageMicroseconds),
+        static_cast<unsigned int>(stats.Flags));
+
+    // Let the service kill and remove the group.
+    pService.reset();
+    const int remainingCount = CountRemainingJobGroups(root);
+    if (remainingCount != 0)
+    {
+        std::fprintf(stderr, "bench: %d job groups remain after the service has exited\n", remainingCount);
+        return 1;
+    }
+
+    return 0;
+}
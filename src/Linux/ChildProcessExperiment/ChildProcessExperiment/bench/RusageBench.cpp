@@ -0,0 +1,85 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// rusage: Checks the extended exit notification. Spawns a shell that busy-loops and then sleeps for --sleep-ms,
+// and prints the resource usage and the wall time reported for it. Requires --exit-notification=extended.
+// Fails if the wall time is shorter than the sleep.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "Globals.hpp"
+#include "Service.hpp"
+#include "ServiceOptions.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <string>
+
+int RunRusageBench(BenchArgs args)
+{
+    const auto sleepMilliseconds = args.TakeNumber("sleep-ms", 300);
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    if (g_ServiceOptions.ExitNotifications != ExitNotificationFormat::Extended)
+    {
+        std::fprintf(stderr, "bench: rusage requires --exit-notification=extended\n");
+        return 1;
+    }
+
+    const auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel)
+    {
+        return 1;
+    }
+
+    const std::string script = "i=0; while [ $i -lt 300000 ]; do i=$((i+1)); done; sleep "
+        + std::to_string(sleepMilliseconds / 1000) + "." + std::to_string(sleepMilliseconds % 1000 + 1000).substr(1);
+    SpawnProcessRequest r{};
+    r.Token = 1;
+    r.Flags = 0;
+    r.ExecutablePath = "/bin/sh";
+    r.Argv.push_back("sh");
+    r.Argv.push_back("-c");
+    r.Argv.push_back(script.c_str());
+    r.Argv.push_back(nullptr);
+
+    std::int32_t response[2];
+    if (!SendRequest(pSubchannel.get(), RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r))
+        || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+    {
+        PutFatalError(errno, "bench: spawn");
+        return 1;
+    }
+
+    if (response[0] != 0)
+    {
+        std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+        return 1;
+    }
+
+    ExtendedChildExitNotification n;
+    if (!pService->GetMainChannel()->RecvExactBytes(&n, sizeof(n)))
+    {
+        PutFatalError(errno, "bench: recv");
+        return 1;
+    }
+
+    std::printf("rusage: status=%d user=%.1f ms sys=%.1f ms maxrss=%llu KiB in=%llu out=%llu wall=%.1f ms\n",
+        n.Status,
+        n.UserTimeMicroseconds / 1000.0,
+        n.SystemTimeMicroseconds / 1000.0,
+        static_cast<unsigned long long>(n.MaxRssKilobytes),
+        static_cast<unsigned long long>(n.InputBlocks),
+        static_cast<unsigned long long>(n.OutputBlocks),
+        n.WallTimeMicroseconds / 1000.0);
+
+    if (n.Token != r.Token || n.Status != 0 || n.WallTimeMicroseconds < sleepMilliseconds * 1000)
+    {
+        std::fprintf(stderr, "bench: unexpected notification\n");
+        return 1;
+    }
+
+    return 0;
+}
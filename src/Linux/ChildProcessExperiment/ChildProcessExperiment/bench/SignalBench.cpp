@@ -0,0 +1,209 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// signal: Signals --children children with one Signal request per child, and with one Signal Bulk request
+// for each target (tokens, all children, group tag). The children ignore SIGINT, so the default --signal=2
+// isolates the cost of the requests; --signal=9 includes the teardown of the children.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "BinaryWriter.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+namespace
+{
+    const std::uint32_t BenchGroupTag = 5;
+
+    [[nodiscard]] bool SpawnChildren(AncillaryDataSocket* pSubchannel, std::uint64_t firstToken, std::uint64_t count)
+    {
+        SpawnProcessRequest r{};
+        r.Flags = RequestFlagsGroupTag;
+        r.ExecutablePath = "/bin/sh";
+        r.Argv.push_back("sh");
+        r.Argv.push_back("-c");
+        r.Argv.push_back("trap '' INT; exec sleep 100");
+        r.Argv.push_back(nullptr);
+        r.GroupTag = BenchGroupTag;
+
+        for (std::uint64_t i = 0; i < count; i++)
+        {
+            r.Token = firstToken + i;
+            std::int32_t response[2];
+            if (!SendRequest(pSubchannel, RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r))
+                || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+            {
+                PutFatalError(errno, "bench: spawn");
+                return false;
+            }
+
+            if (response[0] != 0)
+            {
+                std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Returns the number of entries that succeeded, or -1 on error.
+    [[nodiscard]] long SendSignalBulk(AncillaryDataSocket* pSubchannel, std::uint32_t signal, SendSignalBulkTarget target,
+        std::uint64_t firstToken, std::uint64_t count)
+    {
+        BinaryWriter bw;
+        bw.Write(signal);
+        bw.Write(static_cast<std::uint32_t>(target));
+        if (target == SendSignalBulkTarget::Tokens)
+        {
+            bw.Write(static_cast<std::uint32_t>(count));
+            for (std::uint64_t i = 0; i < count; i++)
+            {
+                bw.Write(firstToken + i);
+            }
+        }
+        else if (target == SendSignalBulkTarget::GroupTag)
+        {
+            bw.Write(BenchGroupTag);
+        }
+
+        std::int32_t header[2];
+        if (!SendRequest(pSubchannel, RequestCommand::SendSignalBulk, bw.Detach())
+            || !pSubchannel->RecvExactBytes(header, sizeof(header)))
+        {
+            PutFatalError(errno, "bench: signal bulk");
+            return -1;
+        }
+
+        if (header[0] != 0)
+        {
+            std::fprintf(stderr, "bench: signal bulk failed: %d\n", header[0]);
+            return -1;
+        }
+
+        std::vector<std::byte> entries(static_cast<std::size_t>(header[1]) * 16);
+        if (!pSubchannel->RecvExactBytes(entries.data(), entries.size()))
+        {
+            PutFatalError(errno, "bench: signal bulk");
+            return -1;
+        }
+
+        long succeededCount = 0;
+        for (std::size_t i = 0; i < entries.size(); i += 16)
+        {
+            std::int32_t err;
+            std::memcpy(&err, &entries[i], sizeof(err));
+            succeededCount += err == 0 ? 1 : 0;
+        }
+
+        return succeededCount;
+    }
+
+    [[nodiscard]] bool SendSignals(AncillaryDataSocket* pSubchannel, std::uint32_t signal, std::uint64_t firstToken, std::uint64_t count)
+    {
+        for (std::uint64_t i = 0; i < count; i++)
+        {
+            BinaryWriter bw;
+            bw.Write(firstToken + i);
+            bw.Write(signal);
+            std::int32_t response[2];
+            if (!SendRequest(pSubchannel, RequestCommand::SendSignal, bw.Detach())
+                || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+            {
+                PutFatalError(errno, "bench: signal");
+                return false;
+            }
+
+            if (response[0] != 0)
+            {
+                std::fprintf(stderr, "bench: signal failed: %d\n", response[0]);
+                return false;
+            }
+        }
+
+        return true;
+    }
+} // namespace
+
+int RunSignalBench(BenchArgs args)
+{
+    const auto childCount = args.TakeNumber("children", 2000);
+    const auto signal = static_cast<std::uint32_t>(args.TakeNumber("signal", static_cast<std::uint64_t>(AbstractSignal::Interrupt)));
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    const auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel)
+    {
+        return 1;
+    }
+
+    const struct
+    {
+        const char* Name;
+        bool IsBulk;
+        SendSignalBulkTarget Target;
+    } methods[] = {
+        {"single", false, SendSignalBulkTarget::Tokens},
+        {"bulk tokens", true, SendSignalBulkTarget::Tokens},
+        {"bulk all", true, SendSignalBulkTarget::AllChildren},
+        {"bulk group tag", true, SendSignalBulkTarget::GroupTag},
+    };
+
+    for (std::size_t i = 0; i < std::size(methods); i++)
+    {
+        const auto& method = methods[i];
+        const std::uint64_t firstToken = i * childCount;
+        if (!SpawnChildren(pSubchannel.get(), firstToken, childCount))
+        {
+            return 1;
+        }
+
+        const Stopwatch stopwatch;
+        if (method.IsBulk)
+        {
+            const long succeededCount = SendSignalBulk(pSubchannel.get(), signal, method.Target, firstToken, childCount);
+            if (succeededCount == -1)
+            {
+                return 1;
+            }
+
+            if (static_cast<std::uint64_t>(succeededCount) != childCount)
+            {
+                std::fprintf(stderr, "bench: %s signaled %ld of %llu children\n",
+                    method.Name, succeededCount, static_cast<unsigned long long>(childCount));
+                return 1;
+            }
+        }
+        else if (!SendSignals(pSubchannel.get(), signal, firstToken, childCount))
+        {
+            return 1;
+        }
+
+        const double elapsed = stopwatch.GetMilliseconds();
+
+        // Make sure that every child exits before the next method.
+        const auto killSignal = static_cast<std::uint32_t>(AbstractSignal::Kill);
+        if (signal != killSignal && SendSignalBulk(pSubchannel.get(), killSignal, SendSignalBulkTarget::AllChildren, 0, 0) == -1)
+        {
+            return 1;
+        }
+
+        if (pService->RecvExitNotifications(childCount) == -1)
+        {
+            return 1;
+        }
+
+        std::printf("signal: %s: %llu children in %.1f ms (until the responses)\n",
+            method.Name,
+            static_cast<unsigned long long>(childCount),
+            elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// spawn: Spawn throughput with concurrent clients, each spawning synchronously on its own subchannel.
+// Compare --subchannel-mode=pool with --spawn-executor=inline and work-stealing, and vary the number of cores
+// with taskset and --spawn-workers. The scaling sweep runs each executor at taskset -c 0-(N-1) for N = 1, 2, 4, ...
+// with --clients=N and --clients=2N; the last field of the output reports the CPUs the bench actually ran on.
+// --ballast-mib=N makes the helper touch N MiB of memory after it has started, which fork has to copy
+// the page tables of. Compare --spawn-method=fork with zygote.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "MiscHelpers.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    struct ClientArgs final
+    {
+        std::unique_ptr<AncillaryDataSocket> Subchannel;
+        const char* ExecutablePath;
+        std::uint64_t FirstToken;
+        std::uint64_t Count;
+        bool Succeeded;
+    };
+
+    void* ClientThreadFunc(void* arg)
+    {
+        const auto pArgs = static_cast<ClientArgs*>(arg);
+
+        SpawnProcessRequest r{};
+        r.Flags = 0;
+        r.ExecutablePath = pArgs->ExecutablePath;
+        r.Argv.push_back(pArgs->ExecutablePath);
+        r.Argv.push_back(nullptr);
+
+        for (std::uint64_t i = 0; i < pArgs->Count; i++)
+        {
+            r.Token = pArgs->FirstToken + i;
+            std::int32_t response[2];
+            if (!SendRequest(pArgs->Subchannel.get(), RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r))
+                || !pArgs->Subchannel->RecvExactBytes(response, sizeof(response)))
+            {
+                PutFatalError(errno, "bench: spawn");
+                return nullptr;
+            }
+
+            if (response[0] != 0)
+            {
+                std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+                return nullptr;
+            }
+        }
+
+        pArgs->Succeeded = true;
+        return nullptr;
+    }
+} // namespace
+
+int RunSpawnBench(BenchArgs args)
+{
+    const auto count = args.TakeNumber("count", 2000);
+    const auto clientCount = std::max<std::uint64_t>(1, args.TakeNumber("clients", 1));
+    const char* const executablePath = args.TakeString("executable", "/bin/true");
+    const auto ballastBytes = args.TakeNumber("ballast-mib", 0) << 20;
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    // After the zygote has been started.
+    std::vector<char> ballast(ballastBytes, 1);
+
+    std::vector<ClientArgs> clients(clientCount);
+    for (std::uint64_t i = 0; i < clientCount; i++)
+    {
+        clients[i].Subchannel = pService->CreateSubchannel();
+        if (!clients[i].Subchannel)
+        {
+            return 1;
+        }
+
+        clients[i].ExecutablePath = executablePath;
+        clients[i].FirstToken = i * count;
+        clients[i].Count = count / clientCount + (i < count % clientCount ? 1 : 0);
+        clients[i].Succeeded = false;
+    }
+
+    const Stopwatch stopwatch;
+    std::vector<pthread_t> threads;
+    for (auto& client : clients)
+    {
+        auto maybeThread = CreateThreadWithMyDefault(ClientThreadFunc, &client, 0);
+        if (!maybeThread)
+        {
+            FatalErrorAbort(errno, "pthread_create");
+        }
+        threads.push_back(*maybeThread);
+    }
+
+    bool succeeded = pService->RecvExitNotifications(count) != -1;
+    for (std::size_t i = 0; i < threads.size(); i++)
+    {
+        pthread_join(threads[i], nullptr);
+        succeeded = succeeded && clients[i].Succeeded;
+    }
+
+    const double elapsed = stopwatch.GetMilliseconds();
+    if (!succeeded)
+    {
+        return 1;
+    }
+
+    cpu_set_t cpus;
+    const int usableCpuCount = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : -1;
+    std::printf("spawn: %llu spawns by %llu clients in %.1f ms (%.0f spawns/s, %.3f ms/spawn per client), %d of %ld CPUs\n",
+        static_cast<unsigned long long>(count),
+        static_cast<unsigned long long>(clientCount),
+        elapsed,
+        count / elapsed * 1000,
+        elapsed / (count / static_cast<double>(clientCount)),
+        usableCpuCount,
+        sysconf(_SC_NPROCESSORS_ONLN));
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// state-map: Lock contention of ChildProcessStateMap. Each thread registers, looks up and deletes entries
+// with fake PIDs as spawns, signal requests and the reaper do, keeping --live entries registered.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "ChildProcessState.hpp"
+#include "MiscHelpers.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <pthread.h>
+#include <vector>
+
+namespace
+{
+    struct WorkerArgs final
+    {
+        ChildProcessStateMap* Map;
+        int FirstPid;
+        std::uint64_t Operations;
+        std::uint64_t LiveCount;
+        bool UsesServiceAssignedTokens;
+    };
+
+    void* WorkerThreadFunc(void* arg)
+    {
+        const auto pArgs = static_cast<WorkerArgs*>(arg);
+        const auto pMap = pArgs->Map;
+        std::vector<std::shared_ptr<ChildProcessState>> live(pArgs->LiveCount);
+        for (std::uint64_t i = 0; i < pArgs->Operations; i++)
+        {
+            auto& pState = live[i % live.size()];
+            if (pState)
+            {
+                // The reaper.
+                if (pMap->GetByPid(pState->GetPid()).get() != pState.get())
+                {
+                    FatalErrorAbort("GetByPid");
+                }
+                static_cast<void>(pMap->Delete(pState.get()));
+            }
+
+            // A spawn and a signal request.
+            const int pid = pArgs->FirstPid + static_cast<int>(i % live.size());
+            pState = pArgs->UsesServiceAssignedTokens
+                ? pMap->AllocateWithServiceAssignedToken(pid, UniqueFd{}, 0)
+                : pMap->Allocate(pid, UniqueFd{}, (static_cast<std::uint64_t>(pArgs->FirstPid) << 20) + i, 0);
+            if (pMap->GetByToken(pState->GetToken()).get() != pState.get())
+            {
+                FatalErrorAbort("GetByToken");
+            }
+        }
+
+        for (const auto& pState : live)
+        {
+            if (pState)
+            {
+                static_cast<void>(pMap->Delete(pState.get()));
+            }
+        }
+
+        return nullptr;
+    }
+} // namespace
+
+int RunStateMapBench(BenchArgs args)
+{
+    const auto threadCount = std::max<std::uint64_t>(1, args.TakeNumber("threads", 4));
+    const auto operations = args.TakeNumber("operations", 1000000);
+    const auto liveCount = std::max<std::uint64_t>(1, args.TakeNumber("live", 64));
+    const bool usesServiceAssignedTokens = args.TakeNumber("service-assigned-tokens", 0) != 0;
+
+    const auto pMap = std::make_unique<ChildProcessStateMap>();
+    std::vector<WorkerArgs> workers(threadCount);
+    for (std::uint64_t i = 0; i < threadCount; i++)
+    {
+        // Disjoint PIDs and client tokens per thread.
+        workers[i] = {pMap.get(), static_cast<int>((i + 1) << 22), operations / threadCount, liveCount, usesServiceAssignedTokens};
+    }
+
+    const Stopwatch stopwatch;
+    std::vector<pthread_t> threads;
+    for (auto& worker : workers)
+    {
+        auto maybeThread = CreateThreadWithMyDefault(WorkerThreadFunc, &worker, 0);
+        if (!maybeThread)
+        {
+            FatalErrorAbort(errno, "pthread_create");
+        }
+        threads.push_back(*maybeThread);
+    }
+
+    for (const auto thread : threads)
+    {
+        pthread_join(thread, nullptr);
+    }
+
+    const double elapsed = stopwatch.GetMilliseconds();
+    const auto totalOperations = operations / threadCount * threadCount;
+    std::printf("state-map: %llu spawn/signal/reap cycles on %llu threads in %.1f ms (%.0f ns/cycle)\n",
+        static_cast<unsigned long long>(totalOperations),
+        static_cast<unsigned long long>(threadCount),
+        elapsed,
+        elapsed * 1e6 / static_cast<double>(totalOperations));
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// timer-wheel: Adds --timers timers spread over --span-ms ticks and advances to each next event until all
+// have expired, with TimerWheel and with a std::multimap.
+
+#include "Bench.hpp"
+#include "TimerWheel.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+int RunTimerWheelBench(BenchArgs args)
+{
+    const auto timerCount = args.TakeNumber("timers", 1000000);
+    const auto span = std::max<std::uint64_t>(1, args.TakeNumber("span-ms", 600000));
+
+    std::mt19937_64 rng{1};
+    std::vector<std::uint64_t> expiries(timerCount);
+    for (auto& expiry : expiries)
+    {
+        expiry = 1 + rng() % span;
+    }
+
+    {
+        const Stopwatch stopwatch;
+        TimerWheel<std::uint64_t> wheel{0};
+        for (std::uint64_t i = 0; i < timerCount; i++)
+        {
+            wheel.Add(expiries[i], i);
+        }
+
+        std::vector<std::uint64_t> expired;
+        std::uint64_t now = 0;
+        while (!wheel.IsEmpty())
+        {
+            now = std::max(now + 1, *wheel.GetNextEventTime());
+            wheel.Advance(now, &expired);
+            expired.clear();
+        }
+
+        std::printf("timer-wheel: wheel: %.1f ms\n", stopwatch.GetMilliseconds());
+    }
+
+    {
+        const Stopwatch stopwatch;
+        std::multimap<std::uint64_t, std::uint64_t> timers;
+        for (std::uint64_t i = 0; i < timerCount; i++)
+        {
+            timers.emplace(expiries[i], i);
+        }
+
+        while (!timers.empty())
+        {
+            timers.erase(timers.begin(), timers.upper_bound(timers.begin()->first));
+        }
+
+        std::printf("timer-wheel: multimap: %.1f ms\n", stopwatch.GetMilliseconds());
+    }
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// zygote-exit: Kills the zygote and checks that the service reaps it and that spawns fall back to fork.
+// Requires --spawn-method=zygote. Run with each --reaper; fails if the zygote is not reaped within --timeout-ms.
+
+#include "Bench.hpp"
+#include "Base.hpp"
+#include "Zygote.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <signal.h>
+#include <unistd.h>
+
+namespace
+{
+    [[nodiscard]] bool SpawnTrue(BenchService* pService, AncillaryDataSocket* pSubchannel, std::uint64_t token)
+    {
+        SpawnProcessRequest r{};
+        r.Token = token;
+        r.Flags = 0;
+        r.ExecutablePath = "/bin/true";
+        r.Argv.push_back("true");
+        r.Argv.push_back(nullptr);
+
+        std::int32_t response[2];
+        if (!SendRequest(pSubchannel, RequestCommand::SpawnProcess, SerializeSpawnProcessRequest(r))
+            || !pSubchannel->RecvExactBytes(response, sizeof(response)))
+        {
+            PutFatalError(errno, "bench: spawn");
+            return false;
+        }
+
+        if (response[0] != 0)
+        {
+            std::fprintf(stderr, "bench: spawn failed: %d\n", response[0]);
+            return false;
+        }
+
+        return pService->RecvExitNotifications(1) != -1;
+    }
+} // namespace
+
+int RunZygoteExitBench(BenchArgs args)
+{
+    const auto timeoutMilliseconds = args.TakeNumber("timeout-ms", 5000);
+    const auto pService = BenchService::Start(args);
+    if (!pService)
+    {
+        return 1;
+    }
+
+    const int zygotePid = GetZygotePid();
+    if (zygotePid == -1)
+    {
+        std::fprintf(stderr, "bench: zygote-exit requires --spawn-method=zygote\n");
+        return 1;
+    }
+
+    const auto pSubchannel = pService->CreateSubchannel();
+    if (!pSubchannel || !SpawnTrue(pService.get(), pSubchannel.get(), 1))
+    {
+        return 1;
+    }
+
+    if (kill(zygotePid, SIGKILL) == -1)
+    {
+        FatalErrorAbort(errno, "kill");
+    }
+
+    // kill(pid, 0) succeeds until the zombie has been reaped.
+    const Stopwatch stopwatch;
+    while (kill(zygotePid, 0) == 0)
+    {
+        if (stopwatch.GetMilliseconds() > static_cast<double>(timeoutMilliseconds))
+        {
+            std::fprintf(stderr, "bench: the zygote was not reaped within %llu ms\n", static_cast<unsigned long long>(timeoutMilliseconds));
+            return 1;
+        }
+
+        usleep(1000);
+    }
+    const double elapsed = stopwatch.GetMilliseconds();
+
+    if (IsZygoteAvailable())
+    {
+        std::fprintf(stderr, "bench: the zygote was reaped but is still marked available\n");
+        return 1;
+    }
+
+    // Falls back to fork.
+    if (!SpawnTrue(pService.get(), pSubchannel.get(), 2))
+    {
+        return 1;
+    }
+
+    std::printf("zygote-exit: reaped in %.1f ms; spawns fall back to fork\n", elapsed);
+    return 0;
+}
@@ -3,8 +3,12 @@
 #include "AncillaryDataSocket.hpp"
 #include "Base.hpp"
 #include "Client.hpp"
+#include "Globals.hpp"
 #include "MiscHelpers.hpp"
 #include "Service.hpp"
+#include "ServiceOptions.hpp"
+#include "SignalHandler.hpp"
+#include "Zygote.hpp"
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
@@ -28,6 +32,24 @@ void* ServiceThreadFunc(void* arg);
 
 int main(int argc, const char** argv)
 {
+    // Usage: ChildProcessExperiment [options]
+    if (!ParseServiceOptions(&g_ServiceOptions, argc - 1, argv + 1))
+    {
+        return 1;
+    }
+
+    if (g_ServiceOptions.DefaultSpawnMethod == SpawnMethod::Zygote && !StartZygote())
+    {
+        PutFatalError(errno, "StartZygote");
+        return 1;
+    }
+
+    if (g_ServiceOptions.SignalIntake == SignalIntakeMode::SignalFd)
+    {
+        // The client thread must not receive the signals either.
+        BlockSignalFdSignals();
+    }
+
     auto maybeSocketPair = CreateUnixStreamSocketPair();
     if (!maybeSocketPair)
     {
@@ -0,0 +1,107 @@
+// Copyright (c) @asmichi (https://github.com/asmichi). Licensed under the MIT License. See LICENCE in the project root for details.
+
+// Cross-checks TimerWheel against a std::multimap with random timers, including expiries near and beyond
+// the rotation of the highest level.
+
+#include "TimerWheel.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace
+{
+    const int RoundCount = 200;
+    const int StepCount = 2000;
+
+    [[nodiscard]] std::uint64_t MakeDelay(std::mt19937_64& rng)
+    {
+        switch (rng() % 4)
+        {
+        case 0:
+            return rng() % 64;
+        case 1:
+            return rng() % 100000;
+        case 2:
+            return rng() % (std::uint64_t{1} << 32);
+        default:
+            return rng() % (std::uint64_t{1} << 38);
+        }
+    }
+
+    [[nodiscard]] bool RunRound(std::mt19937_64& rng, int round)
+    {
+        // Every third round starts just before the highest level wraps around.
+        const std::uint64_t start = round % 3 == 0
+            ? (std::uint64_t{1} << 36) - rng() % 5000
+            : rng() % (std::uint64_t{1} << 40);
+        TimerWheel<int> wheel{start};
+        std::multimap<std::uint64_t, int> reference;
+        std::uint64_t now = start;
+        int nextId = 0;
+        std::vector<int> actual;
+        std::vector<int> expected;
+        for (int step = 0; step < StepCount; step++)
+        {
+            const int addCount = static_cast<int>(rng() % 5);
+            for (int i = 0; i < addCount; i++)
+            {
+                const std::uint64_t expiry = now + MakeDelay(rng);
+                wheel.Add(expiry, nextId);
+                reference.emplace(expiry, nextId);
+                nextId++;
+            }
+
+            const auto maybeNextEventTime = wheel.GetNextEventTime();
+            if (!reference.empty() && (!maybeNextEventTime || *maybeNextEventTime > reference.begin()->first))
+            {
+                std::fprintf(stderr, "round %d step %d: next event time later than the earliest expiry\n", round, step);
+                return false;
+            }
+
+            const std::uint64_t next = now + (rng() % 2 != 0 ? rng() % 100 : rng() % (std::uint64_t{1} << 34));
+            actual.clear();
+            wheel.Advance(next, &actual);
+            expected.clear();
+            while (!reference.empty() && reference.begin()->first <= next)
+            {
+                expected.push_back(reference.begin()->second);
+                reference.erase(reference.begin());
+            }
+
+            std::sort(actual.begin(), actual.end());
+            std::sort(expected.begin(), expected.end());
+            if (actual != expected)
+            {
+                std::fprintf(stderr, "round %d step %d: %zu timers expired, expected %zu\n", round, step, actual.size(), expected.size());
+                return false;
+            }
+
+            if (wheel.IsEmpty() != reference.empty())
+            {
+                std::fprintf(stderr, "round %d step %d: IsEmpty mismatch\n", round, step);
+                return false;
+            }
+
+            now = next;
+        }
+
+        return true;
+    }
+} // namespace
+
+int main()
+{
+    std::mt19937_64 rng{1};
+    for (int round = 0; round < RoundCount; round++)
+    {
+        if (!RunRound(rng, round))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}